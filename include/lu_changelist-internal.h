@@ -37,47 +37,65 @@ typedef struct lu_event_change_s {
 	 * and write_change is unused. */
     lu_uint8_t read_change;
     lu_uint8_t write_change;
+    /* The change for LU_EV_CLOSED (EPOLLRDHUP on epoll). */
     lu_uint8_t error_change;
 }lu_event_change_t;
 
+/** The changes queued on a base since its last dispatch, at most one per
+ * fd.  Owned by the base; only used by backends that opt in. */
+typedef struct lu_event_changelist_s{
+    lu_event_change_t *changes;
+    int n_changes;
+	int changes_size;
+}lu_event_changelist_t;
+
+/** The fdinfo a changelist backend keeps in each io map slot: the index
+ * (plus one) of the fd's entry in the changelist, or 0 if it has none. */
+typedef struct lu_event_changelist_fdinfo_s{
+    int idxplus1;
+}lu_event_changelist_fdinfo_t;
+
 
 
 
 /* Flags for read_change and write_change. */
 
-// /* If set, add the event. */
-// #define EV_CHANGE_ADD     0x01
-// /* If set, delete the event.  Exclusive with EV_CHANGE_ADD */
-// #define EV_CHANGE_DEL     0x02
-// /* If set, this event refers a signal, not an fd. */
-// #define EV_CHANGE_SIGNAL  EV_SIGNAL
-// /* Set for persistent events.  Currently not used. */
-// #define EV_CHANGE_PERSIST EV_PERSIST
-// /* Set for adding edge-triggered events. */
-// #define EV_CHANGE_ET      EV_ET
+/* If set, add the event. */
+#define LU_EV_CHANGE_ADD     0x01
+/* If set, delete the event.  Exclusive with LU_EV_CHANGE_ADD */
+#define LU_EV_CHANGE_DEL     0x02
+/* If set, this event refers a signal, not an fd. */
+#define LU_EV_CHANGE_SIGNAL  LU_EV_SIGNAL
+/* Set for persistent events.  Currently not used. */
+#define LU_EV_CHANGE_PERSIST LU_EV_PERSIST
+/* Set for adding edge-triggered events. */
+#define LU_EV_CHANGE_ET      LU_EV_ET
+/* Set for adding exclusive-wakeup events. */
+#define LU_EV_CHANGE_EXCLUSIVE LU_EV_EXCLUSIVE
 
 
 
 /* The value of fdinfo_size that a backend should use if it is letting
  * changelist handle its add and delete functions. */
-// #define EVENT_CHANGELIST_FDINFO_SIZE sizeof(int)
-
-
-//TODO: to be implemented
-// /** Set up the data fields in a changelist. */
-// void lu_event_changelist_init_(lu_event_changelist_t *changelist);
-// /** Remove every change in the changelist, and make corresponding changes
-//  * in the event maps in the base.  This function is generally used right
-//  * after making all the changes in the changelist. */
-// void lu_event_changelist_remove_all_(lu_event_changelist_t *changelist, lu_event_base_t *base);
-// /** Free all memory held in a changelist. */
-// void lu_event_changelist_freemem_(lu_event_changelist_t *changelist);
-
-// /** Implementation of eventop_add that queues the event in a changelist. */
-// int lu_event_changelist_add_(lu_event_base_t *base, lu_evutil_socket_t fd, short old, short events,
-//     void *p);
-// /** Implementation of eventop_del that queues the event in a changelist. */
-// int lu_event_changelist_del_(lu_event_base_t *base, lu_evutil_socket_t fd, short old, short events,
-//     void *p);
+#define LU_EVENT_CHANGELIST_FDINFO_SIZE sizeof(lu_event_changelist_fdinfo_t)
+
+struct lu_event_base_s;
+
+/** Set up the data fields in a changelist. */
+void lu_event_changelist_init_(lu_event_changelist_t *changelist);
+/** Remove every change in the changelist, and make corresponding changes
+ * in the event maps in the base.  This function is generally used right
+ * after making all the changes in the changelist. */
+void lu_event_changelist_remove_all_(lu_event_changelist_t *changelist,
+    struct lu_event_base_s *base);
+/** Free all memory held in a changelist. */
+void lu_event_changelist_freemem_(lu_event_changelist_t *changelist);
+
+/** Implementation of eventop_add that queues the event in a changelist. */
+int lu_event_changelist_add_(struct lu_event_base_s *base, lu_evutil_socket_t fd,
+    short old, short events, void *p);
+/** Implementation of eventop_del that queues the event in a changelist. */
+int lu_event_changelist_del_(struct lu_event_base_s *base, lu_evutil_socket_t fd,
+    short old, short events, void *p);
 
 #endif /* LU_CHANGELIST_INTERNAL_H */
\ No newline at end of file
@@ -10,12 +10,17 @@ extern "C" {
 
 
 #include <sys/queue.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
 #include "lu_util.h"
 #include <sys/time.h>
 #include "lu_mm-internal.h"
 #include "lu_changelist-internal.h"
 
-TAILQ_HEAD(lu_evcallback_list, lu_event_callback_t);
+TAILQ_HEAD(lu_evcallback_list, lu_event_callback_s);
+LIST_HEAD(lu_event_dlist, lu_event_s);
+TAILQ_HEAD(lu_event_tqlist, lu_event_s);
 
 
 typedef struct lu_event_base_s lu_event_base_t;
@@ -69,56 +74,178 @@ typedef enum lu_event_base_config_flag_u {
     */
     LU_EVENT_BASE_FLAG_USE_SIGNALFD = 0x80,
 
-}lu_event_base_config_flag_t;
-
-//TODO:
+    /** Before blocking in the backend, spin on zero-timeout waits for a
+     * budget (see lu_event_config_set_busy_poll(), 50us by default), so
+     * that events arriving soon are picked up without a sleep/wake round
+     * trip.  Trades CPU for latency; meant for loops on dedicated cores.
+     */
+    LU_EVENT_BASE_FLAG_BUSY_POLL = 0x100,
 
+}lu_event_base_config_flag_t;
 
-typedef struct lu_event_changelist_s{
 
-    lu_event_change_t *changes;
-    int n_changes;
-	int changes_size;
-}lu_event_changelist_t;
 
+/**
+ * A registered common timeout duration.  Events added with the magic
+ * timeval returned by lu_event_base_init_common_timeout() are kept in the
+ * base's timing wheel instead of the min-heap.
+ */
+typedef struct lu_common_timeout_list_s {
+    /* The duration of every event using this list, with the magic bits
+     * and index encoded in tv_usec; this is what callers get back. */
+    struct timeval duration;
+    /* The base this list belongs to. */
+    struct lu_event_base_s *base;
+}lu_common_timeout_list_t;
 
-typedef struct lu_evsig_info_s{
-    //TODO:
-    int summyl;
-}lu_evsig_info_t;
+/**
+ * @name Timing wheel geometry
+ * LU_TIMER_WHEEL_LEVELS levels of 2^LU_TIMER_WHEEL_BITS slots each.  A tick
+ * is LU_TIMER_WHEEL_TICK_USEC microseconds, so level L slots cover
+ * 2^(LU_TIMER_WHEEL_BITS*L) ticks.
+ * @{
+ */
+#define LU_TIMER_WHEEL_BITS         6
+#define LU_TIMER_WHEEL_SLOTS        (1 << LU_TIMER_WHEEL_BITS)
+#define LU_TIMER_WHEEL_LEVELS       5
+#define LU_TIMER_WHEEL_TICK_USEC    1000
+/* The longest duration (in ticks) the wheel can hold without slots of the
+ * top level aliasing each other. */
+#define LU_TIMER_WHEEL_MAX_TICKS    \
+    ((1ULL << (LU_TIMER_WHEEL_BITS * LU_TIMER_WHEEL_LEVELS)) - \
+     (1ULL << (LU_TIMER_WHEEL_BITS * (LU_TIMER_WHEEL_LEVELS - 1))))
+/** @} */
 
+/**
+ * Hierarchical timing wheel.  An event expiring at tick e lives on level L,
+ * where L is the highest LU_TIMER_WHEEL_BITS-bit group in which e differs
+ * from the current tick, in slot (e >> (LU_TIMER_WHEEL_BITS*L)).  Slots of
+ * a higher level are cascaded down when the current tick enters them, so an
+ * event's slot can always be recomputed from its expiry, and insert and
+ * remove are O(1).  See lu_timer_wheel-internal.h.
+ */
+typedef struct lu_timer_wheel_s {
+    struct lu_event_tqlist slots[LU_TIMER_WHEEL_LEVELS][LU_TIMER_WHEEL_SLOTS];
+    /* Bit s of occupied[L] is set iff slots[L][s] is not empty. */
+    lu_uint64_t occupied[LU_TIMER_WHEEL_LEVELS];
+    /* Events whose expiry tick is not after now_tick. */
+    struct lu_event_tqlist due;
+    /* The tick the wheel has been advanced to. */
+    lu_uint64_t now_tick;
+    /* Number of events on the wheel, including the due list. */
+    int count;
+}lu_timer_wheel_t;
 
-typedef struct lu_common_timeout_list_s {
-	//TODO:
-    int paser;
-}lu_common_timeout_list_t;
+/**
+ * Allocator for objects of one size, carved from cache-line-aligned slabs
+ * with an intrusive free list.  See lu_slab-internal.h.
+ */
+typedef struct lu_slab_s {
+    size_t obj_size;
+    /* Free objects; the first word of each points to the next. */
+    void *free_list;
+    /* Every slab; the first word of each points to the next. */
+    void *slabs;
+    /* Objects in all slabs, and how many of them are free. */
+    size_t nobjs;
+    size_t nfree;
+}lu_slab_t;
 
 
 
+/**
+ * Mapping from file descriptor to the events that are added on it.
+ * On Linux fds are small dense integers, so the slots are stored inline in
+ * one flat array indexed by fd: finding the slot for a ready fd is a single
+ * multiply-and-add, with no hashing and no pointer to follow.
+ */
 typedef struct lu_event_io_map_s {
-    //TODO:
-    int summyl;
+    /* nentries slots of entry_size bytes each.  A slot is an lu_evmap_io_t
+     * followed by the backend's fdinfo. */
+    void *entries;
+    /* The number of entries available in entries. */
+    int nentries;
+    /* Size of one slot: a power of two, so that with the cache-line
+     * aligned array no slot of up to a cache line straddles two lines. */
+    int entry_size;
 }lu_event_io_map_t;
 
+/**
+ * Mapping from signal number to the events that are added on it.  Signals
+ * are few and rarely looked up, so this is a plain array of
+ * lu_evmap_signal_t*, indexed by signal number.
+ */
 typedef struct lu_event_signal_map_s{
-    //TODO:
-    int summyl;
+    /* An array of lu_evmap_signal_t*, indexed by signal number. */
+    void **entries;
+    /* The number of entries available in entries. */
+    int nentries;
 }lu_event_signal_map_t;
 
-typedef struct min_heap {
-    //TODO:
-    int paser;
-}min_heap_t;
+/** A slot of the timeout heap: the expiry is kept inline next to the event
+ * so that sifting compares keys without touching the events. */
+typedef struct lu_min_heap_entry_s {
+    lu_int64_t key;//ev_timeout in microseconds
+    struct lu_event_s *ev;
+}lu_min_heap_entry_t;
+
+/** 4-ary min-heap of events with timeouts. See lu_min_heap.h. */
+typedef struct lu_min_heap_s {
+    lu_min_heap_entry_t *elements;
+    lu_size_t n;
+    lu_size_t capacity;
+}lu_min_heap_t;
 
 typedef struct evutil_weakrand_state_s{
     //TODO:
     int summy;
 } evutil_weakrand_state_t;
 
-typedef struct evwatch_list_s{
-    //TODO:
-    int summy;
-}evwatch_list_t;
+/**
+ * @name Watchers
+ * Callbacks run by the loop on every iteration: "prepare" watchers right
+ * before the backend waits for events, "check" watchers right after.
+ * See lu_evwatch_prepare_new().
+ * @{
+ */
+#define LU_EVWATCH_PREPARE  0
+#define LU_EVWATCH_CHECK    1
+
+/** What a prepare watcher is told about the coming wait. */
+typedef struct lu_evwatch_prepare_cb_info_s {
+    /** The longest the backend will wait, or NULL for no limit. */
+    const struct timeval *timeout;
+}lu_evwatch_prepare_cb_info_t;
+
+/** What a check watcher is told about the wait that just returned. */
+typedef struct lu_evwatch_check_cb_info_s {
+    /** How long the backend wait took, blocked time included. */
+    struct timeval poll_duration;
+    /** Callbacks the wait (and other threads' activations) made active. */
+    int nready;
+}lu_evwatch_check_cb_info_t;
+
+struct lu_evwatch_s;
+typedef void (*lu_evwatch_prepare_cb)(struct lu_evwatch_s *,
+    const lu_evwatch_prepare_cb_info_t *, void *);
+typedef void (*lu_evwatch_check_cb)(struct lu_evwatch_s *,
+    const lu_evwatch_check_cb_info_t *, void *);
+
+typedef struct lu_evwatch_s {
+    TAILQ_ENTRY(lu_evwatch_s) next;
+    struct lu_event_base_s *base;
+    /* LU_EVWATCH_PREPARE or LU_EVWATCH_CHECK */
+    unsigned type;
+    union {
+        lu_evwatch_prepare_cb prepare;
+        lu_evwatch_check_cb check;
+    } callback;
+    void *arg;
+}lu_evwatch_t;
+
+TAILQ_HEAD(evwatch_list_s, lu_evwatch_s);
+typedef struct evwatch_list_s evwatch_list_t;
+/** @} */
 
 
  
@@ -128,6 +255,8 @@ typedef struct lu_event_callback_s{
   
     TAILQ_ENTRY(lu_event_callback_s) evcb_active_next;
     short evcb_events;
+    /** LU_EVLIST_* flags describing which lists this callback is on. */
+    short evcb_flags;
     
     //Smaller numbers are higher priority.
     lu_uint8_t evcb_pri;//优先级
@@ -144,6 +273,16 @@ typedef struct lu_event_callback_s{
     }evcb_cb_union;
     void *evcb_arg;//回调函数的参数
 
+    /** Link on the base's cross-thread activation queue, and the result
+     * bits accumulated while the callback is on it (0 when it is not).
+     * LU_EVCB_ASYNC_CANCELLED in the result drops the bits queued before
+     * it; the loop skips a callback with nothing else set. */
+    struct lu_event_callback_s *evcb_async_next;
+    short evcb_async_res;
+    /** When the callback was last made active, while the base traces
+     * callbacks; see lu_event_base_trace_callbacks(). */
+    struct timeval evcb_activated;
+
 }lu_event_callback_t;
 
 
@@ -156,6 +295,7 @@ typedef struct lu_event_s{
         TAILQ_ENTRY(lu_event_s) ev_next_with_common_timeout;
         lu_size_t min_heap_idx;//该事件在最小堆（min heap）中的索引，用于快速查找最早的超时事件。
     }ev_timeout_pos;
+    lu_evutil_socket_t ev_fd;
     short ev_events;
     short ev_res;//result passed to event callback
 
@@ -170,7 +310,7 @@ typedef struct lu_event_s{
         //used for signal events
         struct{
             LIST_ENTRY(lu_event_s) ev_signal_next;
-            short ev_signum;
+            short ev_ncalls;
             //Allow deletes in signal callback
             short* ev_pncalls; 
         }ev_signal;
@@ -181,8 +321,134 @@ typedef struct lu_event_s{
 
 }lu_event_t;
 
+/** A one-shot event from lu_event_base_once().  Records come from the
+ * base's once_slab and go back to it right after the callback runs. */
+typedef struct lu_event_once_s {
+    LIST_ENTRY(lu_event_once_s) next_once;
+    lu_event_t ev;
+    void (*cb)(lu_evutil_socket_t, short, void *);
+    void *arg;
+}lu_event_once_t;
+
+
+/**
+ * State shared by the signal backends (see lu_evsignal-internal.h).  The
+ * sigaction backend uses a self-pipe written from the signal handler; the
+ * signalfd backend reads every signal through one signalfd.  Either way
+ * ev_signal is the internal read event that turns them into callbacks.
+ */
+typedef struct lu_evsig_info_s{
+    /* Event watching ev_signal_pair[0] */
+    lu_event_t ev_signal;
+    /* Self-pipe for the sigaction backend, [0] read end and [1] write end.
+     * For the signalfd backend [0] is the signalfd and [1] is -1. */
+    lu_evutil_socket_t ev_signal_pair[2];
+    /* True if we've already added the ev_signal event. */
+    int ev_signal_added;
+    /* Count of the number of signals we're currently watching. */
+    int ev_n_signals_added;
+
+    /* Array of previous signal handler objects before luevent started
+     * messing with them.  Used to restore old signal handlers. */
+    struct sigaction **sh_old;
+    /* Size of sh_old. */
+    int sh_old_max;
+
+    /* Signals routed to the signalfd. */
+    sigset_t sigfd_mask;
+    /* Signals that were already blocked before the signalfd backend
+     * blocked them, and so must stay blocked when they are deleted. */
+    sigset_t sigfd_preblocked;
+}lu_evsig_info_t;
 
 #define EVWATCH_MAX     2
+/** How the dispatch rounds of a base ended; see
+ * lu_event_base_get_dispatch_counters(). */
+typedef struct lu_event_dispatch_counters_s {
+    /** Rounds of running active callbacks. */
+    lu_uint64_t rounds;
+    /** Callbacks run, internal ones included. */
+    lu_uint64_t callbacks;
+    /** Rounds cut short because max_dispatch_callbacks were run. */
+    lu_uint64_t max_callbacks_hit;
+    /** Rounds cut short because max_dispatch_interval had elapsed. */
+    lu_uint64_t max_interval_hit;
+    /** LU_EVENT_BASE_FLAG_BUSY_POLL: waits that found events while
+     * spinning, and waits that spent the budget and went to sleep. */
+    lu_uint64_t busy_poll_hits;
+    lu_uint64_t busy_poll_sleeps;
+    /** Current size of the backend's readiness result array, or 0 if the
+     * backend has none. */
+    int backend_nevents;
+} lu_event_dispatch_counters_t;
+
+/** A snapshot of a base's counters; see lu_event_base_get_stats(). */
+typedef struct lu_event_base_stats_s {
+    /** Events added to the base, internal ones included, and the most
+     * there have ever been. */
+    int event_count;
+    int event_count_max;
+    /** Callbacks waiting to run, and the most there have ever been. */
+    int event_count_active;
+    int event_count_active_max;
+    /** Things other than events that keep the loop running, such as
+     * offloaded jobs, and the most there have ever been. */
+    int virtual_event_count;
+    int virtual_event_count_max;
+    /** Events on the timeout heap, and on the common-timeout wheel. */
+    int timer_heap_size;
+    int timer_wheel_size;
+    /** Loop iterations, i.e. waits in the backend. */
+    lu_uint64_t iterations;
+    /** Time the loop spent waiting in the backend, and the rest of the
+     * time it was running: callbacks, timers and its own bookkeeping. */
+    struct timeval time_polling;
+    struct timeval time_running;
+    /** Changelist flushes, the changes they applied, and the most changes
+     * in one flush. */
+    lu_uint64_t changelist_flushes;
+    lu_uint64_t changelist_changes;
+    int changelist_max_flush;
+    /** See lu_event_base_get_dispatch_counters(). */
+    lu_event_dispatch_counters_t dispatch;
+} lu_event_base_stats_t;
+
+/** One callback run by the loop; see lu_event_base_trace_callbacks(). */
+typedef struct lu_event_callback_trace_s {
+    /** The function that ran: the event's callback, or the internal
+     * function of a callback that is not an event. */
+    void *callback;
+    /** The event's fd or signal, or -1 if the callback is not an event. */
+    lu_evutil_socket_t fd;
+    int priority;
+    /** When the callback started, on CLOCK_MONOTONIC (never the coarse
+     * clock the base may use for timeouts). */
+    struct timeval started;
+    /** How long it waited on the active queue before it started (zero if
+     * it was already active when tracing was turned on), and how long it
+     * ran. */
+    struct timeval queue_delay;
+    struct timeval run_time;
+} lu_event_callback_trace_t;
+
+/** Called when a traced callback ran for at least the slow threshold. */
+typedef void (*lu_event_trace_slow_fn)(lu_event_base_t *base,
+    const lu_event_callback_trace_t *slow, void *arg);
+
+/* The ring of the last records of a base that traces its callbacks. */
+typedef struct lu_event_trace_s {
+    lu_event_callback_trace_t *records;
+    int size;
+    /* Records written so far; the next one goes to nrecorded % size. */
+    lu_uint64_t nrecorded;
+    /* When tracing was turned on; activation times before it are stale. */
+    struct timeval since;
+    /* Zero: no threshold. */
+    struct timeval slow;
+    lu_event_trace_slow_fn on_slow;
+    void *on_slow_arg;
+} lu_event_trace_t;
+
 typedef struct lu_event_base_s {
     
     /** Function pointers and other data to describe this event_base's
@@ -231,13 +497,35 @@ typedef struct lu_event_base_s {
     //用于标记已deferred_cbs的数量
     int n_deferred_queued;
 
+    /** An array of nactivequeues queues for active event_callbacks (ones
+	 * that have triggered, and whose callbacks need to be called).  Low
+	 * priority numbers are more important, and stall higher ones.
+	 */
     struct lu_evcallback_list* active_queues;
+    /** The length of the activequeues array */
+    int nactivequeues;
+    /** Bit i is set iff active_queues[i] is non-empty, so the most
+     * important non-empty queue is found with one count-trailing-zeros. */
+    lu_uint64_t active_queues_bitmap;
+    /** Callbacks other threads asked to activate, newest first.  A
+     * lock-free multi-producer/single-consumer stack: producers push with
+     * a CAS, the loop takes the whole stack with one exchange. */
+    lu_event_callback_t *async_head;
+    /** Worker threads for lu_event_base_offload(), or NULL. */
+    struct lu_event_workers_s *workers;
     /**Common timeout logic */
-    struct common_timeout_list** common_timeout_queues;
+    lu_common_timeout_list_t** common_timeout_queues;
     /** The number of entries used in common_timeout_queues */
 	int n_common_timeouts;
    /** The total size of common_timeout_queues. */
 	int n_common_timeouts_allocated;
+    /** Events using a common timeout, ordered by expiry tick. */
+    lu_timer_wheel_t common_timeout_wheel;
+    /** Internal heap timer that services common_timeout_wheel; only the
+     * soonest wheel expiry is ever in the min-heap. */
+    lu_event_t common_timeout_event;
+    /** The wheel tick common_timeout_event is scheduled for. */
+    lu_uint64_t common_timeout_scheduled_tick;
 
     /**Mapping from file descriptor to enabled(added)   events */
     lu_event_io_map_t io;
@@ -246,7 +534,7 @@ typedef struct lu_event_base_s {
 
 
     /** Priority queue of events with timeouts. */
-	struct min_heap timeheap;
+	lu_min_heap_t timeheap;
     /** Stored timeval: used to avoid calling gettimeofday/clock_gettime
 	 * too often. */
 	struct timeval tv_cache;
@@ -268,29 +556,62 @@ typedef struct lu_event_base_s {
     /** Flags that this base was configured with */
 	lu_event_base_config_flag_t flags;
 
+    /* Bounds on one round of callbacks, for priorities from
+     * limit_callbacks_after_priority on: stop after max_dispatch_callbacks
+     * callbacks or max_dispatch_time (tv_sec -1: unbounded), then go back
+     * to the backend and the timers before running more. */
     struct timeval max_dispatch_time;
     int max_dispatch_callbacks;
     int limit_callbacks_after_priority;
+    lu_event_dispatch_counters_t dispatch_counters;
+    /* Loop statistics.  'stats' is updated under the lock as things
+     * happen; the loop copies it to stats_snapshot once per iteration,
+     * under the stats_seq seqlock, for lu_event_base_get_stats(). */
+    lu_event_base_stats_t stats;
+    lu_event_base_stats_t stats_snapshot;
+    unsigned int stats_seq;
+    /* LU_EVENT_BASE_FLAG_BUSY_POLL: how long to spin before blocking, and
+     * the SO_BUSY_POLL value for sockets read by this base (0: leave
+     * them alone). */
+    struct timeval busy_poll_budget;
+    int busy_poll_sock_usec;
+    /* Callback tracing; NULL unless lu_event_base_trace_callbacks()
+     * turned it on. */
+    lu_event_trace_t *trace;
+    /** Where lu_event_new() gets its events from. */
+    lu_slab_t event_slab;
     /* Notify main thread to wake up break, etc. */
 	/** True if the base already has a pending notify, and we don't need
-	 * to add any more. */
+	 * to add any more.  Set with an atomic exchange by the notifying
+	 * thread, cleared by the loop when it drains the notify fd. */
 	int is_notify_pending;
-	/** A socketpair used by some th_notify functions to wake up the main
-	 * thread. */
+	/** The fds used by th_notify_fn to wake up the main thread: a single
+	 * eventfd in th_notify_fd[0], or the two ends of a pipe when eventfd
+	 * is not available. */
     lu_evutil_socket_t th_notify_fd[2];
    
+    /** Internal read event on th_notify_fd[0]. */
     lu_event_t th_notify;
 
     //----
     /** A function used to wake up the main thread from another thread. */
 	int (*th_notify_fn)(struct lu_event_base_s *base);
 
+    /** The thread running lu_event_base_loop(); only meaningful while
+     * running_loop is set. */
+    pthread_t th_owner_id;
+    /** Lock protecting the base.  Not used when the base was created with
+     * LU_EVENT_BASE_FLAG_NOLOCK. */
+    pthread_mutex_t th_base_lock;
+
 	/** Saved seed for weak random number generator. Some backends use
 	 * this to produce fairness among sockets. Protected by th_base_lock. */
 	struct evutil_weakrand_state_s weakrand_seed;
 
 	/** List of event_onces that have not yet fired. */
-	LIST_HEAD(once_event_list, event_once) once_events;
+	LIST_HEAD(lu_once_event_list, lu_event_once_s) once_events;
+	/** Where lu_event_base_once() gets its records from. */
+	lu_slab_t once_slab;
 
 	/** "Prepare" and "check" watchers. */
 	struct evwatch_list_s watchers[EVWATCH_MAX];
@@ -312,6 +633,8 @@ typedef enum lu_event_method_feature_u {
     LU_EVENT_FEATURE_O1 = 0x02,
     LU_EVENT_FEATURE_FDS = 0x04,
     LU_EVENT_FEATURE_EARLY_CLOSE = 0x08,
+    /* LU_EV_EXCLUSIVE wakes one waiter instead of all of them. */
+    LU_EVENT_FEATURE_EXCLUSIVE = 0x10,
 }lu_event_method_feature_t;
 
 typedef struct lu_event_op_s {
@@ -321,7 +644,15 @@ typedef struct lu_event_op_s {
      *  create a new lu_event_base_t and return it.On failture,this function should return NULL
      */
     void* (*init)(lu_event_base_t*);  
-    int* (*add)(lu_event_base_t*, lu_evutil_socket_t fd,short old,short events, void* fdinfo);
+    /** Enable reading/writing on a given fd or signal.  'events' will be
+     * the events that we're trying to enable: one or more of LU_EV_READ,
+     * LU_EV_WRITE, LU_EV_SIGNAL, and LU_EV_ET.  'old' will be those events
+     * that were enabled on this fd previously.  'fdinfo' will be a structure
+     * associated with the fd by the evmap; its size is defined by the
+     * fdinfo field below.  It will be set to 0 the first time the fd is
+     * added.  The function should return 0 on success and -1 on error.
+     */
+    int (*add)(lu_event_base_t*, lu_evutil_socket_t fd,short old,short events, void* fdinfo);
      /** 类似于'add'函数，但'events'参数表示我们要禁用的事件类型。 */
     int (*del)( lu_event_base_t *, lu_evutil_socket_t fd, short old, short events, void *fdinfo);
 
@@ -344,6 +675,130 @@ typedef struct lu_event_op_s {
 } lu_event_op_t;
 
 
+/**
+ * @name LU_EVLIST flags
+ * Flags kept in evcb_flags describing which internal lists an event or
+ * callback is on.
+ * @{
+ */
+#define LU_EVLIST_TIMEOUT	    0x01
+#define LU_EVLIST_INSERTED	    0x02
+#define LU_EVLIST_SIGNAL	    0x04
+#define LU_EVLIST_ACTIVE	    0x08
+#define LU_EVLIST_INTERNAL	    0x10
+#define LU_EVLIST_ACTIVE_LATER  0x20
+#define LU_EVLIST_FINALIZING    0x40
+#define LU_EVLIST_INIT		    0x80
+
+#define LU_EVLIST_ALL           0xff
+/** @} */
+
+/** Set in evcb_async_res by lu_event_del() on a callback it could not
+ * take off the async queue; above every LU_EV_* result bit. */
+#define LU_EVCB_ASYNC_CANCELLED 0x4000
+
+/**
+ * @name Possible values for evcb_closure in lu_event_callback_t
+ * @{
+ */
+/** A regular event. Uses the evcb_callback callback */
+#define LU_EV_CLOSURE_EVENT             0
+/** A signal event. Uses the evcb_callback callback */
+#define LU_EV_CLOSURE_EVENT_SIGNAL      1
+/** A persistent non-signal event. Uses the evcb_callback callback */
+#define LU_EV_CLOSURE_EVENT_PERSIST     2
+/** A simple callback. Uses the evcb_selfcb callback. */
+#define LU_EV_CLOSURE_CB_SELF           3
+/** @} */
+
+/* Shorthands for the members of lu_event_t that live in other structures. */
+#define ev_pri          ev_callback_.evcb_pri
+#define ev_flags        ev_callback_.evcb_flags
+#define ev_closure      ev_callback_.evcb_closure
+#define ev_callback     ev_callback_.evcb_cb_union.evcb_callback
+#define ev_arg          ev_callback_.evcb_arg
+#define ev_io_next      ev_.ev_io.ev_io_next
+#define ev_signal_next  ev_.ev_signal.ev_signal_next
+#define ev_ncalls       ev_.ev_signal.ev_ncalls
+#define ev_pncalls      ev_.ev_signal.ev_pncalls
+/* The interval a persistent event is re-armed with after each run. */
+#define ev_io_timeout   ev_.ev_io.ev_timeout
+
+/** Return the lu_event_t that embeds the callback 'evcb'. Only valid if
+ * LU_EVLIST_INIT is set on evcb_flags. */
+#define lu_event_callback_to_event(evcb) \
+    ((lu_event_t *)((char *)(evcb) - offsetof(lu_event_t, ev_callback_)))
+#define lu_event_to_event_callback(ev) (&(ev)->ev_callback_)
+
+/**
+ * @name Common timeout encoding
+ * A common timeout is a timeval whose tv_usec carries LU_COMMON_TIMEOUT_MAGIC
+ * in its top bits and the index into common_timeout_queues above the
+ * microseconds.  Events on the timing wheel keep the same bits in
+ * ev_timeout.
+ * @{
+ */
+#define LU_MICROSECONDS_MASK            0x000fffff
+#define LU_COMMON_TIMEOUT_IDX_MASK      0x0ff00000
+#define LU_COMMON_TIMEOUT_IDX_SHIFT     20
+#define LU_COMMON_TIMEOUT_MASK          0xf0000000
+#define LU_COMMON_TIMEOUT_MAGIC         0x50000000
+#define LU_MAX_COMMON_TIMEOUTS          256
+
+#define LU_COMMON_TIMEOUT_IDX(tv) \
+    (((tv)->tv_usec & LU_COMMON_TIMEOUT_IDX_MASK) >> LU_COMMON_TIMEOUT_IDX_SHIFT)
+/** @} */
+
+/**
+ * @name Base locking
+ * The base lock is held by the loop except while it waits in the backend
+ * and while it runs callbacks.
+ * @{
+ */
+#define LU_EVBASE_ACQUIRE_LOCK(base) do {                           \
+    if (!((base)->flags & LU_EVENT_BASE_FLAG_NOLOCK))               \
+        pthread_mutex_lock(&(base)->th_base_lock);                  \
+} while (0)
+#define LU_EVBASE_RELEASE_LOCK(base) do {                           \
+    if (!((base)->flags & LU_EVENT_BASE_FLAG_NOLOCK))               \
+        pthread_mutex_unlock(&(base)->th_base_lock);                \
+} while (0)
+/** True iff the loop is running in a thread other than the caller's, so
+ * a change to the base has to wake it up. */
+#define LU_EVBASE_NEED_NOTIFY(base)                                 \
+    ((base)->running_loop &&                                        \
+     !pthread_equal((base)->th_owner_id, pthread_self()))
+/** @} */
+
+/** True iff any callbacks are active on this base. */
+#define LU_N_ACTIVE_CALLBACKS(base) ((base)->event_count_active)
+
+/** Make 'ev' active with result 'res'.  'ncalls' is only used for signal
+ * events. Must be called with the base lock held (if any). */
+void lu_event_active_nolock_(lu_event_t *ev, int res, short ncalls);
+/** Put a callback that is not an event on its base's active queue.  Must
+ * be called with the base lock held (if any). */
+void lu_event_callback_activate_nolock_(lu_event_base_t *base,
+    lu_event_callback_t *evcb);
+/** Ask the loop of 'base' to activate 'evcb' without taking the base lock;
+ * safe from any thread.  For an event, res is or-ed into the result it is
+ * activated with.  Returns 0 on success, -1 on failure. */
+int  lu_event_callback_activate_async_(lu_event_base_t *base,
+    lu_event_callback_t *evcb, short res);
+
+/** Count something that is not an event but should keep the loop from
+ * exiting for lack of events.  Must be called with the base lock held. */
+void lu_event_base_add_virtual_(lu_event_base_t *base);
+/** Undo lu_event_base_add_virtual_(). */
+void lu_event_base_del_virtual_(lu_event_base_t *base);
+
+/** Stop and join the base's worker threads and free the pool. */
+void lu_event_workers_free_(lu_event_base_t *base);
+/** True iff evcb is the completion of an offloaded job. */
+int  lu_event_workers_owns_(const lu_event_callback_t *evcb);
+/** Free the job of a completion that will never run. */
+void lu_event_workers_discard_(lu_event_callback_t *evcb);
+
 typedef struct lu_event_config_entry_s {
     TAILQ_ENTRY(lu_event_config_entry_s) next;
     //aviod method
@@ -367,6 +822,15 @@ typedef struct lu_event_config_s {
     //用于限制在特定优先级之后的回调数量。Use to limit the number of callbacks after a specific priority.
 	int limit_callbacks_after_priority;
 
+    /* See lu_event_config_set_busy_poll(). */
+    struct timeval busy_poll_budget;
+    int busy_poll_sock_usec;
+
+    /* Events and one-shot records to preallocate; see
+     * lu_event_config_reserve_events(). */
+    int nevents_reserved;
+    int nonce_reserved;
+
     lu_event_method_feature_t required_features; //指定所需的事件方法特性。
 
      //指定事件基础配置的标志
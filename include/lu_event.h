@@ -3,10 +3,345 @@
 
 #include "lu_event-internal.h"
 
+#include <stdio.h>
+
+/**
+ * @name event flags
+ *
+ * Flags to pass to lu_event_new(), lu_event_assign(), lu_event_pending(),
+ * and anything else with an argument of the form "short events"
+ * @{
+ */
+/** Indicates that a timeout has occurred.  It's not necessary to pass
+ * this flag to lu_event_new()/lu_event_assign() to get a timeout. */
+#define LU_EV_TIMEOUT   0x01
+/** Wait for a socket or FD to become readable */
+#define LU_EV_READ      0x02
+/** Wait for a socket or FD to become writeable */
+#define LU_EV_WRITE     0x04
+/** Wait for a POSIX signal to be raised*/
+#define LU_EV_SIGNAL    0x08
+/**
+ * Persistent event: won't get removed automatically when activated.
+ *
+ * When a persistent event with a timeout becomes activated, its timeout
+ * is reset to 0.
+ */
+#define LU_EV_PERSIST   0x10
+/** Select edge-triggered behavior, if supported by the backend. */
+#define LU_EV_ET        0x20
+/** Wake only one of the bases watching the same fd when it becomes ready,
+ * instead of all of them (EPOLLEXCLUSIVE).  Only meaningful on backends
+ * with LU_EVENT_FEATURE_EXCLUSIVE; ignored elsewhere. */
+#define LU_EV_EXCLUSIVE 0x40
+/** Detects connection close events.  You can use this to detect when a
+ * connection has been closed, without having to read all the pending data
+ * from a connection. */
+#define LU_EV_CLOSED    0x80
+/**@}*/
+
+/**
+ * @name evloop flags
+ * Flags to pass to lu_event_base_loop().
+ * @{
+ */
+/** Block until we have an active event, then exit once all active events
+ * have had their callbacks run. */
+#define LU_EVLOOP_ONCE                  0x01
+/** Do not block: see which events are ready now, run the callbacks
+ * of the highest-priority ones, then exit. */
+#define LU_EVLOOP_NONBLOCK              0x02
+/** Do not exit the loop because we have no pending events.  Instead, keep
+ * running until lu_event_base_loopexit() or lu_event_base_loopbreak()
+ * makes us stop. */
+#define LU_EVLOOP_NO_EXIT_ON_EMPTY      0x04
+/**@}*/
+
+/** A callback function for an event. It receives the fd (or signal number),
+ * the LU_EV_* flags that triggered it, and the user argument. */
+typedef void (*lu_event_callback_fn)(lu_evutil_socket_t, short, void *);
 
 lu_event_base_t*    lu_event_base_new(void);
 lu_event_config_t*  lu_event_config_new(void);
 lu_event_base_t*    lu_event_base_new_with_config(lu_event_config_t* );
 void                lu_event_config_free(lu_event_config_t*);
 
+/** Enters a method name to avoid (for example "epoll") when choosing a
+ * backend. Returns 0 on success, -1 on failure. */
+int         lu_event_config_avoid_method(lu_event_config_t *cfg, const char *method);
+/** Only accept backends that provide every feature in 'features'. */
+int         lu_event_config_require_features(lu_event_config_t *cfg, int features);
+/**
+ * Bound how long the loop runs callbacks before checking for new events
+ * and expired timers again.
+ *
+ * Callbacks of a priority below min_priority are always all run; for the
+ * others, a round stops once max_callbacks of them have run, or once
+ * max_interval has elapsed since the round began (checked after each
+ * callback, so one slow callback can still overrun it).
+ * @param max_interval the longest round, or NULL for no time bound
+ * @param max_callbacks the most callbacks per round, or -1 for no bound
+ * @param min_priority the first priority the bounds apply to
+ * @return 0 on success, -1 on failure.
+ */
+int         lu_event_config_set_max_dispatch_interval(lu_event_config_t *cfg,
+                const struct timeval *max_interval, int max_callbacks,
+                int min_priority);
+/**
+ * Turn on LU_EVENT_BASE_FLAG_BUSY_POLL.
+ *
+ * Each time the loop would block, it first polls the backend without
+ * waiting until an event is ready or 'budget' has elapsed, and only then
+ * sleeps.  See the busy_poll_* fields of lu_event_dispatch_counters_t for
+ * how often the spin paid off.
+ * @param budget how long to spin, or NULL to keep the default of 50us
+ * @param so_busy_poll_usec if > 0, set SO_BUSY_POLL to this many
+ *        microseconds on every socket the base starts reading, so the
+ *        kernel also polls the device queue for it.  Raising it above
+ *        net.core.busy_read needs CAP_NET_ADMIN; failures are ignored.
+ * @return 0 on success, -1 on failure.
+ */
+int         lu_event_config_set_busy_poll(lu_event_config_t *cfg,
+                const struct timeval *budget, int so_busy_poll_usec);
+/** Preallocate room for nevents events from lu_event_new() and nonce
+ * records for lu_event_base_once() when the base is created, so the first
+ * ones don't go to the system allocator.  Returns 0 on success, -1 on
+ * failure. */
+int         lu_event_config_reserve_events(lu_event_config_t *cfg, int nevents,
+                int nonce);
+/** Record how many CPUs the application expects to use.  Used by
+ * lu_event_pool_new() as the number of bases to create. */
+int         lu_event_config_set_num_cpus_hint(lu_event_config_t *cfg, int cpus);
+/** Set one or more lu_event_base_config_flag_t flags on the config. */
+int         lu_event_config_set_flag(lu_event_config_t *cfg, int flag);
+
+/** Deallocate all memory associated with a base.  Events from
+ * lu_event_new() live in the base's slab and are freed with it, added or
+ * not: don't call lu_event_free() on them afterwards.  Events the caller
+ * allocated itself and set up with lu_event_assign() are not freed. */
+void        lu_event_base_free(lu_event_base_t *base);
+/**
+ * Make a base usable in the child after fork().
+ *
+ * Backends that keep state in the kernel (lu_event_op_t need_reinit) get
+ * new kernel objects: the epoll fd and its timerfd, or the io_uring ring.
+ * Every fd of the base is then registered again, once with all the events
+ * wanted on it, and the signal and wakeup fds are replaced so that they
+ * are no longer shared with the parent.  Events, timeouts and active
+ * callbacks are kept as they are.
+ *
+ * Call it in the child before running the loop.  Worker threads from
+ * lu_event_base_start_workers() do not survive fork() and are not
+ * restarted.  On failure the base can only be freed.
+ * @return 0 on success, -1 on failure.
+ */
+int         lu_event_reinit(lu_event_base_t *base);
+/**
+ * Read a snapshot of the base's counters without taking its lock.
+ *
+ * The loop publishes the snapshot at the end of every iteration and when
+ * it exits, so it may be one iteration old; it is always consistent.  Any
+ * thread may call this at any time, and it never blocks the loop.
+ * @return 0 on success, -1 on failure.
+ */
+int         lu_event_base_get_stats(const lu_event_base_t *base,
+                lu_event_base_stats_t *stats);
+/** Return the name of the backend used by this base, e.g. "epoll". */
+const char *lu_event_base_get_method(const lu_event_base_t *base);
+/** Return a bitmask of the lu_event_method_feature_t the backend supports. */
+int         lu_event_base_get_features(const lu_event_base_t *base);
+/** Copy the base's lu_event_dispatch_counters_t into *counters: how its
+ * dispatch rounds ended, busy polling, and the backend's result array
+ * size.  Returns 0 on success, -1 on failure. */
+int         lu_event_base_get_dispatch_counters(lu_event_base_t *base,
+                lu_event_dispatch_counters_t *counters);
+/**
+ * Record every callback the base runs in a ring of its last nrecords
+ * lu_event_callback_trace_t, to find what blocked the loop without a
+ * profiler.  Costs a few CLOCK_MONOTONIC reads per callback while on,
+ * whatever clock the base uses for its timeouts.
+ *
+ * A callback that runs for 'slow' or longer is passed to on_slow(base,
+ * record, arg), without the lock, in the loop's thread; if on_slow is
+ * NULL the whole ring is written to stderr instead.
+ *
+ * Calling this again replaces the ring and its settings.
+ * @param nrecords the size of the ring, or 0 to stop tracing
+ * @param slow the slow-callback threshold, or NULL for none
+ * @return 0 on success, -1 on failure.
+ */
+int         lu_event_base_trace_callbacks(lu_event_base_t *base, int nrecords,
+                const struct timeval *slow, lu_event_trace_slow_fn on_slow,
+                void *arg);
+/** Copy up to max of the latest trace records into records, oldest
+ * first.  Returns the number copied (0 when not tracing), or -1 on
+ * failure. */
+int         lu_event_base_get_callback_trace(lu_event_base_t *base,
+                lu_event_callback_trace_t *records, int max);
+/** Write the trace records to 'output', one line per callback, oldest
+ * first. */
+void        lu_event_base_dump_callback_trace(lu_event_base_t *base,
+                FILE *output);
+
+/**
+ * Wait for events to become active and run their callbacks.
+ * @param flags any combination of LU_EVLOOP_ONCE | LU_EVLOOP_NONBLOCK |
+ *              LU_EVLOOP_NO_EXIT_ON_EMPTY
+ * @return 0 if successful, -1 if an error occurred, or 1 if we exited
+ *         because no events were pending or active.
+ */
+int         lu_event_base_loop(lu_event_base_t *base, int flags);
+/** Same as lu_event_base_loop(base, 0). */
+int         lu_event_base_dispatch(lu_event_base_t *base);
+/** Abort the active lu_event_base_loop() immediately, after the current
+ * callback returns. */
+int         lu_event_base_loopbreak(lu_event_base_t *base);
+/** Return true if the loop was told to exit via lu_event_base_loopbreak(). */
+int         lu_event_base_got_break(lu_event_base_t *base);
+
+/**
+ * @name Priorities
+ *
+ * Active events are run by priority: all active events of priority 0 run
+ * before any of priority 1, and so on.  A base starts with one priority;
+ * new events get the middle one (npriorities / 2).
+ * @{
+ */
+/** The largest number of priorities a base can have. */
+#define LU_EVENT_MAX_PRIORITIES 64
+/**
+ * Set the number of priorities of a base.  Only legal while no events are
+ * active, and should be called before any event is assigned.
+ * @return 0 on success, -1 on failure.
+ */
+int         lu_event_base_priority_init(lu_event_base_t *base, int npriorities);
+/** Return the number of priorities of a base. */
+int         lu_event_base_get_npriorities(lu_event_base_t *base);
+/** Set the priority of an event that is not active.  0 is the most
+ * important.  Returns 0 on success, -1 on failure. */
+int         lu_event_priority_set(lu_event_t *ev, int pri);
+/** @} */
+
+/**
+ * Get the current wall-clock time as of the start of the running
+ * callbacks, without a system call.
+ *
+ * Inside a callback this is the time the loop last woke up, converted to
+ * wall-clock time.  Outside the loop, or if the base was created with
+ * LU_EVENT_BASE_FLAG_NO_CACHE_TIME, it falls back to gettimeofday().
+ * @return 0 on success, -1 on failure.
+ */
+int         lu_event_base_gettimeofday_cached(lu_event_base_t *base,
+                struct timeval *tv);
+/** Refresh the cached time of a running loop, e.g. from a long callback.
+ * Returns 0 on success, -1 on failure. */
+int         lu_event_base_update_cache_time(lu_event_base_t *base);
+
+/** Prepare a caller-allocated event. See lu_event_new() for the arguments. */
+int         lu_event_assign(lu_event_t *ev, lu_event_base_t *base, lu_evutil_socket_t fd,
+                short events, lu_event_callback_fn callback, void *arg);
+/**
+ * Allocate and assign a new event.
+ * @param fd the file descriptor (or signal number) to watch, or -1.
+ * @param events LU_EV_READ, LU_EV_WRITE, LU_EV_SIGNAL, LU_EV_PERSIST, ...
+ * @return the new event, or NULL on error.
+ */
+lu_event_t *lu_event_new(lu_event_base_t *base, lu_evutil_socket_t fd, short events,
+                lu_event_callback_fn callback, void *arg);
+/**
+ * Run a callback once, when fd is ready or the timeout expires.
+ *
+ * Nothing needs to be freed: the record comes from a per-base pool and is
+ * recycled as soon as the callback returns, so a steady stream of one-shot
+ * timers does not touch the system allocator.  A record that never fires
+ * is released by lu_event_base_free().
+ * @param fd the fd to watch, or -1 for a timer
+ * @param events LU_EV_TIMEOUT alone for a timer, or any of LU_EV_READ,
+ *        LU_EV_WRITE and LU_EV_CLOSED; LU_EV_SIGNAL and LU_EV_PERSIST are
+ *        not allowed
+ * @param tv the timeout, or NULL.  A timer with no (or a zero) timeout
+ *        runs on the next loop iteration.
+ * @return 0 on success, -1 on failure.
+ */
+int         lu_event_base_once(lu_event_base_t *base, lu_evutil_socket_t fd,
+                short events, lu_event_callback_fn callback, void *arg,
+                const struct timeval *tv);
+/** Delete and deallocate an event returned by lu_event_new().  Must be
+ * called before its base is freed: events come from a per-base pool. */
+void        lu_event_free(lu_event_t *ev);
+/**
+ * Make an event pending.
+ * @param timeout the maximum amount of time to wait, or NULL to wait
+ *                forever.
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int         lu_event_add(lu_event_t *ev, const struct timeval *timeout);
+/** Make an event non-pending and non-active, cancelling an activation
+ * queued by lu_event_active_async() too.  Returns 0 on success. */
+int         lu_event_del(lu_event_t *ev);
+/** Make an event active, as if 'res' had just happened to it. */
+void        lu_event_active(lu_event_t *ev, int res, short ncalls);
+/**
+ * Make an event active from another thread without taking the base lock.
+ *
+ * The event is pushed on a lock-free queue that the loop drains in one go
+ * each iteration; activations made before it drains are merged, and only
+ * the first wakes the loop.  lu_event_del() and lu_event_free() cancel a
+ * queued activation.
+ * @param res the LU_EV_* flags to activate with; must not be 0
+ * @return 0 on success, -1 on failure.
+ */
+int         lu_event_active_async(lu_event_t *ev, int res);
+
+/**
+ * @name Signal events
+ * Wrappers for events that fire when a POSIX signal is raised.  The
+ * callback runs once per delivery the backend saw, in the loop's thread.
+ * @{
+ */
+#define lu_evsignal_new(base, x, cb, arg) \
+    lu_event_new((base), (x), LU_EV_SIGNAL|LU_EV_PERSIST, (cb), (arg))
+#define lu_evsignal_assign(ev, base, x, cb, arg) \
+    lu_event_assign((ev), (base), (x), LU_EV_SIGNAL|LU_EV_PERSIST, (cb), (arg))
+#define lu_evsignal_add(ev, tv)     lu_event_add((ev), (tv))
+#define lu_evsignal_del(ev)         lu_event_del(ev)
+/** @} */
+
+/**
+ * @name Watchers
+ * Hooks into every loop iteration.  A prepare watcher runs right before
+ * the backend waits for events (e.g. to flush writes batched during the
+ * iteration); a check watcher runs right after the wait, before any
+ * callback, and is told how long the wait took and how many callbacks it
+ * made active (e.g. to feed a utilization gauge).  Watchers run in the
+ * loop's thread without the base lock, and do not keep the loop from
+ * exiting for lack of events.
+ * @{
+ */
+/** Add a prepare watcher.  If it makes an event active, the wait that
+ * follows does not block.  Returns NULL on failure. */
+lu_evwatch_t *lu_evwatch_prepare_new(lu_event_base_t *base,
+                lu_evwatch_prepare_cb callback, void *arg);
+/** Add a check watcher.  Returns NULL on failure. */
+lu_evwatch_t *lu_evwatch_check_new(lu_event_base_t *base,
+                lu_evwatch_check_cb callback, void *arg);
+/** Return the base a watcher belongs to. */
+lu_event_base_t *lu_evwatch_base(lu_evwatch_t *watcher);
+/** Remove and free a watcher.  A watcher may free itself from its own
+ * callback, but not another watcher of the same kind.  Watchers left are
+ * freed by lu_event_base_free(). */
+void        lu_evwatch_free(lu_evwatch_t *watcher);
+/** @} */
+
+/**
+ * Prepare a base for a large number of timeouts that all share one duration.
+ *
+ * Passing the returned timeval to lu_event_add() keeps the event on a
+ * timing wheel instead of the timeout heap, so adding and deleting it is
+ * O(1).  Expiry is rounded up to the next millisecond.
+ * @return a magic timeval to use with lu_event_add(), or NULL on error.
+ */
+const struct timeval *lu_event_base_init_common_timeout(lu_event_base_t *base,
+                const struct timeval *duration);
+
 #endif  //LU_EVENT_H
\ No newline at end of file
@@ -0,0 +1,87 @@
+#ifndef LU_EVENT_POOL_H
+#define LU_EVENT_POOL_H
+
+/**
+ * @file lu_event_pool.h
+ * @brief A pool of reactors: one lu_event_base_t and loop thread per core.
+ *
+ * Each base is only ever run by its own thread, so the bases share no
+ * state and need no lock between them.  Listening sockets are sharded with
+ * SO_REUSEPORT: every base gets its own socket bound to the same address,
+ * and the kernel spreads incoming connections across them, so accepted
+ * connections stay on the core that accepted them.
+ *
+ * With LU_EVENT_POOL_LISTEN_EXCLUSIVE, every base instead watches one
+ * shared socket with LU_EV_EXCLUSIVE, so a new connection wakes one idle
+ * base rather than all of them, and a busy base leaves its backlog to the
+ * others.
+ */
+
+#include "lu_event.h"
+
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lu_event_pool_s lu_event_pool_t;
+
+/** Pin loop thread i to the i-th CPU the process is allowed to run on. */
+#define LU_EVENT_POOL_PIN_CPUS  0x01
+/** Share one listening socket between the bases, registered with
+ * LU_EV_EXCLUSIVE, instead of one SO_REUSEPORT socket per base.  Falls
+ * back to the latter if the backend lacks LU_EVENT_FEATURE_EXCLUSIVE. */
+#define LU_EVENT_POOL_LISTEN_EXCLUSIVE  0x02
+
+/**
+ * Create a pool of bases, all configured from cfg.
+ *
+ * The number of bases is cfg's lu_event_config_set_num_cpus_hint(), or
+ * the number of CPUs the process may run on if that is not set.  The
+ * loops do not run until lu_event_pool_start().
+ * @param cfg the configuration of every base, or NULL for the default
+ * @param flags any of LU_EVENT_POOL_PIN_CPUS | LU_EVENT_POOL_LISTEN_EXCLUSIVE
+ * @return the new pool, or NULL on error.
+ */
+lu_event_pool_t *lu_event_pool_new(lu_event_config_t *cfg, int flags);
+/** Stop the pool if it is running, close its listeners and free every
+ * base.  Events from lu_event_new() on the bases are freed with them (see
+ * lu_event_base_free()): don't call lu_event_free() on them afterwards. */
+void        lu_event_pool_free(lu_event_pool_t *pool);
+
+/** Start one thread per base, running its loop until lu_event_pool_stop().
+ * Returns 0 on success, -1 on failure (with no thread left running). */
+int         lu_event_pool_start(lu_event_pool_t *pool);
+/** Break every loop and wait for the threads to exit.  Returns 0 on
+ * success. */
+int         lu_event_pool_stop(lu_event_pool_t *pool);
+
+/** Return the number of bases in the pool. */
+int         lu_event_pool_get_nbases(const lu_event_pool_t *pool);
+/** Return base i of the pool, or NULL if i is out of range. */
+lu_event_base_t *lu_event_pool_get_base(lu_event_pool_t *pool, int i);
+/** Return the bases in turn, e.g. to spread client connections. */
+lu_event_base_t *lu_event_pool_next_base(lu_event_pool_t *pool);
+
+/**
+ * Listen on an address from every base.
+ *
+ * A nonblocking SO_REUSEPORT socket is bound to 'sa' for each base, with a
+ * persistent LU_EV_READ event that calls cb(listen_fd, LU_EV_READ, arg) in
+ * that base's thread when a connection is waiting; cb is expected to
+ * accept() it.  The sockets are closed by lu_event_pool_free().
+ *
+ * In LU_EVENT_POOL_LISTEN_EXCLUSIVE mode one socket is shared instead.
+ * The kernel may still wake more than one base for a connection, so cb
+ * must expect accept() to fail with EAGAIN.
+ * @return 0 on success, -1 on failure.
+ */
+int         lu_event_pool_listen(lu_event_pool_t *pool, const struct sockaddr *sa,
+                socklen_t socklen, int backlog, lu_event_callback_fn cb, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  //LU_EVENT_POOL_H
@@ -0,0 +1,56 @@
+#ifndef LU_EVENT_WORKERS_H
+#define LU_EVENT_WORKERS_H
+
+/**
+ * @file lu_event_workers.h
+ * @brief Worker threads for CPU-bound work offloaded from a base's loop.
+ *
+ * A callback that would stall the loop (a TLS handshake, parsing a large
+ * message) hands the work to lu_event_base_offload() instead.  The work
+ * runs on one of the base's worker threads; when it returns, its 'done'
+ * function is run back in the loop's thread, like any other callback.
+ *
+ * Each worker has its own deque of jobs: it takes its newest job first,
+ * and a worker with nothing to do steals the oldest job of another one, so
+ * that bursts spread over all the idle workers.
+ */
+
+#include "lu_event.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Work to run on a worker thread. */
+typedef void (*lu_event_work_fn)(void *arg);
+/** Called in the loop's thread once the work has run. */
+typedef void (*lu_event_work_done_fn)(void *arg);
+
+/**
+ * Start worker threads for a base.
+ *
+ * The workers are stopped and joined by lu_event_base_free(); jobs that
+ * have not started by then are dropped without calling their 'done'.
+ * @param nworkers the number of threads, or 0 for one per available CPU
+ * @return 0 on success, -1 on failure or if the base already has workers.
+ */
+int         lu_event_base_start_workers(lu_event_base_t *base, int nworkers);
+
+/**
+ * Run work(arg) on a worker thread of the base, then done(arg) in the
+ * loop's thread.  May be called from any thread, including from inside
+ * a work function, whose worker then runs the new job first.
+ *
+ * A pending job keeps lu_event_base_loop() from exiting for lack of
+ * events.
+ * @param done called in the loop's thread after work; may be NULL
+ * @return 0 on success, -1 on failure (e.g. no workers were started).
+ */
+int         lu_event_base_offload(lu_event_base_t *base, lu_event_work_fn work,
+                lu_event_work_done_fn done, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  //LU_EVENT_WORKERS_H
@@ -0,0 +1,61 @@
+#ifndef LU_EVMAP_INTERNAL_H_INCLUDED_
+#define LU_EVMAP_INTERNAL_H_INCLUDED_
+
+/**
+ * @file lu_evmap-internal.h
+ * @brief Mapping maintenance from fds and signals to the events added on
+ * them.
+ *
+ * The evmap is what the backends talk to: lu_event_add() asks the evmap to
+ * register an event, and the evmap only calls the backend's add/del when
+ * the set of events wanted on an fd actually changes.  When the backend
+ * reports readiness, lu_evmap_io_active_() activates every matching event.
+ */
+
+#include "lu_event-internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Initialize an io map. */
+void lu_evmap_io_initmap_(lu_event_io_map_t *ctx);
+/** Remove every entry from an io map and free the memory it uses. */
+void lu_evmap_io_clear_(lu_event_io_map_t *ctx);
+
+/**
+ * Add an IO event (some combination of LU_EV_READ or LU_EV_WRITE) to a
+ * base, telling the backend about it if needed.
+ * @return -1 on error, 0 if nothing changed in the backend, 1 if the
+ *         backend was told about a change.
+ */
+int  lu_evmap_io_add_(lu_event_base_t *base, lu_evutil_socket_t fd, lu_event_t *ev);
+/** Remove an IO event from a base, telling the backend about it if
+ * needed.  Return values match lu_evmap_io_add_(). */
+int  lu_evmap_io_del_(lu_event_base_t *base, lu_evutil_socket_t fd, lu_event_t *ev);
+/** Activate every event on fd that is waiting for one of 'events'. */
+void lu_evmap_io_active_(lu_event_base_t *base, lu_evutil_socket_t fd, short events);
+/** Tell a freshly initialized backend about every fd in the io map, once
+ * per fd with all the events wanted on it.  Used by lu_event_reinit().
+ * Returns 0 on success, -1 if any fd could not be added. */
+int  lu_evmap_io_reinit_(lu_event_base_t *base);
+
+/** Initialize a signal map. */
+void lu_evmap_signal_initmap_(lu_event_signal_map_t *ctx);
+/** Remove every entry from a signal map and free the memory it uses. */
+void lu_evmap_signal_clear_(lu_event_signal_map_t *ctx);
+
+/** Add a signal event to a base, telling the signal backend when the
+ * first event for sig is added.  Return values match lu_evmap_io_add_(). */
+int  lu_evmap_signal_add_(lu_event_base_t *base, int sig, lu_event_t *ev);
+/** Remove a signal event from a base.  Return values match
+ * lu_evmap_io_add_(). */
+int  lu_evmap_signal_del_(lu_event_base_t *base, int sig, lu_event_t *ev);
+/** Activate every event waiting for sig, which was raised ncalls times. */
+void lu_evmap_signal_active_(lu_event_base_t *base, lu_evutil_socket_t sig, int ncalls);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LU_EVMAP_INTERNAL_H_INCLUDED_ */
@@ -0,0 +1,49 @@
+#ifndef LU_EVSIGNAL_INTERNAL_H_INCLUDED_
+#define LU_EVSIGNAL_INTERNAL_H_INCLUDED_
+
+/**
+ * @file lu_evsignal-internal.h
+ * @brief Signal backends.
+ *
+ * Signals are not fds, so they get their own lu_event_op_t in
+ * base->evsigsel_op.  Two implementations exist:
+ *
+ *  - lu_sigfdops (lu_signalfd.c) blocks the watched signals and reads them
+ *    from a single signalfd, in batches, with no signal handler at all.
+ *    Used when the base has LU_EVENT_BASE_FLAG_USE_SIGNALFD or the
+ *    LU_EVENT_USE_SIGNALFD environment variable is set.
+ *  - lu_evsigops (lu_signal.c) installs a sigaction() handler that writes
+ *    the signal number to a self-pipe.  Only one base at a time can own
+ *    signals this way.
+ *
+ * Either way the readable fd is watched by an internal event of the main
+ * backend, whose callback calls lu_evmap_signal_active_().
+ */
+
+#include "lu_event-internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Set up the sigaction backend on base.  Returns 0 on success. */
+int  lu_evsig_init_(lu_event_base_t *base);
+/** Set up the signalfd backend on base.  Returns 0 on success, -1 if
+ * signalfd is unavailable. */
+int  lu_sigfd_init_(lu_event_base_t *base);
+
+/** Replace the sigaction backend's self-pipe after fork(), keeping the
+ * installed handlers.  ev_signal must not be added.  Returns 0 on
+ * success. */
+int  lu_evsig_reinit_(lu_event_base_t *base);
+/** Same as lu_evsig_reinit_(), for the signalfd backend. */
+int  lu_sigfd_reinit_(lu_event_base_t *base);
+
+extern const lu_event_op_t lu_evsigops;
+extern const lu_event_op_t lu_sigfdops;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LU_EVSIGNAL_INTERNAL_H_INCLUDED_ */
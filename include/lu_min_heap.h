@@ -1,18 +1,31 @@
 #ifndef LU_INCLUDE_MIN_HEAP_H
 #define LU_INCLUDE_MIN_HEAP_H
 
+/**
+ * @file lu_min_heap.h
+ * @brief 4-ary min-heap of timeouts, ordered by lu_event_t::ev_timeout.
+ *
+ * Each slot stores the expiry (in microseconds) inline next to the event
+ * pointer, so comparisons during a sift never dereference an event.  A
+ * slot is 16 bytes and the array is cache-line aligned with a 3-slot
+ * offset, which puts the four children of every node in the same 64-byte
+ * line.  Every event remembers its slot in ev_timeout_pos.min_heap_idx,
+ * which makes erase and adjust O(log n).
+ */
+
 #include "lu_event-internal.h"
 #include "lu_event_struct.h"
 //#include "lu_mm-internal.h"
 #include "lu_memory_manager.h"
 #include "lu_util.h"
 
-typedef struct lu_min_heap_s {
-  lu_event_t ** elements;
-  lu_size_t n;
-  lu_size_t capacity;
-}lu_min_heap_t;
-
+/* Children of slot i are slots LU_MIN_HEAP_ARITY*i+1 .. LU_MIN_HEAP_ARITY*i+LU_MIN_HEAP_ARITY. */
+#define LU_MIN_HEAP_ARITY       4
+/* Alignment of the slot array. */
+#define LU_MIN_HEAP_CACHELINE   64
+/* Number of unused slots in front of slot 0, so that the first child of
+ * every node starts a cache line. */
+#define LU_MIN_HEAP_PAD         (LU_MIN_HEAP_ARITY - 1)
 
 
 static inline void lu_min_heap_constructor_(lu_min_heap_t * heap);
@@ -20,19 +33,40 @@ static inline void lu_min_heap_destructor_(lu_min_heap_t * heap);
 static inline void lu_min_heap_element_init_(lu_event_t * event);
 static inline int  lu_min_heap_elt_is_top_(const lu_event_t * event);
 static inline int  lu_min_heap_empty_(lu_min_heap_t * heap);
-static inline size_t lu_min_heaps_size_(lu_min_heap_t * heap);
+static inline size_t lu_min_heap_size_(lu_min_heap_t * heap);
 static inline lu_event_t * lu_min_heap_top_(lu_min_heap_t * heap);
 static inline int  lu_min_heap_reserve_(lu_min_heap_t * heap, size_t n);
 static inline int  lu_min_heap_push_(lu_min_heap_t * heap, lu_event_t * event);
 static inline lu_event_t * lu_min_heap_pop_(lu_min_heap_t * heap);
 static inline int  lu_min_heap_adjust_(lu_min_heap_t * heap, lu_event_t * event);
 static inline int  lu_min_heap_erase_(lu_min_heap_t * heap, lu_event_t * event);
-static inline void lu_min_heap_shift_up_(lu_min_heap_t * heap, size_t hole_index, lu_event_t * event);
-static inline void lu_min_heap_shift_up_unconditional_(lu_min_heap_t * heap, size_t hole_index, lu_event_t * event);
-static inline void lu_min_heap_shift_down_(lu_min_heap_t * heap, size_t hole_index, lu_event_t * event);
+static inline void lu_min_heap_shift_up_(lu_min_heap_t * heap, size_t hole_index, lu_min_heap_entry_t entry);
+static inline void lu_min_heap_shift_up_unconditional_(lu_min_heap_t * heap, size_t hole_index, lu_min_heap_entry_t entry);
+static inline void lu_min_heap_shift_down_(lu_min_heap_t * heap, size_t hole_index, lu_min_heap_entry_t entry);
+
+#define lu_min_heap_parent_(i)      (((i) - 1) / LU_MIN_HEAP_ARITY)
+#define lu_min_heap_first_child_(i) (LU_MIN_HEAP_ARITY * (i) + 1)
+
+/** The heap key of an event: its absolute timeout in microseconds. */
+static inline lu_int64_t lu_min_heap_key_(const lu_event_t *event)
+{
+  return (lu_int64_t)event->ev_timeout.tv_sec * 1000000 + event->ev_timeout.tv_usec;
+}
 
-#define lu_min_heap_element_greater_(a, b) \
-  (lu_evutil_timercmp(&(a)->ev_timeout, &(b)->ev_timeout, >))//TODO:
+static inline lu_min_heap_entry_t lu_min_heap_make_entry_(lu_event_t *event)
+{
+  lu_min_heap_entry_t entry;
+  entry.key = lu_min_heap_key_(event);
+  entry.ev = event;
+  return entry;
+}
+
+/** Store entry in slot i and tell the event where it is. */
+static inline void lu_min_heap_place_(lu_min_heap_t *heap, size_t i, lu_min_heap_entry_t entry)
+{
+  heap->elements[i] = entry;
+  entry.ev->ev_timeout_pos.min_heap_idx = i;
+}
 
 void lu_min_heap_constructor_(lu_min_heap_t *heap) {
   heap->elements = NULL;
@@ -42,17 +76,147 @@ void lu_min_heap_constructor_(lu_min_heap_t *heap) {
 
 void lu_min_heap_destructor_(lu_min_heap_t *heap) {
   if (heap->elements) {
-    mm_free(heap->elements);
+    mm_free(heap->elements - LU_MIN_HEAP_PAD);
   }
+  heap->elements = NULL;
+  heap->n = heap->capacity = 0;
 }
 
 void lu_min_heap_element_init_(lu_event_t *event) {
   event->ev_timeout_pos.min_heap_idx = LU_SIZE_MAX;
 }
 
-void lu_min_heap_empty_(lu_min_heap_t * heap){
-  
+int lu_min_heap_elt_is_top_(const lu_event_t *event) {
+  return event->ev_timeout_pos.min_heap_idx == 0;
+}
+
+int lu_min_heap_empty_(lu_min_heap_t * heap){
+  return heap->n == 0;
+}
+
+size_t lu_min_heap_size_(lu_min_heap_t *heap) {
+  return heap->n;
+}
+
+lu_event_t *lu_min_heap_top_(lu_min_heap_t *heap) {
+  return heap->n ? heap->elements[0].ev : NULL;
+}
+
+int lu_min_heap_reserve_(lu_min_heap_t *heap, size_t n) {
+  if (heap->capacity < n) {
+    lu_min_heap_entry_t *mem;
+    size_t capacity = heap->capacity ? heap->capacity * 2 : 8;
+    if (capacity < n)
+      capacity = n;
+    mem = mm_memalign((capacity + LU_MIN_HEAP_PAD) * sizeof(lu_min_heap_entry_t),
+        LU_MIN_HEAP_CACHELINE);
+    if (mem == NULL)
+      return -1;
+    if (heap->elements) {
+      memcpy(mem + LU_MIN_HEAP_PAD, heap->elements,
+          heap->n * sizeof(lu_min_heap_entry_t));
+      mm_free(heap->elements - LU_MIN_HEAP_PAD);
+    }
+    heap->elements = mem + LU_MIN_HEAP_PAD;
+    heap->capacity = capacity;
+  }
+  return 0;
+}
+
+int lu_min_heap_push_(lu_min_heap_t *heap, lu_event_t *event) {
+  if (heap->n == LU_SIZE_MAX || lu_min_heap_reserve_(heap, heap->n + 1))
+    return -1;
+  lu_min_heap_shift_up_(heap, heap->n++, lu_min_heap_make_entry_(event));
+  return 0;
+}
+
+lu_event_t *lu_min_heap_pop_(lu_min_heap_t *heap) {
+  if (heap->n) {
+    lu_event_t *top = heap->elements[0].ev;
+    lu_min_heap_shift_down_(heap, 0, heap->elements[--heap->n]);
+    top->ev_timeout_pos.min_heap_idx = LU_SIZE_MAX;
+    return top;
+  }
+  return NULL;
+}
+
+int lu_min_heap_erase_(lu_min_heap_t *heap, lu_event_t *event) {
+  size_t idx = event->ev_timeout_pos.min_heap_idx;
+  if (idx != LU_SIZE_MAX) {
+    lu_min_heap_entry_t last = heap->elements[--heap->n];
+    if (idx != heap->n) {
+      /* we replace e with the last element in the heap.  We might need to
+         shift it upward if it is less than its parent, or downward if it is
+         greater than one or both its children. Since the children are known
+         to be less than the parent, it can't need to shift both up and
+         down. */
+      if (idx > 0 && heap->elements[lu_min_heap_parent_(idx)].key > last.key)
+        lu_min_heap_shift_up_unconditional_(heap, idx, last);
+      else
+        lu_min_heap_shift_down_(heap, idx, last);
+    }
+    event->ev_timeout_pos.min_heap_idx = LU_SIZE_MAX;
+    return 0;
+  }
+  return -1;
+}
+
+int lu_min_heap_adjust_(lu_min_heap_t *heap, lu_event_t *event) {
+  size_t idx = event->ev_timeout_pos.min_heap_idx;
+  lu_min_heap_entry_t entry;
+  if (idx == LU_SIZE_MAX)
+    return lu_min_heap_push_(heap, event);
+
+  /* The event's timeout changed: refresh the inline key and move it. */
+  entry = lu_min_heap_make_entry_(event);
+  if (idx > 0 && heap->elements[lu_min_heap_parent_(idx)].key > entry.key)
+    lu_min_heap_shift_up_unconditional_(heap, idx, entry);
+  else
+    lu_min_heap_shift_down_(heap, idx, entry);
+  return 0;
+}
+
+void lu_min_heap_shift_up_unconditional_(lu_min_heap_t *heap, size_t hole_index, lu_min_heap_entry_t entry) {
+  size_t parent = lu_min_heap_parent_(hole_index);
+  do {
+    lu_min_heap_place_(heap, hole_index, heap->elements[parent]);
+    hole_index = parent;
+    parent = lu_min_heap_parent_(hole_index);
+  } while (hole_index && heap->elements[parent].key > entry.key);
+  lu_min_heap_place_(heap, hole_index, entry);
+}
+
+void lu_min_heap_shift_up_(lu_min_heap_t *heap, size_t hole_index, lu_min_heap_entry_t entry) {
+  size_t parent = lu_min_heap_parent_(hole_index);
+  while (hole_index && heap->elements[parent].key > entry.key) {
+    lu_min_heap_place_(heap, hole_index, heap->elements[parent]);
+    hole_index = parent;
+    parent = lu_min_heap_parent_(hole_index);
+  }
+  lu_min_heap_place_(heap, hole_index, entry);
+}
+
+void lu_min_heap_shift_down_(lu_min_heap_t *heap, size_t hole_index, lu_min_heap_entry_t entry) {
+  size_t child = lu_min_heap_first_child_(hole_index);
+  while (child < heap->n) {
+    /* All children of hole_index share one cache line: pick the smallest. */
+    size_t last = child + LU_MIN_HEAP_ARITY;
+    size_t min_child = child;
+    size_t i;
+    if (last > heap->n)
+      last = heap->n;
+    for (i = child + 1; i < last; ++i) {
+      if (heap->elements[i].key < heap->elements[min_child].key)
+        min_child = i;
+    }
+    if (!(heap->elements[min_child].key < entry.key))
+      break;
+    lu_min_heap_place_(heap, hole_index, heap->elements[min_child]);
+    hole_index = min_child;
+    child = lu_min_heap_first_child_(hole_index);
+  }
+  lu_min_heap_place_(heap, hole_index, entry);
 }
 
 
-#endif /* LU_INCLUDE_MIN_HEAP_H */
\ No newline at end of file
+#endif /* LU_INCLUDE_MIN_HEAP_H */
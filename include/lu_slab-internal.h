@@ -0,0 +1,37 @@
+#ifndef LU_SLAB_INTERNAL_H_INCLUDED_
+#define LU_SLAB_INTERNAL_H_INCLUDED_
+
+/**
+ * @file lu_slab-internal.h
+ * @brief Fixed-size object allocator used for a base's events.
+ *
+ * Objects are carved out of cache-line-aligned slabs and recycled through
+ * an intrusive free list: the first word of a free object points to the
+ * next free one, so alloc and free are a pointer swap.  Slabs are only
+ * given back when the allocator is cleared, which keeps the heap from
+ * fragmenting under churn.  No locking; the base lock covers it.
+ */
+
+#include "lu_event-internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Set up an empty allocator for objects of obj_size bytes. */
+void  lu_slab_init_(lu_slab_t *slab, size_t obj_size);
+/** Return an uninitialized object, or NULL when out of memory. */
+void *lu_slab_alloc_(lu_slab_t *slab);
+/** Put an object from lu_slab_alloc_() back on the free list. */
+void  lu_slab_free_(lu_slab_t *slab, void *obj);
+/** Make sure at least n objects can be allocated without going to the
+ * system allocator.  Return 0 on success, -1 on failure. */
+int   lu_slab_reserve_(lu_slab_t *slab, size_t n);
+/** Release every slab.  Objects still allocated become invalid. */
+void  lu_slab_clear_(lu_slab_t *slab);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LU_SLAB_INTERNAL_H_INCLUDED_ */
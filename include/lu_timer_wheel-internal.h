@@ -0,0 +1,57 @@
+#ifndef LU_TIMER_WHEEL_INTERNAL_H_INCLUDED_
+#define LU_TIMER_WHEEL_INTERNAL_H_INCLUDED_
+
+/**
+ * @file lu_timer_wheel-internal.h
+ * @brief Hierarchical timing wheel for events that use a common timeout.
+ *
+ * The wheel only knows about ticks: an event's expiry tick is its
+ * ev_timeout (with the common-timeout bits masked off) rounded up to a
+ * whole tick, so an event is never reported due before its timeout.
+ * Insert and remove are O(1); advancing skips empty slots using the
+ * per-level occupancy bitmaps.  The base keeps a single heap timer armed
+ * for lu_timer_wheel_next_tick_().
+ */
+
+#include "lu_event-internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Returned by lu_timer_wheel_next_tick_() when the wheel is empty. */
+#define LU_TIMER_WHEEL_NO_TICK  (~(lu_uint64_t)0)
+
+/** Convert a time to ticks, rounding down. */
+lu_uint64_t lu_timer_wheel_tv_to_tick_(const struct timeval *tv);
+/** Convert a tick to the time at which it starts. */
+void lu_timer_wheel_tick_to_tv_(lu_uint64_t tick, struct timeval *tv);
+
+/** Initialize an empty wheel whose current tick is now_tick. */
+void lu_timer_wheel_init_(lu_timer_wheel_t *wheel, lu_uint64_t now_tick);
+
+/**
+ * Put ev on the wheel according to ev->ev_timeout.
+ * @return the tick at which the wheel must next be advanced for ev.
+ */
+lu_uint64_t lu_timer_wheel_insert_(lu_timer_wheel_t *wheel, lu_event_t *ev);
+/** Take ev off the wheel.  ev->ev_timeout must not have changed since it
+ * was inserted. */
+void lu_timer_wheel_remove_(lu_timer_wheel_t *wheel, lu_event_t *ev);
+
+/**
+ * Move the wheel forward to target_tick, cascading higher levels as their
+ * slots are reached.  Events that expire on or before target_tick end up
+ * on wheel->due; they are still on the wheel until removed.
+ */
+void lu_timer_wheel_advance_(lu_timer_wheel_t *wheel, lu_uint64_t target_tick);
+
+/** Return the earliest tick at which the wheel needs to be advanced, or
+ * LU_TIMER_WHEEL_NO_TICK if it is empty. */
+lu_uint64_t lu_timer_wheel_next_tick_(const lu_timer_wheel_t *wheel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LU_TIMER_WHEEL_INTERNAL_H_INCLUDED_ */
@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <inttypes.h>
+#include <sys/time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -167,19 +168,134 @@ LU_EVENT_EXPORT_SYMBOL const char *lu_evutil_socket_error_to_string(int errcode)
 
 
 
+/**
+   @name Manipulation macros for struct timeval.
+
+   We define replacements for timeradd, timersub, timerclear, timercmp, and
+   timerisset so that every caller gets the same semantics.
+   @{
+*/
+#define lu_evutil_timeradd(tvp, uvp, vvp)                           \
+    do {                                                            \
+        (vvp)->tv_sec = (tvp)->tv_sec + (uvp)->tv_sec;              \
+        (vvp)->tv_usec = (tvp)->tv_usec + (uvp)->tv_usec;           \
+        if ((vvp)->tv_usec >= 1000000) {                            \
+            (vvp)->tv_sec++;                                        \
+            (vvp)->tv_usec -= 1000000;                              \
+        }                                                           \
+    } while (0)
+
+#define lu_evutil_timersub(tvp, uvp, vvp)                           \
+    do {                                                            \
+        (vvp)->tv_sec = (tvp)->tv_sec - (uvp)->tv_sec;              \
+        (vvp)->tv_usec = (tvp)->tv_usec - (uvp)->tv_usec;           \
+        if ((vvp)->tv_usec < 0) {                                   \
+            (vvp)->tv_sec--;                                        \
+            (vvp)->tv_usec += 1000000;                              \
+        }                                                           \
+    } while (0)
+
+#define lu_evutil_timerclear(tvp)   (tvp)->tv_sec = (tvp)->tv_usec = 0
+
+#define lu_evutil_timerisset(tvp)   ((tvp)->tv_sec || (tvp)->tv_usec)
+
+/** Return true iff the tvp is related to uvp according to the relational
+ * operator cmp.  Recognized values for cmp are ==, <=, <, >=, and >. */
+#define lu_evutil_timercmp(tvp, uvp, cmp)                           \
+    (((tvp)->tv_sec == (uvp)->tv_sec) ?                             \
+     ((tvp)->tv_usec cmp (uvp)->tv_usec) :                          \
+     ((tvp)->tv_sec cmp (uvp)->tv_sec))
+/**@}*/
+
+struct timeval;
+
+/** Convert a timeval to milliseconds, rounding up.  Return -1 if the result
+ * would overflow a long. */
+long lu_evutil_tv_to_msec_(const struct timeval *tv);
+
+/** Put fd into nonblocking mode.  Return 0 on success, -1 on failure. */
+int lu_evutil_make_socket_nonblocking(lu_evutil_socket_t fd);
+/** Let a listening socket be rebound right after it is closed
+ * (SO_REUSEADDR).  Return 0 on success, -1 on failure. */
+int lu_evutil_make_listen_socket_reuseable(lu_evutil_socket_t sock);
+/** Let several sockets listen on the same address and port, with the
+ * kernel spreading incoming connections across them (SO_REUSEPORT).
+ * Return 0 on success, -1 on failure. */
+int lu_evutil_make_listen_socket_reuseable_port(lu_evutil_socket_t sock);
+/** Have the kernel busy-poll the device queue for up to usec microseconds
+ * when a read on sock would block (SO_BUSY_POLL).  Return 0 on success,
+ * -1 on failure. */
+int lu_evutil_make_socket_busy_poll(lu_evutil_socket_t sock, int usec);
+
+/**
+   @name Draining helpers for edge-triggered events
+
+   With LU_EV_ET the backend reports an fd once per readiness change, not
+   while it stays ready: a callback that stops reading before the fd
+   would block gets no further wakeup for the data left behind.  These
+   helpers loop on read()/write() until EAGAIN, and say whether the edge
+   was consumed.
+   @{
+*/
+/** The edge was consumed: the fd would block now, and its next readiness
+ * change will be reported. */
+#define LU_EVUTIL_EDGE_CONSUMED  0
+/** The buffer filled (or, for writes, emptied) before the fd would block.
+ * For reads, data may be left that no new edge will report; read it later
+ * or re-activate the event with lu_event_active(). */
+#define LU_EVUTIL_EDGE_PENDING   1
+/** The peer closed the connection (read() returned 0). */
+#define LU_EVUTIL_EDGE_EOF       2
+
+/**
+ * Read from a nonblocking fd until it would block, buf is full, or EOF.
+ * @param nread set to the number of bytes read into buf, even on error
+ * @return one of LU_EVUTIL_EDGE_*, or -1 on error with errno set.
+ */
+int lu_evutil_read_drain(lu_evutil_socket_t fd, void *buf, size_t len,
+    size_t *nread);
+/**
+ * Write buf to a nonblocking fd until it would block or all is written.
+ * LU_EVUTIL_EDGE_CONSUMED means some data is left; write the rest from
+ * the next LU_EV_WRITE callback.
+ * @param nwritten set to the number of bytes written, even on error
+ * @return one of LU_EVUTIL_EDGE_CONSUMED or LU_EVUTIL_EDGE_PENDING, or -1
+ *         on error with errno set.
+ */
+int lu_evutil_write_drain(lu_evutil_socket_t fd, const void *buf, size_t len,
+    size_t *nwritten);
+/**@}*/
+
 #define LU_EVENT_HASH_TABLE_SIZE 32  // 哈希表大小
 #define LU_EVENT_MONOT_PRECISE  1 // 高精度
 #define LU_EVENT_MONOT_FALLBACK 2 // 低精度
 
 
+/** State of a monotonic clock, set up by lu_evutil_configure_monotonic_time_().
+ *
+ * monotonic_clock is the clockid_t to pass to clock_gettime(), or -1 when
+ * no monotonic clock is available and gettimeofday() is used instead; in
+ * that case adjust_monotonic_clock and last_time keep the result from ever
+ * going backwards. */
 typedef struct lu_evutil_monotonic_timer_s{
-    //TODO: to be implemented
-    int dummy;
+    int monotonic_clock;
+    struct timeval adjust_monotonic_clock;
+    struct timeval last_time;
 }lu_evutil_monotonic_timer_t;
 
 
 const char * lu_evutil_getenv_(const char *varname);
+/** Pick the clock for 'base'.  flags is 0 or LU_EVENT_MONOT_PRECISE /
+ * LU_EVENT_MONOT_FALLBACK.  Returns 0 on success. */
 int lu_evutil_configure_monotonic_time_( lu_evutil_monotonic_timer_t *base,int flags);
+/** Set *tp to the current time of the clock chosen for 'base'.
+ * Returns 0 on success, -1 on failure. */
+int lu_evutil_gettime_monotonic_(lu_evutil_monotonic_timer_t *base,
+    struct timeval *tp);
+/** Set *tp to the current CLOCK_MONOTONIC time, whatever clock the base
+ * uses, for measuring spans shorter than a coarse clock tick.  Returns 0
+ * on success, -1 on failure. */
+int lu_evutil_gettime_precise_(struct timeval *tp);
 
 #ifdef __cplusplus  
 }
@@ -0,0 +1,512 @@
+/**
+ * @file lu_epoll.c
+ * @brief epoll(7) backend for lu_event_base_t.
+ *
+ * epoll is the O(1) readiness interface on Linux: the interest set lives in
+ * the kernel, so each dispatch only returns the fds that are actually ready.
+ */
+#include "lu_event-internal.h"
+#include "lu_event.h"
+#include "lu_evmap-internal.h"
+#include "lu_changelist-internal.h"
+#include "lu_log-internal.h"
+#include "lu_memory_manager.h"
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Since Linux 2.6.17, epoll is able to report about peer half-closed
+ * connection using special EPOLLRDHUP flag on a read event. */
+#ifndef EPOLLRDHUP
+#define EPOLLRDHUP 0
+#endif
+
+/* Since Linux 4.5; older kernels don't know the bit and wake every
+ * waiter, as without it. */
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+#define LU_EPOLL_INITIAL_NEVENT 32
+#define LU_EPOLL_MAX_NEVENT     4096
+/* Halve the result array after this many waits in a row that returned
+ * events but filled less than a quarter of it. */
+#define LU_EPOLL_SHRINK_AFTER   128
+
+/* On Linux kernels at least up to 2.6.24.4, epoll can't handle timeout
+ * values bigger than (LONG_MAX - 999ULL)/HZ.  HZ in the wild can be
+ * as big as 1000, and LONG_MAX can be as small as (1<<31)-1, so the
+ * largest number of msec we can support here is 2147482.  Let's
+ * round that down by 47 seconds.
+ */
+#define LU_MAX_EPOLL_TIMEOUT_MSEC (35*60*1000)
+
+
+typedef struct lu_epollop_s {
+    /* Result array handed to epoll_wait(); grows when it comes back full,
+     * shrinks when it stays mostly empty. */
+    struct epoll_event *events;
+    int nevents;
+    /* Waits in a row that used less than a quarter of events. */
+    int nunderused;
+    int epfd;
+    /* timerfd used for sub-millisecond dispatch timeouts, or -1 */
+    int timerfd;
+    /* True if timerfd may currently be armed */
+    int timerfd_armed;
+} lu_epollop_t;
+
+
+static void *lu_epoll_init(lu_event_base_t *base);
+static int   lu_epoll_dispatch(lu_event_base_t *base, struct timeval *tv);
+static void  lu_epoll_dealloc(lu_event_base_t *base);
+static int   lu_epoll_nochangelist_add(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p);
+static int   lu_epoll_nochangelist_del(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p);
+
+const lu_event_op_t lu_epollops = {
+    "epoll",
+    lu_epoll_init,
+    lu_epoll_nochangelist_add,
+    lu_epoll_nochangelist_del,
+    lu_epoll_dispatch,
+    lu_epoll_dealloc,
+    1, /* need reinit */
+    LU_EVENT_FEATURE_ET|LU_EVENT_FEATURE_O1|LU_EVENT_FEATURE_EARLY_CLOSE|
+    LU_EVENT_FEATURE_EXCLUSIVE,
+    0
+};
+
+/* Same backend, but add/del only record the change in base->changelist,
+ * and dispatch applies the net change per fd right before waiting. */
+static const lu_event_op_t lu_epollops_changelist = {
+    "epoll (with changelist)",
+    lu_epoll_init,
+    lu_event_changelist_add_,
+    lu_event_changelist_del_,
+    lu_epoll_dispatch,
+    lu_epoll_dealloc,
+    1, /* need reinit */
+    LU_EVENT_FEATURE_ET|LU_EVENT_FEATURE_O1|LU_EVENT_FEATURE_EARLY_CLOSE|
+    LU_EVENT_FEATURE_EXCLUSIVE,
+    LU_EVENT_CHANGELIST_FDINFO_SIZE
+};
+
+
+static void *lu_epoll_init(lu_event_base_t *base)
+{
+    int epfd;
+    lu_epollop_t *epollop;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        if (errno != ENOSYS)
+            lu_event_warn("epoll_create1");
+        return (NULL);
+    }
+
+    if (!(epollop = mm_calloc(1, sizeof(lu_epollop_t)))) {
+        close(epfd);
+        return (NULL);
+    }
+
+    epollop->epfd = epfd;
+
+    /* Initialize fields */
+    epollop->events = mm_calloc(LU_EPOLL_INITIAL_NEVENT, sizeof(struct epoll_event));
+    if (epollop->events == NULL) {
+        mm_free(epollop);
+        close(epfd);
+        return (NULL);
+    }
+    epollop->nevents = LU_EPOLL_INITIAL_NEVENT;
+    base->dispatch_counters.backend_nevents = epollop->nevents;
+
+    epollop->timerfd = -1;
+
+    if ((base->flags & LU_EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST) != 0 ||
+        ((base->flags & LU_EVENT_BASE_FLAG_IGNORE_ENV) == 0 &&
+        lu_evutil_getenv_("LU_EVENT_EPOLL_USE_CHANGELIST") != NULL)) {
+
+        base->evsel_op = &lu_epollops_changelist;
+    }
+
+    /* epoll_wait() only takes milliseconds.  With a precise timer, wait
+     * on a timerfd instead, which has nanosecond resolution. */
+    if ((base->flags & LU_EVENT_BASE_FLAG_PRECISE_TIMER) &&
+        !(base->flags & LU_EVENT_BASE_FLAG_EPOLL_DISALLOW_TIMERFD)) {
+
+        int fd;
+        fd = epollop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if (epollop->timerfd >= 0) {
+            struct epoll_event epev;
+            memset(&epev, 0, sizeof(epev));
+            epev.data.fd = epollop->timerfd;
+            epev.events = EPOLLIN;
+            if (epoll_ctl(epollop->epfd, EPOLL_CTL_ADD, fd, &epev) < 0) {
+                lu_event_warn("epoll_ctl(timerfd)");
+                close(fd);
+                epollop->timerfd = -1;
+            }
+        } else {
+            if (errno != EINVAL && errno != ENOSYS) {
+                /* These errors probably mean that we were
+                 * compiled with timerfd/TFD_* support, but
+                 * we're running on a kernel that lacks those.
+                 */
+                lu_event_warn("timerfd_create");
+            }
+            epollop->timerfd = -1;
+        }
+    }
+
+    return (epollop);
+}
+
+static const char *lu_epoll_op_to_string(int op)
+{
+    return op == EPOLL_CTL_ADD ? "ADD" :
+        op == EPOLL_CTL_DEL ? "DEL" :
+        op == EPOLL_CTL_MOD ? "MOD" :
+        "???";
+}
+
+static const char *lu_epoll_change_to_string(int change)
+{
+    change &= (LU_EV_CHANGE_ADD|LU_EV_CHANGE_DEL);
+    if (change == LU_EV_CHANGE_ADD) {
+        return "add";
+    } else if (change == LU_EV_CHANGE_DEL) {
+        return "del";
+    } else if (change == 0) {
+        return "none";
+    } else {
+        return "???";
+    }
+}
+
+/** Apply a single changelist entry to a flag set, returning the new set. */
+static short lu_epoll_apply_change_bits(short events, lu_uint8_t change, short flag)
+{
+    if (change & LU_EV_CHANGE_ADD)
+        events |= flag;
+    else if (change & LU_EV_CHANGE_DEL)
+        events &= ~flag;
+    return events;
+}
+
+static int lu_epoll_apply_one_change(lu_event_base_t *base,
+    lu_epollop_t *epollop, const lu_event_change_t *ch)
+{
+    struct epoll_event epev;
+    short new_events;
+    int op, events = 0;
+
+    (void)base;
+
+    new_events = ch->old_events;
+    new_events = lu_epoll_apply_change_bits(new_events, ch->read_change, LU_EV_READ);
+    new_events = lu_epoll_apply_change_bits(new_events, ch->write_change, LU_EV_WRITE);
+    new_events = lu_epoll_apply_change_bits(new_events, ch->error_change, LU_EV_CLOSED);
+    new_events &= (LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED);
+
+    if (new_events == (ch->old_events & (LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED)))
+        return 0;
+
+    if (new_events & LU_EV_READ)
+        events |= EPOLLIN;
+    if (new_events & LU_EV_WRITE)
+        events |= EPOLLOUT;
+    if (new_events & LU_EV_CLOSED)
+        events |= EPOLLRDHUP;
+    /* evmap never mixes edge- and level-triggered events on one fd, so
+     * any change that carries LU_EV_ET speaks for the whole fd. */
+    if ((ch->read_change|ch->write_change|ch->error_change) & LU_EV_CHANGE_ET)
+        events |= EPOLLET;
+    /* EPOLLEXCLUSIVE can't be combined with EPOLLRDHUP. */
+    if ((ch->read_change|ch->write_change|ch->error_change) & LU_EV_CHANGE_EXCLUSIVE)
+        events = (events & ~EPOLLRDHUP) | EPOLLEXCLUSIVE;
+
+    if (!(ch->old_events & (LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED)))
+        op = EPOLL_CTL_ADD;
+    else if (new_events == 0)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    memset(&epev, 0, sizeof(epev));
+    epev.data.fd = ch->fd;
+    epev.events = events;
+
+    /* An exclusive registration can't be modified, only replaced. */
+    if (op == EPOLL_CTL_MOD && (events & EPOLLEXCLUSIVE)) {
+        epoll_ctl(epollop->epfd, EPOLL_CTL_DEL, ch->fd, &epev);
+        op = EPOLL_CTL_ADD;
+    }
+
+    if (epoll_ctl(epollop->epfd, op, ch->fd, &epev) == 0) {
+        return 0;
+    }
+
+    switch (op) {
+    case EPOLL_CTL_MOD:
+        if (errno == ENOENT) {
+            /* If a MOD operation fails with ENOENT, the
+             * fd was probably closed and re-opened.  We
+             * should retry the operation as an ADD.
+             */
+            if (epoll_ctl(epollop->epfd, EPOLL_CTL_ADD, ch->fd, &epev) == -1) {
+                lu_event_warn("Epoll MOD(%d) on %d retried as ADD; that failed too",
+                    (int)epev.events, ch->fd);
+                return -1;
+            }
+            return 0;
+        }
+        break;
+    case EPOLL_CTL_ADD:
+        if (errno == EEXIST) {
+            /* If an ADD operation fails with EEXIST,
+             * either the operation was redundant (as with a
+             * precautionary add), or we ran into a fun
+             * kernel bug where using dup*() to duplicate the
+             * same file into the same fd gives you the same epitem
+             * rather than a fresh one.  For the second case,
+             * we must retry with MOD. */
+            if (epoll_ctl(epollop->epfd, EPOLL_CTL_MOD, ch->fd, &epev) == -1) {
+                lu_event_warn("Epoll ADD(%d) on %d retried as MOD; that failed too",
+                    (int)epev.events, ch->fd);
+                return -1;
+            }
+            return 0;
+        }
+        break;
+    case EPOLL_CTL_DEL:
+        if (errno == ENOENT || errno == EBADF || errno == EPERM) {
+            /* If a delete fails with one of these errors,
+             * that's fine too: we closed the fd before we
+             * got around to calling epoll_dispatch. */
+            return 0;
+        }
+        break;
+    default:
+        break;
+    }
+
+    lu_event_warn("Epoll %s(%d) on fd %d failed. Old events were %d; read change was %d (%s); write change was %d (%s); close change was %d (%s)",
+        lu_epoll_op_to_string(op),
+        (int)epev.events,
+        (int)ch->fd,
+        ch->old_events,
+        ch->read_change,
+        lu_epoll_change_to_string(ch->read_change),
+        ch->write_change,
+        lu_epoll_change_to_string(ch->write_change),
+        ch->error_change,
+        lu_epoll_change_to_string(ch->error_change));
+
+    return -1;
+}
+
+/** Apply every queued change, then empty the changelist. */
+static int lu_epoll_apply_changes(lu_event_base_t *base)
+{
+    lu_event_changelist_t *changelist = &base->changelist;
+    lu_epollop_t *epollop = base->evbase;
+    lu_event_change_t *ch;
+    int r = 0;
+    int i;
+
+    for (i = 0; i < changelist->n_changes; ++i) {
+        ch = &changelist->changes[i];
+        if (lu_epoll_apply_one_change(base, epollop, ch) < 0)
+            r = -1;
+    }
+
+    ++base->stats.changelist_flushes;
+    base->stats.changelist_changes += changelist->n_changes;
+    if (changelist->n_changes > base->stats.changelist_max_flush)
+        base->stats.changelist_max_flush = changelist->n_changes;
+
+    lu_event_changelist_remove_all_(changelist, base);
+
+    return (r);
+}
+
+static int lu_epoll_nochangelist_add(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p)
+{
+    lu_event_change_t ch;
+
+    (void)p;
+
+    ch.fd = fd;
+    ch.old_events = old;
+    ch.read_change = ch.write_change = ch.error_change = 0;
+    if (events & LU_EV_WRITE)
+        ch.write_change = LU_EV_CHANGE_ADD | (events & (LU_EV_ET|LU_EV_EXCLUSIVE));
+    if (events & LU_EV_READ)
+        ch.read_change = LU_EV_CHANGE_ADD | (events & (LU_EV_ET|LU_EV_EXCLUSIVE));
+    if (events & LU_EV_CLOSED)
+        ch.error_change = LU_EV_CHANGE_ADD | (events & (LU_EV_ET|LU_EV_EXCLUSIVE));
+
+    return lu_epoll_apply_one_change(base, base->evbase, &ch);
+}
+
+static int lu_epoll_nochangelist_del(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p)
+{
+    lu_event_change_t ch;
+
+    (void)p;
+
+    ch.fd = fd;
+    ch.old_events = old;
+    ch.read_change = ch.write_change = ch.error_change = 0;
+    if (events & LU_EV_WRITE)
+        ch.write_change = LU_EV_CHANGE_DEL | (events & (LU_EV_ET|LU_EV_EXCLUSIVE));
+    if (events & LU_EV_READ)
+        ch.read_change = LU_EV_CHANGE_DEL | (events & (LU_EV_ET|LU_EV_EXCLUSIVE));
+    if (events & LU_EV_CLOSED)
+        ch.error_change = LU_EV_CHANGE_DEL | (events & (LU_EV_ET|LU_EV_EXCLUSIVE));
+
+    return lu_epoll_apply_one_change(base, base->evbase, &ch);
+}
+
+/** Reallocate the result array to hold new_nevents entries.  On failure
+ * the old array is kept, which is always safe. */
+static void lu_epoll_resize(lu_event_base_t *base, lu_epollop_t *epollop,
+    int new_nevents)
+{
+    struct epoll_event *new_events;
+
+    epollop->nunderused = 0;
+    new_events = mm_realloc(epollop->events,
+        new_nevents * sizeof(struct epoll_event));
+    if (new_events) {
+        epollop->events = new_events;
+        epollop->nevents = new_nevents;
+        base->dispatch_counters.backend_nevents = new_nevents;
+    }
+}
+
+static int lu_epoll_dispatch(lu_event_base_t *base, struct timeval *tv)
+{
+    lu_epollop_t *epollop = base->evbase;
+    struct epoll_event *events = epollop->events;
+    int i, res;
+    long timeout = -1;
+
+    if (base->changelist.n_changes)
+        lu_epoll_apply_changes(base);
+
+    if (epollop->timerfd >= 0) {
+        struct itimerspec is;
+        is.it_interval.tv_sec = 0;
+        is.it_interval.tv_nsec = 0;
+        if (tv == NULL) {
+            /* No timeout; disarm the timer. */
+            is.it_value.tv_sec = 0;
+            is.it_value.tv_nsec = 0;
+        } else {
+            if (tv->tv_sec == 0 && tv->tv_usec == 0) {
+                /* we need to exit immediately; timerfd can't
+                 * do that. */
+                timeout = 0;
+            }
+            is.it_value.tv_sec = tv->tv_sec;
+            is.it_value.tv_nsec = tv->tv_usec * 1000;
+        }
+        /* Skip the syscall when the timer is already disarmed and we
+         * only want to keep it that way. */
+        if (is.it_value.tv_sec || is.it_value.tv_nsec || epollop->timerfd_armed) {
+            if (timerfd_settime(epollop->timerfd, 0, &is, NULL) < 0)
+                lu_event_warn("timerfd_settime");
+            epollop->timerfd_armed = (is.it_value.tv_sec || is.it_value.tv_nsec);
+        }
+    } else if (tv != NULL) {
+        timeout = lu_evutil_tv_to_msec_(tv);
+        if (timeout < 0 || timeout > LU_MAX_EPOLL_TIMEOUT_MSEC) {
+            /* Linux kernels can wait forever if the timeout is
+             * too big; see comment on LU_MAX_EPOLL_TIMEOUT_MSEC. */
+            timeout = LU_MAX_EPOLL_TIMEOUT_MSEC;
+        }
+    }
+
+    LU_EVBASE_RELEASE_LOCK(base);
+
+    res = epoll_wait(epollop->epfd, events, epollop->nevents, timeout);
+
+    LU_EVBASE_ACQUIRE_LOCK(base);
+
+    if (res == -1) {
+        if (errno != EINTR) {
+            lu_event_warn("epoll_wait");
+            return (-1);
+        }
+
+        return (0);
+    }
+
+    event_debug(("%s: epoll_wait reports %d", __func__, res));
+
+    for (i = 0; i < res; i++) {
+        int what = events[i].events;
+        short ev = 0;
+
+        if (events[i].data.fd == epollop->timerfd)
+            continue;
+
+        if (what & EPOLLERR) {
+            ev = LU_EV_READ | LU_EV_WRITE;
+        } else if ((what & EPOLLHUP) && !(what & EPOLLRDHUP)) {
+            ev = LU_EV_READ | LU_EV_WRITE;
+        } else {
+            if (what & EPOLLIN)
+                ev |= LU_EV_READ;
+            if (what & EPOLLOUT)
+                ev |= LU_EV_WRITE;
+            if (what & EPOLLRDHUP)
+                ev |= LU_EV_CLOSED;
+        }
+
+        if (!ev)
+            continue;
+
+        lu_evmap_io_active_(base, events[i].data.fd, ev);
+    }
+
+    if (res == epollop->nevents && epollop->nevents < LU_EPOLL_MAX_NEVENT) {
+        /* We used all of the event space this time.  We should
+           be ready for more events next time. */
+        lu_epoll_resize(base, epollop, epollop->nevents * 2);
+    } else if (res > 0 && res < epollop->nevents / 4 &&
+        epollop->nevents > LU_EPOLL_INITIAL_NEVENT) {
+        /* Empty waits (timeouts, busy polling) say nothing about the
+         * load, so only count the ones that returned something. */
+        if (++epollop->nunderused >= LU_EPOLL_SHRINK_AFTER)
+            lu_epoll_resize(base, epollop, epollop->nevents / 2);
+    } else if (res > 0) {
+        epollop->nunderused = 0;
+    }
+
+    return (0);
+}
+
+static void lu_epoll_dealloc(lu_event_base_t *base)
+{
+    lu_epollop_t *epollop = base->evbase;
+
+    if (epollop->events)
+        mm_free(epollop->events);
+    if (epollop->epfd >= 0)
+        close(epollop->epfd);
+    if (epollop->timerfd >= 0)
+        close(epollop->timerfd);
+
+    memset(epollop, 0, sizeof(lu_epollop_t));
+    mm_free(epollop);
+}
@@ -2,6 +2,11 @@
 #include "lu_memory_manager.h"
 #include "lu_changelist-internal.h"
 #include "lu_event-internal.h"
+#include "lu_evmap-internal.h"
+#include "lu_min_heap.h"
+#include "lu_timer_wheel-internal.h"
+#include "lu_slab-internal.h"
+#include "lu_evsignal-internal.h"
 #include "lu_event.h"
 #include "lu_util.h"
 
@@ -9,15 +14,69 @@
 #include <limits.h>
 #include <error.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 
+extern const lu_event_op_t lu_epollops;
+extern const lu_event_op_t lu_io_uringops;
+
+/* Array of backends in order of preference. io_uring is picked when epoll
+ * is avoided through lu_event_config_avoid_method() or LU_EVENT_NOEPOLL. */
+static const lu_event_op_t *lu_eventops_[] = {
+  &lu_epollops,
+  &lu_io_uringops,
+  NULL
+};
+
+#define LU_INCR_EVENT_COUNT(base,flags) do {					\
+	((base)->event_count += !((flags) & LU_EVLIST_INTERNAL));			\
+	LU_MAX_EVENT_COUNT((base)->event_count_max, (base)->event_count);		\
+} while (0)
+#define LU_DECR_EVENT_COUNT(base,flags) \
+	((base)->event_count -= !((flags) & LU_EVLIST_INTERNAL))
+#define LU_MAX_EVENT_COUNT(var, v) var = ((var) > (v) ? (var) : (v))
+
+/* Most non-event callbacks (such as offloaded work completions) to
+ * activate from the cross-thread queue in one loop iteration. */
+#define LU_MAX_DEFERREDS_QUEUED 32
+
 
 static void lu_event_config_entry_free(lu_event_config_entry_t * entry);
- 
+static int  lu_event_base_priority_init_(lu_event_base_t *base, int npriorities);
+static void lu_event_queue_insert_active(lu_event_base_t *base, lu_event_callback_t *evcb);
+static void lu_event_queue_remove_active(lu_event_base_t *base, lu_event_callback_t *evcb);
+static void lu_event_queue_insert_inserted(lu_event_base_t *base, lu_event_t *ev);
+static void lu_event_queue_remove_inserted(lu_event_base_t *base, lu_event_t *ev);
+static void lu_event_queue_insert_timeout(lu_event_base_t *base, lu_event_t *ev);
+static void lu_event_queue_remove_timeout(lu_event_base_t *base, lu_event_t *ev);
+static void lu_event_queue_reinsert_timeout(lu_event_base_t *base, lu_event_t *ev);
+static int  lu_event_add_nolock_(lu_event_t *ev, const struct timeval *tv, int tv_is_absolute);
+static int  lu_event_del_nolock_(lu_event_t *ev);
+static void lu_common_timeout_callback(lu_evutil_socket_t fd, short what, void *arg);
+static void lu_common_timeout_schedule(lu_event_base_t *base, lu_uint64_t tick);
+static inline int lu_is_common_timeout(const struct timeval *tv,
+    const lu_event_base_t *base);
+static int  lu_evthread_notify_base(lu_event_base_t *base);
+static int  lu_event_process_async(lu_event_base_t *base);
+static void lu_event_async_cancel_(lu_event_base_t *base,
+    lu_event_callback_t *evcb);
+static int  lu_evthread_make_base_notifiable_nolock_(lu_event_base_t *base);
+static void lu_event_trace_free_(lu_event_trace_t *trace);
+
+/* Default spin budget of LU_EVENT_BASE_FLAG_BUSY_POLL. */
+#define LU_BUSY_POLL_DEFAULT_USEC 50
+
 lu_event_config_t * lu_event_config_new(void)
 {
    lu_event_config_t *ev_cfg_t = mm_calloc(1, sizeof(*ev_cfg_t));
-     
+
     if (ev_cfg_t == NULL)
       return (NULL);
 
@@ -26,41 +85,219 @@ lu_event_config_t * lu_event_config_new(void)
     ev_cfg_t->max_dispatch_callbacks = INT_MAX;
     ev_cfg_t->limit_callbacks_after_priority =   1;
     ev_cfg_t->max_dispatch_interval.tv_usec     = -1;
+    ev_cfg_t->busy_poll_budget.tv_usec = LU_BUSY_POLL_DEFAULT_USEC;
 
     return (ev_cfg_t);
 }
 
 
+/** How often (in seconds) to refresh tv_clock_diff against the wall
+ * clock. */
+#define LU_CLOCK_SYNC_INTERVAL 5
+
+/** Set 'tp' to the current monotonic time.  Inside the loop this is the
+ * time cached for the current iteration, unless the base was created with
+ * LU_EVENT_BASE_FLAG_NO_CACHE_TIME. */
 static int
-gettime(struct event_base *base, struct timeval *tp)
+gettime(lu_event_base_t *base, struct timeval *tp)
 {
-	//TODO: to be implemented
-  return 0;
+  if (base->tv_cache.tv_sec) {
+    *tp = base->tv_cache;
+    return (0);
+  }
+
+  if (lu_evutil_gettime_monotonic_(&base->monotonic_timer, tp) == -1)
+    return (-1);
+
+  if (base->last_updated_clock_diff + LU_CLOCK_SYNC_INTERVAL < tp->tv_sec) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    lu_evutil_timersub(&tv, tp, &base->tv_clock_diff);
+    base->last_updated_clock_diff = tp->tv_sec;
+  }
+
+  return (0);
+}
+
+/** Make the next gettime() read the clock again. */
+static inline void
+clear_time_cache(lu_event_base_t *base)
+{
+  base->tv_cache.tv_sec = 0;
+}
+
+/** Replace the cached time with the current time. */
+static inline void
+update_time_cache(lu_event_base_t *base)
+{
+  base->tv_cache.tv_sec = 0;
+  if (!(base->flags & LU_EVENT_BASE_FLAG_NO_CACHE_TIME))
+    gettime(base, &base->tv_cache);
+}
+
+int lu_event_base_gettimeofday_cached(lu_event_base_t *base, struct timeval *tv)
+{
+  int r;
+
+  if (base == NULL)
+    return (-1);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  if (base->tv_cache.tv_sec == 0) {
+    r = gettimeofday(tv, NULL);
+  } else {
+    lu_evutil_timeradd(&base->tv_cache, &base->tv_clock_diff, tv);
+    r = 0;
+  }
+  LU_EVBASE_RELEASE_LOCK(base);
+  return (r);
+}
+
+int lu_event_base_update_cache_time(lu_event_base_t *base)
+{
+  if (base == NULL)
+    return (-1);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  if (base->running_loop)
+    update_time_cache(base);
+  LU_EVBASE_RELEASE_LOCK(base);
+  return (0);
+}
+
+
+/** Return true iff the method called 'name' is in the avoid list of cfg. */
+static int lu_event_config_is_avoided_method(const lu_event_config_t *cfg, const char *name)
+{
+  lu_event_config_entry_t *entry;
+
+  TAILQ_FOREACH(entry, &cfg->entries, next) {
+    if (entry->avoid_method != NULL && strcmp(entry->avoid_method, name) == 0)
+      return (1);
+  }
+
+  return (0);
+}
+
+/** Return true iff the environment variable LU_EVENT_NO<NAME> is set. */
+static int lu_event_is_method_disabled(const char *name)
+{
+  char environment[64];
+  int i;
+
+  lu_evutil_snprintf(environment, sizeof(environment), "LU_EVENT_NO%s", name);
+  for (i = 11; environment[i] != '\0'; ++i)
+    environment[i] = toupper((unsigned char)environment[i]);
+
+  return (lu_evutil_getenv_(environment) != NULL);
+}
+
+int lu_event_config_avoid_method(lu_event_config_t *cfg, const char *method)
+{
+  lu_event_config_entry_t *entry = mm_malloc(sizeof(*entry));
+  if (entry == NULL)
+    return (-1);
+
+  if ((entry->avoid_method = mm_strdup(method)) == NULL) {
+    mm_free(entry);
+    return (-1);
+  }
+
+  TAILQ_INSERT_TAIL(&cfg->entries, entry, next);
+
+  return (0);
+}
+
+int lu_event_config_require_features(lu_event_config_t *cfg, int features)
+{
+  if (!cfg)
+    return (-1);
+  cfg->required_features = features;
+  return (0);
+}
+
+int lu_event_config_set_max_dispatch_interval(lu_event_config_t *cfg,
+    const struct timeval *max_interval, int max_callbacks, int min_priority)
+{
+  if (max_interval)
+    memcpy(&cfg->max_dispatch_interval, max_interval, sizeof(struct timeval));
+  else
+    cfg->max_dispatch_interval.tv_sec = -1;
+  cfg->max_dispatch_callbacks = max_callbacks >= 0 ? max_callbacks : INT_MAX;
+  if (min_priority < 0)
+    min_priority = 0;
+  cfg->limit_callbacks_after_priority = min_priority;
+  return (0);
+}
+
+int lu_event_config_set_busy_poll(lu_event_config_t *cfg,
+    const struct timeval *budget, int so_busy_poll_usec)
+{
+  if (!cfg || (budget && (budget->tv_sec < 0 || budget->tv_usec < 0)))
+    return (-1);
+  if (budget)
+    cfg->busy_poll_budget = *budget;
+  cfg->busy_poll_sock_usec = so_busy_poll_usec > 0 ? so_busy_poll_usec : 0;
+  cfg->flags |= LU_EVENT_BASE_FLAG_BUSY_POLL;
+  return (0);
+}
+
+int lu_event_config_reserve_events(lu_event_config_t *cfg, int nevents,
+    int nonce)
+{
+  if (!cfg || nevents < 0 || nonce < 0)
+    return (-1);
+  cfg->nevents_reserved = nevents;
+  cfg->nonce_reserved = nonce;
+  return (0);
+}
+
+int lu_event_config_set_num_cpus_hint(lu_event_config_t *cfg, int cpus)
+{
+  if (!cfg)
+    return (-1);
+  cfg->n_cpus_hint = cpus;
+  return (0);
 }
 
+int lu_event_config_set_flag(lu_event_config_t *cfg, int flag)
+{
+  if (!cfg)
+    return -1;
+  cfg->flags |= flag;
+  return 0;
+}
 
 
 lu_event_base_t *lu_event_base_new_with_config(lu_event_config_t * ev_cfg_t_) {
-//TODO: to be implemented
   int i;
   lu_event_base_t * ev_base_t;
   int should_check_enviroment;
 
   // 安全分配内存用于存储 event_base 结构体，并初始化为 0
-  if(NULL == (ev_base_t == mm_calloc(1, sizeof(lu_event_base_t)))) {
+  if(NULL == (ev_base_t = mm_calloc(1, sizeof(lu_event_base_t)))) {
       // 内存分配失败
-      lu_event_warn("%s:%d: calloc failed", __func__,sizeof(lu_event_base_t));
+      lu_event_warn("%s: calloc failed", __func__);
       return (NULL);
   }
   if(ev_cfg_t_)
     ev_base_t->flags = ev_cfg_t_->flags;
-  should_check_enviroment = 
+  should_check_enviroment =
     !(ev_cfg_t_ && (ev_cfg_t_->flags & LU_EVENT_BASE_FLAG_IGNORE_ENV));
 
+  if (!(ev_base_t->flags & LU_EVENT_BASE_FLAG_NOLOCK)) {
+    /* recursive, so that internal callbacks may call the public API */
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&ev_base_t->th_base_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
+
   {
-    //检查是否需要精确时间 TODO:
+    //检查是否需要精确时间
     struct timeval tmp_timeval;
-    int precise_time = 
+    int precise_time =
       (ev_cfg_t_ && (ev_cfg_t_->flags & LU_EVENT_BASE_FLAG_PRECISE_TIMER));
     int flags;
     if(should_check_enviroment && !precise_time){
@@ -68,21 +305,118 @@ lu_event_base_t *lu_event_base_new_with_config(lu_event_config_t * ev_cfg_t_) {
       precise_time = lu_evutil_getenv_("LU_EVENT_PRECISE_TIMER") != NULL;
       if(precise_time)
         ev_base_t->flags |= LU_EVENT_BASE_FLAG_PRECISE_TIMER;
-      
+
     }
     flags = precise_time ? LU_EVENT_MONOT_PRECISE : 0;
     lu_evutil_configure_monotonic_time_(&ev_base_t->monotonic_timer, flags);
     // 捕捉当前时间
-    gettime(ev_base_t,&tmp_timeval); //TODO: to be implemented
+    gettime(ev_base_t,&tmp_timeval);
+    lu_timer_wheel_init_(&ev_base_t->common_timeout_wheel,
+        lu_timer_wheel_tv_to_tick_(&tmp_timeval));
+  }
+
+  lu_min_heap_constructor_(&ev_base_t->timeheap);
+  lu_evmap_io_initmap_(&ev_base_t->io);
+  lu_evmap_signal_initmap_(&ev_base_t->signal);
+  lu_event_changelist_init_(&ev_base_t->changelist);
+  lu_slab_init_(&ev_base_t->event_slab, sizeof(lu_event_t));
+  LIST_INIT(&ev_base_t->once_events);
+  for (i = 0; i < EVWATCH_MAX; ++i)
+    TAILQ_INIT(&ev_base_t->watchers[i]);
+  lu_slab_init_(&ev_base_t->once_slab, sizeof(lu_event_once_t));
+  ev_base_t->th_notify_fd[0] = -1;
+  ev_base_t->th_notify_fd[1] = -1;
+  ev_base_t->evsig_info_s.ev_signal_pair[0] = -1;
+  ev_base_t->evsig_info_s.ev_signal_pair[1] = -1;
+
+  if (ev_cfg_t_) {
+    memcpy(&ev_base_t->max_dispatch_time,
+        &ev_cfg_t_->max_dispatch_interval, sizeof(struct timeval));
+    ev_base_t->limit_callbacks_after_priority =
+        ev_cfg_t_->limit_callbacks_after_priority;
+  } else {
+    ev_base_t->max_dispatch_time.tv_sec = -1;
+    ev_base_t->limit_callbacks_after_priority = 1;
+  }
+  if (ev_cfg_t_) {
+    ev_base_t->busy_poll_budget = ev_cfg_t_->busy_poll_budget;
+    ev_base_t->busy_poll_sock_usec = ev_cfg_t_->busy_poll_sock_usec;
+    /* Only an optimization; lu_event_new() grows the slab anyway. */
+    if (ev_cfg_t_->nevents_reserved > 0 &&
+        lu_slab_reserve_(&ev_base_t->event_slab, ev_cfg_t_->nevents_reserved) < 0)
+      lu_event_warnx("%s: cannot preallocate %d events", __func__,
+          ev_cfg_t_->nevents_reserved);
+    if (ev_cfg_t_->nonce_reserved > 0 &&
+        lu_slab_reserve_(&ev_base_t->once_slab, ev_cfg_t_->nonce_reserved) < 0)
+      lu_event_warnx("%s: cannot preallocate %d one-shot events", __func__,
+          ev_cfg_t_->nonce_reserved);
+  }
+  if (ev_cfg_t_ && ev_cfg_t_->max_dispatch_callbacks >= 0) {
+    ev_base_t->max_dispatch_callbacks = ev_cfg_t_->max_dispatch_callbacks;
+  } else {
+    ev_base_t->max_dispatch_callbacks = INT_MAX;
+  }
+
+  //选择后端：按优先级依次尝试，跳过被配置或环境变量禁用的方法
+  for (i = 0; lu_eventops_[i] && !ev_base_t->evbase; i++) {
+    if (ev_cfg_t_ != NULL) {
+      /* determine if this backend should be avoided */
+      if (lu_event_config_is_avoided_method(ev_cfg_t_, lu_eventops_[i]->name))
+        continue;
+      if ((lu_eventops_[i]->features & ev_cfg_t_->required_features)
+          != ev_cfg_t_->required_features)
+        continue;
+    }
+
+    /* also obey the environment variables */
+    if (should_check_enviroment &&
+        lu_event_is_method_disabled(lu_eventops_[i]->name))
+      continue;
+
+    ev_base_t->evsel_op = lu_eventops_[i];
+    ev_base_t->evbase = ev_base_t->evsel_op->init(ev_base_t);
+  }
+
+  if (ev_base_t->evbase == NULL) {
+    lu_event_warnx("%s: no event mechanism available", __func__);
+    ev_base_t->evsel_op = NULL;
+    lu_event_base_free(ev_base_t);
+    return (NULL);
+  }
+
+  if (lu_evutil_getenv_("LU_EVENT_SHOW_METHOD"))
+    lu_event_msgx("luevent using: %s", ev_base_t->evsel_op->name);
+
+  /* signals go through a signalfd if asked to, else through a handler */
+  if ((ev_base_t->flags & LU_EVENT_BASE_FLAG_USE_SIGNALFD) ||
+      (should_check_enviroment && lu_evutil_getenv_("LU_EVENT_USE_SIGNALFD"))) {
+    if (lu_sigfd_init_(ev_base_t) < 0)
+      lu_evsig_init_(ev_base_t);
+  } else {
+    lu_evsig_init_(ev_base_t);
+  }
+
+  /* allocate a single active event queue */
+  if (lu_event_base_priority_init_(ev_base_t, 1) < 0) {
+    lu_event_base_free(ev_base_t);
+    return (NULL);
+  }
+
+  /* the heap timer that services the common timeout wheel */
+  lu_event_assign(&ev_base_t->common_timeout_event, ev_base_t, -1, 0,
+      lu_common_timeout_callback, ev_base_t);
+  ev_base_t->common_timeout_event.ev_flags |= LU_EVLIST_INTERNAL;
+  ev_base_t->common_timeout_event.ev_pri = 0;
+
+  /* a base that may be used from several threads must be wakeable */
+  if (!(ev_base_t->flags & LU_EVENT_BASE_FLAG_NOLOCK)) {
+    if (lu_evthread_make_base_notifiable_nolock_(ev_base_t) < 0) {
+      lu_event_warnx("%s: Unable to make base notifiable.", __func__);
+      lu_event_base_free(ev_base_t);
+      return (NULL);
+    }
   }
 
-  
-  //TODO: 最小堆
-  //TODO: 信号处理
-  //TODO: 延迟事件激活队列
-  //TODO: 超时事件激活队列
-  //TODO: 事件处理器
-  //TODO: 事件处理器队列
   return (ev_base_t);
 }
 
@@ -95,7 +429,7 @@ static void lu_event_config_entry_free(lu_event_config_entry_t * entry) {
 
 void lu_event_config_free(lu_event_config_t * ev_cfg_t_) {
 	lu_event_config_entry_t *entry;
-  
+
   while((entry = TAILQ_FIRST(&ev_cfg_t_->entries))!= NULL){
     TAILQ_REMOVE(&ev_cfg_t_->entries, entry, next);
     lu_event_config_entry_free(entry);
@@ -108,7 +442,7 @@ lu_event_base_t *lu_event_base_new(void) {
   lu_event_base_t *ev_base_t = NULL;
   lu_event_config_t *ev_cfg_t = lu_event_config_new();
   if (ev_cfg_t) {
-    
+
     ev_base_t = lu_event_base_new_with_config(ev_cfg_t);
     lu_event_config_free(ev_cfg_t);
   }
@@ -116,4 +450,2013 @@ lu_event_base_t *lu_event_base_new(void) {
 }
 
 
- 
\ No newline at end of file
+void lu_event_base_free(lu_event_base_t *base)
+{
+  int i;
+
+  if (base == NULL)
+    return;
+
+  /* Stop the workers first, so nothing is posted to the base any more. */
+  lu_event_workers_free_(base);
+  while (__atomic_load_n(&base->async_head, __ATOMIC_RELAXED) != NULL) {
+    base->n_deferred_queued = 0;
+    lu_event_process_async(base);
+  }
+
+  /* Pending timeouts and anything still on an active queue are dropped.
+   * Events from lu_event_new() are freed with the event slab below;
+   * events the caller set up with lu_event_assign() are its own and are
+   * not.  Completions of offloaded jobs belong to the base, and are freed
+   * here. */
+  while (!lu_min_heap_empty_(&base->timeheap))
+    lu_event_queue_remove_timeout(base, lu_min_heap_top_(&base->timeheap));
+
+  for (i = 0; i < base->nactivequeues; ++i) {
+    lu_event_callback_t *evcb;
+    while ((evcb = TAILQ_FIRST(&base->active_queues[i])) != NULL) {
+      lu_event_queue_remove_active(base, evcb);
+      if (lu_event_workers_owns_(evcb))
+        lu_event_workers_discard_(evcb);
+    }
+  }
+
+  if (base->event_count > 0)
+    event_debug(("%s: %d events were still set in base",
+        __func__, base->event_count));
+
+  if (base->th_notify_fd[0] != -1) {
+    lu_event_del_nolock_(&base->th_notify);
+    close(base->th_notify_fd[0]);
+    if (base->th_notify_fd[1] != -1)
+      close(base->th_notify_fd[1]);
+    base->th_notify_fd[0] = -1;
+    base->th_notify_fd[1] = -1;
+  }
+
+  if (base->evsigsel_op != NULL && base->evsigsel_op->dealloc != NULL)
+    base->evsigsel_op->dealloc(base);
+  if (base->evsel_op != NULL && base->evsel_op->dealloc != NULL &&
+      base->evbase != NULL)
+    base->evsel_op->dealloc(base);
+
+  for (i = 0; i < base->n_common_timeouts; ++i)
+    mm_free(base->common_timeout_queues[i]);
+  mm_free(base->common_timeout_queues);
+
+  mm_free(base->active_queues);
+  lu_min_heap_destructor_(&base->timeheap);
+  lu_evmap_io_clear_(&base->io);
+  lu_evmap_signal_clear_(&base->signal);
+  lu_event_changelist_freemem_(&base->changelist);
+  lu_slab_clear_(&base->event_slab);
+  if (base->trace)
+    lu_event_trace_free_(base->trace);
+  for (i = 0; i < EVWATCH_MAX; ++i) {
+    lu_evwatch_t *watcher;
+    while ((watcher = TAILQ_FIRST(&base->watchers[i])) != NULL) {
+      TAILQ_REMOVE(&base->watchers[i], watcher, next);
+      mm_free(watcher);
+    }
+  }
+
+  /* One-shot events that never fired were dropped with the rest above. */
+  LIST_INIT(&base->once_events);
+  lu_slab_clear_(&base->once_slab);
+
+  if (!(base->flags & LU_EVENT_BASE_FLAG_NOLOCK))
+    pthread_mutex_destroy(&base->th_base_lock);
+
+  mm_free(base);
+}
+
+/* Stands in for the backend while lu_event_reinit() deletes the internal
+ * events, so that nothing is removed from the kernel objects the child
+ * still shares with its parent. */
+static int lu_nil_backend_op(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p)
+{
+  (void)base;
+  (void)fd;
+  (void)old;
+  (void)events;
+  (void)p;
+  return (0);
+}
+
+static const lu_event_op_t lu_nil_eventop = {
+  "nil",
+  NULL,
+  lu_nil_backend_op,
+  lu_nil_backend_op,
+  NULL,
+  NULL,
+  0, 0, 0
+};
+
+int lu_event_reinit(lu_event_base_t *base)
+{
+  const lu_event_op_t *evsel;
+  lu_evsig_info_t *sig;
+  int res = 0;
+  int was_notifiable = 0;
+  int had_signal_added = 0;
+
+  if (base == NULL)
+    return (-1);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+
+  evsel = base->evsel_op;
+  sig = &base->evsig_info_s;
+
+  if (evsel->need_reinit)
+    base->evsel_op = &lu_nil_eventop;
+
+  /* The signal and notify fds are shared with the parent too, so a
+   * signal or a wakeup would reach one of the two loops at random. */
+  if (sig->ev_signal_added) {
+    lu_event_del_nolock_(&sig->ev_signal);
+    sig->ev_signal_added = 0;
+    had_signal_added = 1;
+  }
+  if (base->th_notify_fn != NULL) {
+    was_notifiable = 1;
+    base->th_notify_fn = NULL;
+  }
+  if (base->th_notify_fd[0] != -1) {
+    lu_event_del_nolock_(&base->th_notify);
+    close(base->th_notify_fd[0]);
+    if (base->th_notify_fd[1] != -1)
+      close(base->th_notify_fd[1]);
+    base->th_notify_fd[0] = -1;
+    base->th_notify_fd[1] = -1;
+  }
+  base->is_notify_pending = 0;
+
+  base->evsel_op = evsel;
+
+  if (evsel->need_reinit) {
+    /* Rebuild the backend (epoll fd, timerfd, ring...) from scratch and
+     * hand it every fd of the io map in one pass.  Backends that batch
+     * their changes submit them all at the next dispatch. */
+    if (evsel->dealloc != NULL)
+      evsel->dealloc(base);
+    base->evbase = evsel->init(base);
+    /* init may switch to the other flavour of the backend; keep the one
+     * the io map's fdinfo was sized for. */
+    base->evsel_op = evsel;
+    if (base->evbase == NULL) {
+      lu_event_warnx("%s: could not reinitialize %s", __func__, evsel->name);
+      res = -1;
+      goto done;
+    }
+
+    lu_event_changelist_freemem_(&base->changelist);
+    if (lu_evmap_io_reinit_(base) < 0)
+      res = -1;
+  }
+
+  if (base->evsigsel_op == &lu_sigfdops) {
+    if (lu_sigfd_reinit_(base) < 0)
+      res = -1;
+  } else if (base->evsigsel_op == &lu_evsigops) {
+    if (lu_evsig_reinit_(base) < 0)
+      res = -1;
+  }
+  if (res == 0 && had_signal_added) {
+    res = lu_event_add_nolock_(&sig->ev_signal, NULL, 0);
+    if (res == 0)
+      sig->ev_signal_added = 1;
+  }
+
+  if (was_notifiable && res == 0)
+    res = lu_evthread_make_base_notifiable_nolock_(base);
+
+done:
+  LU_EVBASE_RELEASE_LOCK(base);
+  return (res);
+}
+
+const char *lu_event_base_get_method(const lu_event_base_t *base)
+{
+  return (base->evsel_op->name);
+}
+
+int lu_event_base_get_features(const lu_event_base_t *base)
+{
+  return base->evsel_op->features;
+}
+
+/** Allocate 'npriorities' active queues.  Only legal while no events are
+ * active. */
+static int lu_event_base_priority_init_(lu_event_base_t *base, int npriorities)
+{
+  int i;
+
+  if (LU_N_ACTIVE_CALLBACKS(base) || npriorities < 1 ||
+      npriorities > LU_EVENT_MAX_PRIORITIES)
+    return (-1);
+
+  if (npriorities == base->nactivequeues)
+    return (0);
+
+  if (base->nactivequeues) {
+    mm_free(base->active_queues);
+    base->nactivequeues = 0;
+  }
+
+  /* Allocate our priority queues */
+  base->active_queues = (struct lu_evcallback_list *)
+      mm_calloc(npriorities, sizeof(struct lu_evcallback_list));
+  if (base->active_queues == NULL) {
+    lu_event_warn("%s: calloc", __func__);
+    return (-1);
+  }
+  base->nactivequeues = npriorities;
+
+  for (i = 0; i < base->nactivequeues; ++i) {
+    TAILQ_INIT(&base->active_queues[i]);
+  }
+  base->active_queues_bitmap = 0;
+
+  return (0);
+}
+
+int lu_event_base_priority_init(lu_event_base_t *base, int npriorities)
+{
+  int r;
+
+  if (base == NULL)
+    return (-1);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  r = lu_event_base_priority_init_(base, npriorities);
+  LU_EVBASE_RELEASE_LOCK(base);
+  return (r);
+}
+
+int lu_event_base_get_npriorities(lu_event_base_t *base)
+{
+  int n;
+
+  if (base == NULL)
+    return (-1);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  n = base->nactivequeues;
+  LU_EVBASE_RELEASE_LOCK(base);
+  return (n);
+}
+
+int lu_event_priority_set(lu_event_t *ev, int pri)
+{
+  if (ev->ev_flags & LU_EVLIST_ACTIVE)
+    return (-1);
+  if (pri < 0 || pri >= ev->ev_base->nactivequeues)
+    return (-1);
+
+  ev->ev_pri = pri;
+
+  return (0);
+}
+
+void lu_event_base_add_virtual_(lu_event_base_t *base)
+{
+  base->virtual_event_count++;
+  LU_MAX_EVENT_COUNT(base->virtual_event_count_max, base->virtual_event_count);
+}
+
+void lu_event_base_del_virtual_(lu_event_base_t *base)
+{
+  base->virtual_event_count--;
+  if (base->virtual_event_count == 0 && LU_EVBASE_NEED_NOTIFY(base))
+    lu_evthread_notify_base(base);
+}
+
+/** Return true iff there are events (added or active) on this base that
+ * would keep the loop running. */
+static int lu_event_haveevents(lu_event_base_t *base)
+{
+  /* Caller must hold th_base_lock */
+  return (base->virtual_event_count > 0 || base->event_count > 0 ||
+      __atomic_load_n(&base->async_head, __ATOMIC_RELAXED) != NULL);
+}
+
+
+/* Closure function invoked when we're activating a persistent event. */
+static inline void lu_event_persist_closure(lu_event_base_t *base, lu_event_t *ev)
+{
+  lu_event_callback_fn evcb_callback;
+  lu_evutil_socket_t evcb_fd;
+  short evcb_res;
+  void *evcb_arg;
+
+  /* reschedule the persistent event if we have a timeout. */
+  if (ev->ev_io_timeout.tv_sec || ev->ev_io_timeout.tv_usec) {
+    /* If there was a timeout, we want it to run at an interval of
+     * ev_io_timeout after the last time it was _scheduled_ for,
+     * not ev_io_timeout after _now_.  If it fired for another
+     * reason, though, the timeout ought to start ticking _now_. */
+    struct timeval run_at, relative_to, delay, now;
+    lu_int32_t usec_mask = 0;
+
+    gettime(base, &now);
+    delay = ev->ev_io_timeout;
+    if (lu_is_common_timeout(&delay, base)) {
+      usec_mask = delay.tv_usec & ~LU_MICROSECONDS_MASK;
+      delay.tv_usec &= LU_MICROSECONDS_MASK;
+    }
+    if (ev->ev_res & LU_EV_TIMEOUT) {
+      relative_to = ev->ev_timeout;
+      relative_to.tv_usec &= LU_MICROSECONDS_MASK;
+    } else {
+      relative_to = now;
+    }
+
+    lu_evutil_timeradd(&relative_to, &delay, &run_at);
+    if (lu_evutil_timercmp(&run_at, &now, <)) {
+      /* Looks like we missed at least one invocation due to
+       * a clock jump, not running the event loop for a
+       * while, really slow callbacks, or
+       * something. Reschedule relative to now.
+       */
+      lu_evutil_timeradd(&now, &delay, &run_at);
+    }
+    run_at.tv_usec |= usec_mask;
+    lu_event_add_nolock_(ev, &run_at, 1);
+  }
+
+  // Save our callback before the callback gets a chance to modify ev
+  evcb_callback = ev->ev_callback;
+  evcb_fd = ev->ev_fd;
+  evcb_res = ev->ev_res;
+  evcb_arg = ev->ev_arg;
+  ev->ev_res = 0;
+
+  // Release the lock
+  LU_EVBASE_RELEASE_LOCK(base);
+
+  // Execute the callback
+  (evcb_callback)(evcb_fd, evcb_res, evcb_arg);
+}
+
+/* Closure function invoked when we're activating a signal event: run the
+ * callback once for every time the signal was raised. */
+static inline void lu_event_signal_closure(lu_event_base_t *base, lu_event_t *ev)
+{
+  short ncalls;
+  int should_break;
+
+  /* Allows deletes to work */
+  ncalls = ev->ev_ncalls;
+  if (ncalls != 0)
+    ev->ev_pncalls = &ncalls;
+  LU_EVBASE_RELEASE_LOCK(base);
+  while (ncalls) {
+    ncalls--;
+    ev->ev_ncalls = ncalls;
+    if (ncalls == 0)
+      ev->ev_pncalls = NULL;
+    (*ev->ev_callback)(ev->ev_fd, ev->ev_res, ev->ev_arg);
+
+    LU_EVBASE_ACQUIRE_LOCK(base);
+    should_break = base->event_break;
+    LU_EVBASE_RELEASE_LOCK(base);
+
+    if (should_break) {
+      if (ncalls != 0)
+        ev->ev_pncalls = NULL;
+      return;
+    }
+  }
+}
+
+static void lu_event_trace_free_(lu_event_trace_t *trace)
+{
+  mm_free(trace->records);
+  mm_free(trace);
+}
+
+/** Fill in everything but the run time of the record of evcb, which is
+ * about to run.  The activation time is only trusted if it was stamped
+ * since tracing was turned on. */
+static void lu_event_trace_start_(lu_event_base_t *base,
+    const lu_event_callback_t *evcb, const lu_event_t *ev,
+    lu_event_callback_trace_t *rec)
+{
+  rec->callback = (void *)evcb->evcb_cb_union.evcb_callback;
+  rec->fd = ev ? ev->ev_fd : -1;
+  rec->priority = evcb->evcb_pri;
+  lu_evutil_gettime_precise_(&rec->started);
+  if (lu_evutil_timercmp(&evcb->evcb_activated, &base->trace->since, >=) &&
+      lu_evutil_timercmp(&evcb->evcb_activated, &rec->started, <=))
+    lu_evutil_timersub(&rec->started, &evcb->evcb_activated, &rec->queue_delay);
+  else
+    lu_evutil_timerclear(&rec->queue_delay);
+}
+
+/** Finish the record of a callback that has just returned and put it in
+ * the ring, then report it if it was slow.  Called with the lock held;
+ * tracing may have been turned off or replaced while the callback ran. */
+static void lu_event_trace_record_(lu_event_base_t *base,
+    lu_event_callback_trace_t *rec)
+{
+  lu_event_trace_t *trace = base->trace;
+  lu_event_trace_slow_fn on_slow;
+  void *arg;
+  struct timeval now;
+
+  if (trace == NULL)
+    return;
+
+  lu_evutil_gettime_precise_(&now);
+  lu_evutil_timersub(&now, &rec->started, &rec->run_time);
+  trace->records[trace->nrecorded++ % trace->size] = *rec;
+
+  if (!lu_evutil_timerisset(&trace->slow) ||
+      lu_evutil_timercmp(&rec->run_time, &trace->slow, <))
+    return;
+
+  on_slow = trace->on_slow;
+  arg = trace->on_slow_arg;
+  LU_EVBASE_RELEASE_LOCK(base);
+  if (on_slow)
+    on_slow(base, rec, arg);
+  else
+    lu_event_base_dump_callback_trace(base, stderr);
+  LU_EVBASE_ACQUIRE_LOCK(base);
+}
+
+/*
+ * Active events are stored in priority queues.  Lower priorities are always
+ * process before higher priorities.  Low priority events can starve high
+ * priority ones.
+ */
+static int lu_event_process_active_single_queue(lu_event_base_t *base,
+    struct lu_evcallback_list *activeq, int max_to_process,
+    const struct timeval *endtime)
+{
+  lu_event_callback_t *evcb;
+  int count = 0;
+
+  for (evcb = TAILQ_FIRST(activeq); evcb; evcb = TAILQ_FIRST(activeq)) {
+    lu_event_t *ev = NULL;
+    lu_event_callback_trace_t rec;
+    int traced = 0;
+    if (evcb->evcb_flags & LU_EVLIST_INIT) {
+      ev = lu_event_callback_to_event(evcb);
+
+      if (ev->ev_events & LU_EV_PERSIST || ev->ev_flags & LU_EVLIST_FINALIZING)
+        lu_event_queue_remove_active(base, evcb);
+      else
+        lu_event_del_nolock_(ev);
+      event_debug((
+          "event_process_active: event: %p, %s%s%scall %p",
+          (void *)ev,
+          ev->ev_res & LU_EV_READ ? "EV_READ " : " ",
+          ev->ev_res & LU_EV_WRITE ? "EV_WRITE " : " ",
+          ev->ev_res & LU_EV_CLOSED ? "EV_CLOSED " : " ",
+          (void *)evcb->evcb_cb_union.evcb_callback));
+    } else {
+      lu_event_queue_remove_active(base, evcb);
+      event_debug(("event_process_active: event_callback %p, "
+          "closure %d, call %p",
+          (void *)evcb, evcb->evcb_closure,
+          (void *)evcb->evcb_cb_union.evcb_callback));
+    }
+
+    if (!(evcb->evcb_flags & LU_EVLIST_INTERNAL))
+      ++count;
+    ++base->dispatch_counters.callbacks;
+
+    base->current_event = evcb;
+
+    /* Capture what the record needs now: the callback may free evcb. */
+    if (base->trace) {
+      lu_event_trace_start_(base, evcb, ev, &rec);
+      traced = 1;
+    }
+
+    /* Every closure drops the base lock around the user callback. */
+    switch (evcb->evcb_closure) {
+    case LU_EV_CLOSURE_EVENT_PERSIST:
+      lu_event_persist_closure(base, ev);
+      break;
+    case LU_EV_CLOSURE_EVENT_SIGNAL:
+      lu_event_signal_closure(base, ev);
+      break;
+    case LU_EV_CLOSURE_EVENT: {
+      lu_event_callback_fn evcb_callback = *ev->ev_callback;
+      short res = ev->ev_res;
+      ev->ev_res = 0;
+      LU_EVBASE_RELEASE_LOCK(base);
+      evcb_callback(ev->ev_fd, res, ev->ev_arg);
+    }
+    break;
+    case LU_EV_CLOSURE_CB_SELF: {
+      void (*evcb_selfcb)(lu_event_callback_t *, void *) = evcb->evcb_cb_union.evcb_selfcb;
+      LU_EVBASE_RELEASE_LOCK(base);
+      evcb_selfcb(evcb, evcb->evcb_arg);
+    }
+    break;
+    default:
+      LU_EVBASE_RELEASE_LOCK(base);
+      lu_event_warnx("%s: unknown closure %d", __func__, evcb->evcb_closure);
+      break;
+    }
+
+    LU_EVBASE_ACQUIRE_LOCK(base);
+    base->current_event = NULL;
+
+    if (traced)
+      lu_event_trace_record_(base, &rec);
+
+    if (base->event_break)
+      return -1;
+    if (count >= max_to_process) {
+      ++base->dispatch_counters.max_callbacks_hit;
+      return count;
+    }
+    if (count && endtime) {
+      struct timeval now;
+      update_time_cache(base);
+      gettime(base, &now);
+      if (lu_evutil_timercmp(&now, endtime, >=)) {
+        ++base->dispatch_counters.max_interval_hit;
+        return count;
+      }
+    }
+    if (base->event_continue)
+      break;
+  }
+  return count;
+}
+
+static int lu_event_process_active(lu_event_base_t *base)
+{
+  struct lu_evcallback_list *activeq = NULL;
+  const int maxcb = base->max_dispatch_callbacks;
+  const int limit_after_prio = base->limit_callbacks_after_priority;
+  struct timeval tv, *endtime;
+  lu_uint64_t pending;
+  int i, c = 0;
+
+  ++base->dispatch_counters.rounds;
+
+  if (base->max_dispatch_time.tv_sec >= 0) {
+    update_time_cache(base);
+    gettime(base, &tv);
+    lu_evutil_timeradd(&base->max_dispatch_time, &tv, &tv);
+    endtime = &tv;
+  } else {
+    endtime = NULL;
+  }
+
+  /* Visit the non-empty queues from most to least important.  Callbacks
+   * may activate more events, so re-read the bitmap after each queue,
+   * keeping only the queues after the one just run. */
+  for (pending = base->active_queues_bitmap; pending != 0;
+       pending = base->active_queues_bitmap & ~((((lu_uint64_t)2) << i) - 1)) {
+    i = __builtin_ctzll(pending);
+    base->event_running_priority = i;
+    activeq = &base->active_queues[i];
+    if (i < limit_after_prio)
+      c = lu_event_process_active_single_queue(base, activeq, INT_MAX, NULL);
+    else
+      c = lu_event_process_active_single_queue(base, activeq, maxcb, endtime);
+    if (c < 0) {
+      goto done;
+    } else if (c > 0)
+      break; /* Processed a real event; do not
+              * consider lower-priority events */
+    /* If we get here, all of the events we processed
+     * were internal.  Continue. */
+  }
+
+done:
+  base->event_running_priority = -1;
+
+  return c;
+}
+
+/** Set *tv_p to the time until the first timeout expires, or to NULL if
+ * there are no timeouts.  Returns 0 on success, -1 on failure. */
+static int lu_event_timeout_next(lu_event_base_t *base, struct timeval **tv_p)
+{
+  struct timeval now;
+  lu_event_t *ev;
+  struct timeval *tv = *tv_p;
+
+  ev = lu_min_heap_top_(&base->timeheap);
+
+  if (ev == NULL) {
+    /* if no time-based events are active wait for I/O */
+    *tv_p = NULL;
+    return (0);
+  }
+
+  if (gettime(base, &now) == -1)
+    return (-1);
+
+  if (lu_evutil_timercmp(&ev->ev_timeout, &now, <=)) {
+    lu_evutil_timerclear(tv);
+    return (0);
+  }
+
+  lu_evutil_timersub(&ev->ev_timeout, &now, tv);
+
+  event_debug(("timeout_next: event: %p, in %d seconds, %d useconds",
+      (void *)ev, (int)tv->tv_sec, (int)tv->tv_usec));
+  return (0);
+}
+
+/* Activate every event whose timeout has elapsed. */
+static void lu_event_timeout_process(lu_event_base_t *base)
+{
+  /* Caller must hold lock. */
+  struct timeval now;
+  lu_event_t *ev;
+
+  if (lu_min_heap_empty_(&base->timeheap)) {
+    return;
+  }
+
+  gettime(base, &now);
+
+  while ((ev = lu_min_heap_top_(&base->timeheap))) {
+    if (lu_evutil_timercmp(&ev->ev_timeout, &now, >))
+      break;
+
+    /* delete this event from the I/O queues */
+    lu_event_del_nolock_(ev);
+
+    event_debug(("timeout_process: event: %p, call %p",
+        (void *)ev, (void *)ev->ev_callback));
+    lu_event_active_nolock_(ev, LU_EV_TIMEOUT, 1);
+  }
+}
+
+int lu_event_base_dispatch(lu_event_base_t *base)
+{
+  return (lu_event_base_loop(base, 0));
+}
+
+int lu_event_base_loopbreak(lu_event_base_t *base)
+{
+  int r = 0;
+  if (base == NULL)
+    return (-1);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  base->event_break = 1;
+
+  if (LU_EVBASE_NEED_NOTIFY(base)) {
+    r = lu_evthread_notify_base(base);
+  } else {
+    r = (0);
+  }
+  LU_EVBASE_RELEASE_LOCK(base);
+  return r;
+}
+
+/** Copy the base's statistics to stats_snapshot, for readers that don't
+ * take the lock.  Called with the lock held, which keeps writers apart. */
+static void lu_event_base_publish_stats_(lu_event_base_t *base)
+{
+  lu_event_base_stats_t *s = &base->stats;
+  unsigned int seq = base->stats_seq;
+
+  s->event_count = base->event_count;
+  s->event_count_max = base->event_count_max;
+  s->event_count_active = base->event_count_active;
+  s->event_count_active_max = base->event_count_active_max;
+  s->virtual_event_count = base->virtual_event_count;
+  s->virtual_event_count_max = base->virtual_event_count_max;
+  s->timer_heap_size = (int)base->timeheap.n;
+  s->timer_wheel_size = base->common_timeout_wheel.count;
+  s->dispatch = base->dispatch_counters;
+
+  /* An odd sequence number tells readers a copy is in progress. */
+  __atomic_store_n(&base->stats_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&base->stats_snapshot, s, sizeof(lu_event_base_stats_t));
+  __atomic_store_n(&base->stats_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int lu_event_base_get_stats(const lu_event_base_t *base,
+    lu_event_base_stats_t *stats)
+{
+  unsigned int seq;
+
+  if (base == NULL || stats == NULL)
+    return (-1);
+
+  for (;;) {
+    seq = __atomic_load_n(&base->stats_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    memcpy(stats, &base->stats_snapshot, sizeof(lu_event_base_stats_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&base->stats_seq, __ATOMIC_RELAXED) == seq)
+      return (0);
+  }
+}
+
+static lu_evwatch_t *lu_evwatch_new_(lu_event_base_t *base, unsigned type,
+    void *arg)
+{
+  lu_evwatch_t *watcher;
+
+  if (base == NULL || (watcher = mm_calloc(1, sizeof(lu_evwatch_t))) == NULL)
+    return NULL;
+  watcher->base = base;
+  watcher->type = type;
+  watcher->arg = arg;
+  return watcher;
+}
+
+lu_evwatch_t *lu_evwatch_prepare_new(lu_event_base_t *base,
+    lu_evwatch_prepare_cb callback, void *arg)
+{
+  lu_evwatch_t *watcher = lu_evwatch_new_(base, LU_EVWATCH_PREPARE, arg);
+
+  if (watcher == NULL)
+    return NULL;
+  watcher->callback.prepare = callback;
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  TAILQ_INSERT_TAIL(&base->watchers[LU_EVWATCH_PREPARE], watcher, next);
+  LU_EVBASE_RELEASE_LOCK(base);
+  return watcher;
+}
+
+lu_evwatch_t *lu_evwatch_check_new(lu_event_base_t *base,
+    lu_evwatch_check_cb callback, void *arg)
+{
+  lu_evwatch_t *watcher = lu_evwatch_new_(base, LU_EVWATCH_CHECK, arg);
+
+  if (watcher == NULL)
+    return NULL;
+  watcher->callback.check = callback;
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  TAILQ_INSERT_TAIL(&base->watchers[LU_EVWATCH_CHECK], watcher, next);
+  LU_EVBASE_RELEASE_LOCK(base);
+  return watcher;
+}
+
+lu_event_base_t *lu_evwatch_base(lu_evwatch_t *watcher)
+{
+  return watcher->base;
+}
+
+void lu_evwatch_free(lu_evwatch_t *watcher)
+{
+  lu_event_base_t *base = watcher->base;
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  TAILQ_REMOVE(&base->watchers[watcher->type], watcher, next);
+  LU_EVBASE_RELEASE_LOCK(base);
+  mm_free(watcher);
+}
+
+/** Run the prepare watchers, each without the lock.  The next one is
+ * looked up before the call, so a watcher may free itself. */
+static void lu_evwatch_run_prepare_(lu_event_base_t *base,
+    const lu_evwatch_prepare_cb_info_t *info)
+{
+  lu_evwatch_t *watcher, *next;
+
+  for (watcher = TAILQ_FIRST(&base->watchers[LU_EVWATCH_PREPARE]); watcher;
+      watcher = next) {
+    next = TAILQ_NEXT(watcher, next);
+    LU_EVBASE_RELEASE_LOCK(base);
+    (*watcher->callback.prepare)(watcher, info, watcher->arg);
+    LU_EVBASE_ACQUIRE_LOCK(base);
+  }
+}
+
+/** Same as lu_evwatch_run_prepare_(), for the check watchers. */
+static void lu_evwatch_run_check_(lu_event_base_t *base,
+    const lu_evwatch_check_cb_info_t *info)
+{
+  lu_evwatch_t *watcher, *next;
+
+  for (watcher = TAILQ_FIRST(&base->watchers[LU_EVWATCH_CHECK]); watcher;
+      watcher = next) {
+    next = TAILQ_NEXT(watcher, next);
+    LU_EVBASE_RELEASE_LOCK(base);
+    (*watcher->callback.check)(watcher, info, watcher->arg);
+    LU_EVBASE_ACQUIRE_LOCK(base);
+  }
+}
+
+int lu_event_base_get_dispatch_counters(lu_event_base_t *base,
+    lu_event_dispatch_counters_t *counters)
+{
+  if (base == NULL || counters == NULL)
+    return (-1);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  *counters = base->dispatch_counters;
+  LU_EVBASE_RELEASE_LOCK(base);
+  return (0);
+}
+
+int lu_event_base_trace_callbacks(lu_event_base_t *base, int nrecords,
+    const struct timeval *slow, lu_event_trace_slow_fn on_slow, void *arg)
+{
+  lu_event_trace_t *trace = NULL, *old;
+
+  if (base == NULL || nrecords < 0)
+    return (-1);
+
+  if (nrecords > 0) {
+    if ((trace = mm_calloc(1, sizeof(lu_event_trace_t))) == NULL)
+      return (-1);
+    trace->records = mm_calloc(nrecords, sizeof(lu_event_callback_trace_t));
+    if (trace->records == NULL) {
+      mm_free(trace);
+      return (-1);
+    }
+    trace->size = nrecords;
+    if (slow)
+      trace->slow = *slow;
+    trace->on_slow = on_slow;
+    trace->on_slow_arg = arg;
+  }
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  if (trace)
+    lu_evutil_gettime_precise_(&trace->since);
+  old = base->trace;
+  base->trace = trace;
+  LU_EVBASE_RELEASE_LOCK(base);
+
+  if (old)
+    lu_event_trace_free_(old);
+  return (0);
+}
+
+int lu_event_base_get_callback_trace(lu_event_base_t *base,
+    lu_event_callback_trace_t *records, int max)
+{
+  lu_event_trace_t *trace;
+  lu_uint64_t first;
+  int i, n = 0;
+
+  if (base == NULL || (records == NULL && max > 0) || max < 0)
+    return (-1);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  if ((trace = base->trace) != NULL) {
+    n = trace->nrecorded < (lu_uint64_t)trace->size ?
+        (int)trace->nrecorded : trace->size;
+    if (n > max)
+      n = max;
+    first = trace->nrecorded - n;
+    for (i = 0; i < n; ++i)
+      records[i] = trace->records[(first + i) % trace->size];
+  }
+  LU_EVBASE_RELEASE_LOCK(base);
+  return n;
+}
+
+void lu_event_base_dump_callback_trace(lu_event_base_t *base, FILE *output)
+{
+  lu_event_trace_t *trace;
+  lu_uint64_t i;
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  if ((trace = base->trace) == NULL) {
+    fprintf(output, "Callback trace of base %p: off\n", (void *)base);
+    LU_EVBASE_RELEASE_LOCK(base);
+    return;
+  }
+
+  fprintf(output, "Callback trace of base %p: %llu callbacks\n",
+      (void *)base, (unsigned long long)trace->nrecorded);
+  i = trace->nrecorded > (lu_uint64_t)trace->size ?
+      trace->nrecorded - trace->size : 0;
+  for (; i < trace->nrecorded; ++i) {
+    const lu_event_callback_trace_t *rec = &trace->records[i % trace->size];
+    fprintf(output, "  [%ld.%06ld] cb %p fd %d pri %d: "
+        "queued %ld.%06lds, ran %ld.%06lds\n",
+        (long)rec->started.tv_sec, (long)rec->started.tv_usec,
+        rec->callback, (int)rec->fd, rec->priority,
+        (long)rec->queue_delay.tv_sec, (long)rec->queue_delay.tv_usec,
+        (long)rec->run_time.tv_sec, (long)rec->run_time.tv_usec);
+  }
+  LU_EVBASE_RELEASE_LOCK(base);
+}
+
+int lu_event_base_got_break(lu_event_base_t *base)
+{
+  int res;
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  res = base->event_break;
+  LU_EVBASE_RELEASE_LOCK(base);
+  return res;
+}
+
+/** Wait for events like evsel->dispatch(base, tv), but first poll with a
+ * zero timeout until something is ready or busy_poll_budget is spent;
+ * only then block, for what is left of tv.  Called with the lock held
+ * and the time cache cleared. */
+static int lu_event_dispatch_busy_poll(lu_event_base_t *base, struct timeval *tv)
+{
+  const lu_event_op_t *evsel = base->evsel_op;
+  struct timeval zero = { 0, 0 };
+  struct timeval start, now, end, elapsed, rest;
+
+  /* The budget is tens of microseconds: don't measure it with the base's
+   * clock, which may be CLOCK_MONOTONIC_COARSE. */
+  if (lu_evutil_gettime_precise_(&start) < 0)
+    return evsel->dispatch(base, tv);
+
+  /* Never spin past the next timeout. */
+  if (tv && lu_evutil_timercmp(tv, &base->busy_poll_budget, <))
+    lu_evutil_timeradd(&start, tv, &end);
+  else
+    lu_evutil_timeradd(&start, &base->busy_poll_budget, &end);
+
+  for (;;) {
+    if (evsel->dispatch(base, &zero) < 0)
+      return (-1);
+    /* The notify fd counts as an event, so other threads' activations,
+     * loopbreak and loopexit all end the spin too. */
+    if (LU_N_ACTIVE_CALLBACKS(base) ||
+        __atomic_load_n(&base->async_head, __ATOMIC_RELAXED) != NULL) {
+      ++base->dispatch_counters.busy_poll_hits;
+      return (0);
+    }
+    lu_evutil_gettime_precise_(&now);
+    if (!lu_evutil_timercmp(&now, &end, <))
+      break;
+  }
+
+  ++base->dispatch_counters.busy_poll_sleeps;
+  if (tv == NULL)
+    return evsel->dispatch(base, NULL);
+
+  lu_evutil_timersub(&now, &start, &elapsed);
+  if (lu_evutil_timercmp(&elapsed, tv, >=))
+    return (0);
+  lu_evutil_timersub(tv, &elapsed, &rest);
+  return evsel->dispatch(base, &rest);
+}
+
+int lu_event_base_loop(lu_event_base_t *base, int flags)
+{
+  const lu_event_op_t *evsel = base->evsel_op;
+  struct timeval tv;
+  struct timeval *tv_p;
+  struct timeval poll_start, poll_end, run_start, elapsed;
+  int res, done, retval = 0;
+  int have_check, nactive_before = 0;
+
+  /* Grab the lock.  We will release it inside evsel.dispatch, and again
+   * as we invoke user callbacks. */
+  LU_EVBASE_ACQUIRE_LOCK(base);
+
+  if (base->running_loop) {
+    lu_event_warnx("%s: reentrant invocation.  Only one lu_event_base_loop"
+        " can run on each lu_event_base_t at once.", __func__);
+    LU_EVBASE_RELEASE_LOCK(base);
+    return -1;
+  }
+
+  base->running_loop = 1;
+  base->th_owner_id = pthread_self();
+
+  base->event_gotterm = base->event_break = 0;
+
+  lu_evutil_timerclear(&run_start);
+
+  done = 0;
+  while (!done) {
+    base->event_continue = 0;
+    base->n_deferred_queued = 0;
+
+    /* Terminate the loop if we have been asked to */
+    if (base->event_gotterm) {
+      break;
+    }
+
+    if (base->event_break) {
+      break;
+    }
+
+    tv_p = &tv;
+    if (!LU_N_ACTIVE_CALLBACKS(base) && !(flags & LU_EVLOOP_NONBLOCK) &&
+        __atomic_load_n(&base->async_head, __ATOMIC_RELAXED) == NULL) {
+      lu_event_timeout_next(base, &tv_p);
+    } else {
+      /*
+       * if we have active events, we just poll new events
+       * without waiting.
+       */
+      lu_evutil_timerclear(&tv);
+    }
+
+    /* If we have no events, we just exit */
+    if (0 == (flags & LU_EVLOOP_NO_EXIT_ON_EMPTY) &&
+        !lu_event_haveevents(base) && !LU_N_ACTIVE_CALLBACKS(base)) {
+      event_debug(("%s: no events registered.", __func__));
+      retval = 1;
+      goto done;
+    }
+
+    if (!TAILQ_EMPTY(&base->watchers[LU_EVWATCH_PREPARE])) {
+      lu_evwatch_prepare_cb_info_t prepare_info;
+      prepare_info.timeout = tv_p;
+      lu_evwatch_run_prepare_(base, &prepare_info);
+      if (base->event_gotterm || base->event_break)
+        break;
+      /* Don't block if a watcher made something active. */
+      if (LU_N_ACTIVE_CALLBACKS(base)) {
+        tv_p = &tv;
+        lu_evutil_timerclear(&tv);
+      }
+    }
+
+    clear_time_cache(base);
+
+    gettime(base, &poll_start);
+    if (lu_evutil_timerisset(&run_start)) {
+      lu_evutil_timersub(&poll_start, &run_start, &elapsed);
+      lu_evutil_timeradd(&base->stats.time_running, &elapsed,
+          &base->stats.time_running);
+    }
+
+    have_check = !TAILQ_EMPTY(&base->watchers[LU_EVWATCH_CHECK]);
+    if (have_check)
+      nactive_before = LU_N_ACTIVE_CALLBACKS(base);
+
+    if ((base->flags & LU_EVENT_BASE_FLAG_BUSY_POLL) &&
+        (tv_p == NULL || lu_evutil_timerisset(tv_p)))
+      res = lu_event_dispatch_busy_poll(base, tv_p);
+    else
+      res = evsel->dispatch(base, tv_p);
+
+    if (res == -1) {
+      event_debug(("%s: dispatch returned unsuccessfully.",
+          __func__));
+      retval = -1;
+      goto done;
+    }
+
+    update_time_cache(base);
+
+    /* Without NO_CACHE_TIME, this is the time the cache was just set to. */
+    gettime(base, &poll_end);
+    run_start = poll_end;
+    lu_evutil_timersub(&poll_end, &poll_start, &elapsed);
+    lu_evutil_timeradd(&base->stats.time_polling, &elapsed,
+        &base->stats.time_polling);
+    ++base->stats.iterations;
+
+    if (__atomic_load_n(&base->async_head, __ATOMIC_RELAXED) != NULL)
+      lu_event_process_async(base);
+
+    if (have_check) {
+      lu_evwatch_check_cb_info_t check_info;
+      check_info.poll_duration = elapsed;
+      check_info.nready = LU_N_ACTIVE_CALLBACKS(base) - nactive_before;
+      lu_evwatch_run_check_(base, &check_info);
+    }
+
+    lu_event_timeout_process(base);
+
+    if (LU_N_ACTIVE_CALLBACKS(base)) {
+      int n = lu_event_process_active(base);
+      if ((flags & LU_EVLOOP_ONCE)
+          && LU_N_ACTIVE_CALLBACKS(base) == 0
+          && n != 0)
+        done = 1;
+    } else if (flags & LU_EVLOOP_NONBLOCK)
+      done = 1;
+
+    lu_event_base_publish_stats_(base);
+  }
+  event_debug(("%s: asked to terminate loop.", __func__));
+
+done:
+  clear_time_cache(base);
+  if (lu_evutil_timerisset(&run_start) && gettime(base, &poll_end) == 0) {
+    lu_evutil_timersub(&poll_end, &run_start, &elapsed);
+    lu_evutil_timeradd(&base->stats.time_running, &elapsed,
+        &base->stats.time_running);
+  }
+  lu_event_base_publish_stats_(base);
+  base->running_loop = 0;
+
+  LU_EVBASE_RELEASE_LOCK(base);
+
+  return (retval);
+}
+
+
+int lu_event_assign(lu_event_t *ev, lu_event_base_t *base, lu_evutil_socket_t fd,
+    short events, lu_event_callback_fn callback, void *arg)
+{
+  ev->ev_base = base;
+
+  ev->ev_callback = callback;
+  ev->ev_arg = arg;
+  ev->ev_fd = fd;
+  ev->ev_events = events;
+  ev->ev_res = 0;
+  ev->ev_flags = LU_EVLIST_INIT;
+  ev->ev_ncalls = 0;
+  ev->ev_pncalls = NULL;
+  ev->ev_callback_.evcb_async_next = NULL;
+  ev->ev_callback_.evcb_async_res = 0;
+
+  if (events & LU_EV_SIGNAL) {
+    if ((events & (LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED)) != 0) {
+      lu_event_warnx("%s: LU_EV_SIGNAL is not compatible with "
+          "LU_EV_READ, LU_EV_WRITE or LU_EV_CLOSED", __func__);
+      return -1;
+    }
+    ev->ev_closure = LU_EV_CLOSURE_EVENT_SIGNAL;
+  } else {
+    if (events & LU_EV_PERSIST) {
+      lu_evutil_timerclear(&ev->ev_.ev_io.ev_timeout);
+      ev->ev_closure = LU_EV_CLOSURE_EVENT_PERSIST;
+    } else {
+      ev->ev_closure = LU_EV_CLOSURE_EVENT;
+    }
+  }
+
+  lu_min_heap_element_init_(ev);
+
+  if (base != NULL) {
+    /* by default, we put new events into the middle priority */
+    ev->ev_pri = base->nactivequeues / 2;
+  }
+
+  return 0;
+}
+
+lu_event_t *lu_event_new(lu_event_base_t *base, lu_evutil_socket_t fd, short events,
+    lu_event_callback_fn cb, void *arg)
+{
+  lu_event_t *ev;
+
+  if (base == NULL)
+    return (NULL);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  ev = lu_slab_alloc_(&base->event_slab);
+  LU_EVBASE_RELEASE_LOCK(base);
+  if (ev == NULL)
+    return (NULL);
+  /* Slab slots are not zeroed; don't let a reused one look queued. */
+  memset(&ev->ev_callback_, 0, sizeof(ev->ev_callback_));
+
+  if (lu_event_assign(ev, base, fd, events, cb, arg) < 0) {
+    LU_EVBASE_ACQUIRE_LOCK(base);
+    lu_slab_free_(&base->event_slab, ev);
+    LU_EVBASE_RELEASE_LOCK(base);
+    return (NULL);
+  }
+
+  return (ev);
+}
+
+/* Runs a one-shot event's callback, then recycles its record. */
+static void lu_event_once_cb(lu_evutil_socket_t fd, short events, void *arg)
+{
+  lu_event_once_t *eonce = arg;
+  lu_event_base_t *base = eonce->ev.ev_base;
+
+  (*eonce->cb)(fd, events, eonce->arg);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  LIST_REMOVE(eonce, next_once);
+  lu_slab_free_(&base->once_slab, eonce);
+  LU_EVBASE_RELEASE_LOCK(base);
+}
+
+int lu_event_base_once(lu_event_base_t *base, lu_evutil_socket_t fd, short events,
+    lu_event_callback_fn callback, void *arg, const struct timeval *tv)
+{
+  lu_event_once_t *eonce;
+  int activate = 0;
+  int res = 0;
+
+  if (base == NULL)
+    return (-1);
+
+  /* We cannot support signals that just fire once, or persistent events. */
+  if (events & (LU_EV_SIGNAL|LU_EV_PERSIST))
+    return (-1);
+
+  if ((events & (LU_EV_TIMEOUT|LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED)) == LU_EV_TIMEOUT) {
+    fd = -1;
+    events = 0;
+    if (tv == NULL || !lu_evutil_timerisset(tv))
+      activate = 1;
+  } else if (events & (LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED)) {
+    events &= LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED;
+  } else {
+    return (-1);
+  }
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+
+  if ((eonce = lu_slab_alloc_(&base->once_slab)) == NULL) {
+    LU_EVBASE_RELEASE_LOCK(base);
+    return (-1);
+  }
+  eonce->cb = callback;
+  eonce->arg = arg;
+
+  lu_event_assign(&eonce->ev, base, fd, events, lu_event_once_cb, eonce);
+  if (activate)
+    lu_event_active_nolock_(&eonce->ev, LU_EV_TIMEOUT, 1);
+  else
+    res = lu_event_add_nolock_(&eonce->ev, tv, 0);
+
+  if (res != 0)
+    lu_slab_free_(&base->once_slab, eonce);
+  else
+    LIST_INSERT_HEAD(&base->once_events, eonce, next_once);
+
+  LU_EVBASE_RELEASE_LOCK(base);
+
+  return (res);
+}
+
+void lu_event_free(lu_event_t *ev)
+{
+  lu_event_base_t *base = ev->ev_base;
+
+  /* make sure that this event won't be coming back to haunt us. */
+  lu_event_del(ev);
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  lu_slab_free_(&base->event_slab, ev);
+  LU_EVBASE_RELEASE_LOCK(base);
+}
+
+int lu_event_add(lu_event_t *ev, const struct timeval *tv)
+{
+  int res;
+
+  if (ev->ev_base == NULL) {
+    lu_event_warnx("%s: event has no event_base set.", __func__);
+    return -1;
+  }
+
+  LU_EVBASE_ACQUIRE_LOCK(ev->ev_base);
+
+  res = lu_event_add_nolock_(ev, tv, 0);
+
+  LU_EVBASE_RELEASE_LOCK(ev->ev_base);
+
+  return (res);
+}
+
+/* Implementation function to add an event.  Works just like lu_event_add,
+ * except: 1) it requires that we have the lock.  2) if tv_is_absolute is set,
+ * we treat tv as an absolute time, not as an interval to add to the current
+ * time */
+static int lu_event_add_nolock_(lu_event_t *ev, const struct timeval *tv,
+    int tv_is_absolute)
+{
+  lu_event_base_t *base = ev->ev_base;
+  int res = 0;
+  int notify = 0;
+
+  event_debug((
+      "event_add: event: %p (fd %d), %s%s%scall %p",
+      (void *)ev,
+      (int)ev->ev_fd,
+      ev->ev_events & LU_EV_READ ? "EV_READ " : " ",
+      ev->ev_events & LU_EV_WRITE ? "EV_WRITE " : " ",
+      ev->ev_events & LU_EV_CLOSED ? "EV_CLOSED " : " ",
+      (void *)ev->ev_callback));
+
+  if (ev->ev_flags & ~LU_EVLIST_ALL) {
+    lu_event_warnx("%s: event has illegal flags %d", __func__, ev->ev_flags);
+    return -1;
+  }
+
+  /*
+   * prepare for timeout insertion further below, if we get a
+   * failure on any step, we should not change any state.
+   */
+  if (tv != NULL && !(ev->ev_flags & LU_EVLIST_TIMEOUT)) {
+    if (lu_min_heap_reserve_(&base->timeheap,
+        1 + lu_min_heap_size_(&base->timeheap)) == -1)
+      return (-1);  /* ENOMEM == errno */
+  }
+
+  if ((ev->ev_events & (LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED|LU_EV_SIGNAL)) &&
+      !(ev->ev_flags & (LU_EVLIST_INSERTED|LU_EVLIST_ACTIVE|LU_EVLIST_ACTIVE_LATER))) {
+    if (ev->ev_events & (LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED))
+      res = lu_evmap_io_add_(base, ev->ev_fd, ev);
+    else if (ev->ev_events & LU_EV_SIGNAL)
+      res = lu_evmap_signal_add_(base, (int)ev->ev_fd, ev);
+    if (res != -1)
+      lu_event_queue_insert_inserted(base, ev);
+    if (res == 1) {
+      /* evmap says we need to notify the main thread. */
+      notify = 1;
+      res = 0;
+    }
+  }
+
+  /*
+   * we should change the timeout state only if the previous event
+   * addition succeeded.
+   */
+  if (res != -1 && tv != NULL) {
+    struct timeval now;
+    int common_timeout;
+
+    /*
+     * for persistent timeout events, we remember the
+     * timeout value and re-add the event.
+     *
+     * If tv_is_absolute, this was already set.
+     */
+    if (ev->ev_closure == LU_EV_CLOSURE_EVENT_PERSIST && !tv_is_absolute)
+      ev->ev_io_timeout = *tv;
+
+    if ((ev->ev_flags & LU_EVLIST_ACTIVE) &&
+        (ev->ev_res & LU_EV_TIMEOUT)) {
+      /* See if we are just active executing this
+       * event in a loop
+       */
+      lu_event_queue_remove_active(base, lu_event_to_event_callback(ev));
+    }
+
+    common_timeout = lu_is_common_timeout(tv, base);
+
+    /* A wheel entry is found again from its ev_timeout, so it has to come
+     * off the wheel before ev_timeout changes.  The same goes for moving
+     * between the wheel and the heap. */
+    if ((ev->ev_flags & LU_EVLIST_TIMEOUT) &&
+        (common_timeout || lu_is_common_timeout(&ev->ev_timeout, base)))
+      lu_event_queue_remove_timeout(base, ev);
+
+    gettime(base, &now);
+
+    if (tv_is_absolute) {
+      ev->ev_timeout = *tv;
+    } else if (common_timeout) {
+      struct timeval tmp = *tv;
+      tmp.tv_usec &= LU_MICROSECONDS_MASK;
+      lu_evutil_timeradd(&now, &tmp, &ev->ev_timeout);
+      ev->ev_timeout.tv_usec |= (tv->tv_usec & ~LU_MICROSECONDS_MASK);
+    } else {
+      lu_evutil_timeradd(&now, tv, &ev->ev_timeout);
+    }
+
+    event_debug((
+        "event_add: event %p, timeout in %d seconds %d useconds, call %p",
+        (void *)ev, (int)tv->tv_sec, (int)tv->tv_usec, (void *)ev->ev_callback));
+
+    lu_event_queue_reinsert_timeout(base, ev);
+
+    /* If the event is now the first to expire, the loop may be waiting
+     * for a later time and has to re-compute its timeout. */
+    if (lu_min_heap_elt_is_top_(ev))
+      notify = 1;
+  }
+
+  /* if we are not in the right thread, we need to wake up the loop */
+  if (res != -1 && notify && LU_EVBASE_NEED_NOTIFY(base))
+    lu_evthread_notify_base(base);
+
+  return (res);
+}
+
+int lu_event_del(lu_event_t *ev)
+{
+  int res;
+
+  if (ev->ev_base == NULL)
+    return (-1);
+
+  LU_EVBASE_ACQUIRE_LOCK(ev->ev_base);
+
+  res = lu_event_del_nolock_(ev);
+
+  LU_EVBASE_RELEASE_LOCK(ev->ev_base);
+
+  return (res);
+}
+
+static int lu_event_del_nolock_(lu_event_t *ev)
+{
+  lu_event_base_t *base;
+  int res = 0, notify = 0;
+
+  event_debug(("event_del: %p (fd %d), callback %p",
+      (void *)ev, (int)ev->ev_fd, (void *)ev->ev_callback));
+
+  /* An event without a base has not been added */
+  if (ev->ev_base == NULL)
+    return (-1);
+
+  base = ev->ev_base;
+
+  /* An activation queued by lu_event_active_async() must not fire
+   * either, nor reach the event once its memory is reused. */
+  if (__atomic_load_n(&ev->ev_callback_.evcb_async_res, __ATOMIC_ACQUIRE))
+    lu_event_async_cancel_(base, &ev->ev_callback_);
+
+  /* If lu_event_signal_closure() is running this event's callback for
+   * several raised signals, stop it after the current call. */
+  if (ev->ev_events & LU_EV_SIGNAL) {
+    if (ev->ev_ncalls && ev->ev_pncalls) {
+      /* Abort loop */
+      *ev->ev_pncalls = 0;
+    }
+  }
+
+  if (ev->ev_flags & LU_EVLIST_TIMEOUT) {
+    lu_event_queue_remove_timeout(base, ev);
+  }
+
+  if (ev->ev_flags & LU_EVLIST_ACTIVE)
+    lu_event_queue_remove_active(base, lu_event_to_event_callback(ev));
+
+  if (ev->ev_flags & LU_EVLIST_INSERTED) {
+    lu_event_queue_remove_inserted(base, ev);
+    if (ev->ev_events & (LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED))
+      res = lu_evmap_io_del_(base, ev->ev_fd, ev);
+    else
+      res = lu_evmap_signal_del_(base, (int)ev->ev_fd, ev);
+    if (res == 1) {
+      /* evmap says we need to notify the main thread. */
+      notify = 1;
+      res = 0;
+    }
+  }
+
+  /* if we are not in the right thread, we need to wake up the loop */
+  if (res != -1 && notify && LU_EVBASE_NEED_NOTIFY(base))
+    lu_evthread_notify_base(base);
+
+  return (res);
+}
+
+void lu_event_active(lu_event_t *ev, int res, short ncalls)
+{
+  if (ev->ev_base == NULL) {
+    lu_event_warnx("%s: event has no event_base set.", __func__);
+    return;
+  }
+
+  LU_EVBASE_ACQUIRE_LOCK(ev->ev_base);
+
+  lu_event_active_nolock_(ev, res, ncalls);
+
+  LU_EVBASE_RELEASE_LOCK(ev->ev_base);
+}
+
+void lu_event_active_nolock_(lu_event_t *ev, int res, short ncalls)
+{
+  lu_event_base_t *base;
+
+  event_debug(("event_active: %p (fd %d), res %d, callback %p",
+      (void *)ev, (int)ev->ev_fd, (int)res, (void *)ev->ev_callback));
+
+  base = ev->ev_base;
+
+  if (ev->ev_flags & LU_EVLIST_FINALIZING) {
+    /* XXXX debug */
+    return;
+  }
+
+  if (ev->ev_flags & LU_EVLIST_ACTIVE) {
+    /* already active: just merge in the new result */
+    ev->ev_res |= res;
+    return;
+  }
+
+  ev->ev_res = res;
+
+  if (ev->ev_pri < base->event_running_priority)
+    base->event_continue = 1;
+
+  if (ev->ev_events & LU_EV_SIGNAL) {
+    ev->ev_ncalls = ncalls;
+    ev->ev_pncalls = NULL;
+  }
+
+  lu_event_queue_insert_active(base, lu_event_to_event_callback(ev));
+
+  if (LU_EVBASE_NEED_NOTIFY(base))
+    lu_evthread_notify_base(base);
+}
+
+void lu_event_callback_activate_nolock_(lu_event_base_t *base,
+    lu_event_callback_t *evcb)
+{
+  if (evcb->evcb_flags & LU_EVLIST_ACTIVE)
+    return;
+
+  if (evcb->evcb_pri < base->event_running_priority)
+    base->event_continue = 1;
+
+  lu_event_queue_insert_active(base, evcb);
+
+  if (LU_EVBASE_NEED_NOTIFY(base))
+    lu_evthread_notify_base(base);
+}
+
+int lu_event_callback_activate_async_(lu_event_base_t *base,
+    lu_event_callback_t *evcb, short res)
+{
+  lu_event_callback_t *head;
+
+  res &= ~LU_EVCB_ASYNC_CANCELLED;
+  if (res == 0)
+    return (-1);
+
+  /* Already queued: the loop will see the merged result. */
+  if (__atomic_fetch_or(&evcb->evcb_async_res, res, __ATOMIC_ACQ_REL))
+    return (0);
+
+  head = __atomic_load_n(&base->async_head, __ATOMIC_RELAXED);
+  do {
+    evcb->evcb_async_next = head;
+  } while (!__atomic_compare_exchange_n(&base->async_head, &head, evcb, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  /* Only the push that makes the queue non-empty needs to wake the loop;
+   * it drains everything queued up to then. */
+  if (head == NULL)
+    lu_evthread_notify_base(base);
+
+  return (0);
+}
+
+int lu_event_active_async(lu_event_t *ev, int res)
+{
+  return lu_event_callback_activate_async_(ev->ev_base,
+      lu_event_to_event_callback(ev), (short)res);
+}
+
+/** Drop the activation of evcb queued on base's async queue, if any, and
+ * take evcb off the queue.  Called with the lock held, so the loop is not
+ * draining the queue meanwhile.  A pusher that has set the result but not
+ * linked evcb yet finds it marked LU_EVCB_ASYNC_CANCELLED, which the
+ * drain skips. */
+static void lu_event_async_cancel_(lu_event_base_t *base,
+    lu_event_callback_t *evcb)
+{
+  lu_event_callback_t *list, **pp, *tail, *head;
+  short expected = LU_EVCB_ASYNC_CANCELLED;
+  int found = 0;
+
+  if (__atomic_load_n(&evcb->evcb_async_res, __ATOMIC_ACQUIRE) == 0)
+    return;
+  __atomic_store_n(&evcb->evcb_async_res, LU_EVCB_ASYNC_CANCELLED,
+      __ATOMIC_RELEASE);
+
+  list = __atomic_exchange_n(&base->async_head, NULL, __ATOMIC_ACQUIRE);
+  for (pp = &list; *pp; pp = &(*pp)->evcb_async_next) {
+    if (*pp == evcb) {
+      *pp = evcb->evcb_async_next;
+      found = 1;
+      break;
+    }
+  }
+
+  if (found) {
+    /* Only clear the result if nobody re-activated evcb since we marked
+     * it; if someone did, they expect it queued, so it goes back. */
+    if (__atomic_compare_exchange_n(&evcb->evcb_async_res, &expected, 0, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      evcb->evcb_async_next = NULL;
+    } else {
+      evcb->evcb_async_next = list;
+      list = evcb;
+    }
+  }
+
+  /* Put the rest back in front of whatever was pushed meanwhile. */
+  if (list == NULL)
+    return;
+  for (tail = list; tail->evcb_async_next; tail = tail->evcb_async_next)
+    ;
+  head = __atomic_load_n(&base->async_head, __ATOMIC_RELAXED);
+  do {
+    tail->evcb_async_next = head;
+  } while (!__atomic_compare_exchange_n(&base->async_head, &head, list, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/** Take every callback queued by lu_event_callback_activate_async_() and
+ * activate it.  Called by the loop with the lock held. */
+static int lu_event_process_async(lu_event_base_t *base)
+{
+  lu_event_callback_t *list, *next, *fifo = NULL;
+  int n = 0;
+
+  list = __atomic_exchange_n(&base->async_head, NULL, __ATOMIC_ACQUIRE);
+
+  /* The stack is newest first; reverse it to keep posting order. */
+  while (list) {
+    next = list->evcb_async_next;
+    list->evcb_async_next = fifo;
+    fifo = list;
+    list = next;
+  }
+
+  for (; fifo; fifo = next) {
+    short res;
+
+    next = fifo->evcb_async_next;
+
+    /* Activate at most LU_MAX_DEFERREDS_QUEUED non-event callbacks per
+     * iteration, so that a flood of completions can't keep the loop from
+     * polling.  The rest go back on the queue, oldest first, for the next
+     * iteration; their result is still set, so nobody else pushes them. */
+    if (!(fifo->evcb_flags & LU_EVLIST_INIT) &&
+        base->n_deferred_queued >= LU_MAX_DEFERREDS_QUEUED) {
+      lu_event_callback_t *head = __atomic_load_n(&base->async_head, __ATOMIC_RELAXED);
+      do {
+        fifo->evcb_async_next = head;
+      } while (!__atomic_compare_exchange_n(&base->async_head, &head, fifo, 1,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+      continue;
+    }
+
+    /* Read the link before clearing the result: once it is 0, another
+     * thread may push this callback again. */
+    res = __atomic_exchange_n(&fifo->evcb_async_res, 0, __ATOMIC_ACQ_REL);
+    res &= ~LU_EVCB_ASYNC_CANCELLED;
+    if (res == 0)
+      continue;
+
+    if (fifo->evcb_flags & LU_EVLIST_INIT) {
+      lu_event_active_nolock_(lu_event_callback_to_event(fifo), res, 1);
+    } else {
+      ++base->n_deferred_queued;
+      lu_event_callback_activate_nolock_(base, fifo);
+    }
+    ++n;
+  }
+
+  return n;
+}
+
+static void lu_event_queue_insert_active(lu_event_base_t *base, lu_event_callback_t *evcb)
+{
+  if (evcb->evcb_flags & LU_EVLIST_ACTIVE) {
+    /* Double insertion is possible for active events */
+    return;
+  }
+
+  LU_INCR_EVENT_COUNT(base, evcb->evcb_flags);
+
+  evcb->evcb_flags |= LU_EVLIST_ACTIVE;
+  if (base->trace)
+    lu_evutil_gettime_precise_(&evcb->evcb_activated);
+
+  base->event_count_active++;
+  LU_MAX_EVENT_COUNT(base->event_count_active_max, base->event_count_active);
+  TAILQ_INSERT_TAIL(&base->active_queues[evcb->evcb_pri],
+      evcb, evcb_active_next);
+  base->active_queues_bitmap |= ((lu_uint64_t)1) << evcb->evcb_pri;
+}
+
+static void lu_event_queue_remove_active(lu_event_base_t *base, lu_event_callback_t *evcb)
+{
+  if (!(evcb->evcb_flags & LU_EVLIST_ACTIVE)) {
+    lu_event_warnx("%s: %p not on queue %x", __func__,
+        (void *)evcb, LU_EVLIST_ACTIVE);
+    return;
+  }
+  LU_DECR_EVENT_COUNT(base, evcb->evcb_flags);
+  evcb->evcb_flags &= ~LU_EVLIST_ACTIVE;
+  base->event_count_active--;
+
+  TAILQ_REMOVE(&base->active_queues[evcb->evcb_pri],
+      evcb, evcb_active_next);
+  if (TAILQ_EMPTY(&base->active_queues[evcb->evcb_pri]))
+    base->active_queues_bitmap &= ~(((lu_uint64_t)1) << evcb->evcb_pri);
+}
+
+static void lu_event_queue_insert_inserted(lu_event_base_t *base, lu_event_t *ev)
+{
+  if (ev->ev_flags & LU_EVLIST_INSERTED) {
+    lu_event_warnx("%s: %p(fd %d) already inserted", __func__,
+        (void *)ev, (int)ev->ev_fd);
+    return;
+  }
+
+  LU_INCR_EVENT_COUNT(base, ev->ev_flags);
+
+  ev->ev_flags |= LU_EVLIST_INSERTED;
+}
+
+static void lu_event_queue_remove_inserted(lu_event_base_t *base, lu_event_t *ev)
+{
+  if (!(ev->ev_flags & LU_EVLIST_INSERTED)) {
+    lu_event_warnx("%s: %p(fd %d) not on queue %x", __func__,
+        (void *)ev, (int)ev->ev_fd, LU_EVLIST_INSERTED);
+    return;
+  }
+  LU_DECR_EVENT_COUNT(base, ev->ev_flags);
+  ev->ev_flags &= ~LU_EVLIST_INSERTED;
+}
+
+static void lu_event_queue_insert_timeout(lu_event_base_t *base, lu_event_t *ev)
+{
+  if (ev->ev_flags & LU_EVLIST_TIMEOUT) {
+    lu_event_warnx("%s: %p(fd %d) already on timeout", __func__,
+        (void *)ev, (int)ev->ev_fd);
+    return;
+  }
+
+  LU_INCR_EVENT_COUNT(base, ev->ev_flags);
+
+  ev->ev_flags |= LU_EVLIST_TIMEOUT;
+
+  if (lu_is_common_timeout(&ev->ev_timeout, base)) {
+    lu_timer_wheel_t *wheel = &base->common_timeout_wheel;
+    lu_uint64_t tick;
+    if (wheel->count == 0) {
+      /* Nothing is pending, so the wheel can jump straight to now. */
+      struct timeval now;
+      gettime(base, &now);
+      lu_timer_wheel_advance_(wheel, lu_timer_wheel_tv_to_tick_(&now));
+    }
+    tick = lu_timer_wheel_insert_(wheel, ev);
+    if (!(base->common_timeout_event.ev_flags & LU_EVLIST_TIMEOUT) ||
+        tick < base->common_timeout_scheduled_tick)
+      lu_common_timeout_schedule(base, tick);
+  } else {
+    lu_min_heap_push_(&base->timeheap, ev);
+  }
+}
+
+static void lu_event_queue_remove_timeout(lu_event_base_t *base, lu_event_t *ev)
+{
+  if (!(ev->ev_flags & LU_EVLIST_TIMEOUT)) {
+    lu_event_warnx("%s: %p(fd %d) not on queue %x", __func__,
+        (void *)ev, (int)ev->ev_fd, LU_EVLIST_TIMEOUT);
+    return;
+  }
+  LU_DECR_EVENT_COUNT(base, ev->ev_flags);
+  ev->ev_flags &= ~LU_EVLIST_TIMEOUT;
+
+  /* The wheel timer is left armed; if it fires for nothing it just
+   * re-arms for the next expiry. */
+  if (lu_is_common_timeout(&ev->ev_timeout, base))
+    lu_timer_wheel_remove_(&base->common_timeout_wheel, ev);
+  else
+    lu_min_heap_erase_(&base->timeheap, ev);
+}
+
+/* Move ev to its new place in the timeout heap after ev_timeout changed,
+ * inserting it if it was not there yet.  Events on the common timeout wheel
+ * have already been removed by lu_event_add_nolock_(). */
+static void lu_event_queue_reinsert_timeout(lu_event_base_t *base, lu_event_t *ev)
+{
+  if (!(ev->ev_flags & LU_EVLIST_TIMEOUT)) {
+    lu_event_queue_insert_timeout(base, ev);
+    return;
+  }
+
+  lu_min_heap_adjust_(&base->timeheap, ev);
+}
+
+/** Return true iff tv is a magic timeval returned by
+ * lu_event_base_init_common_timeout() on this base. */
+static inline int lu_is_common_timeout(const struct timeval *tv,
+    const lu_event_base_t *base)
+{
+  int idx;
+  if ((tv->tv_usec & LU_COMMON_TIMEOUT_MASK) != LU_COMMON_TIMEOUT_MAGIC)
+    return 0;
+  idx = LU_COMMON_TIMEOUT_IDX(tv);
+  return idx < base->n_common_timeouts;
+}
+
+/* Arm the wheel's heap timer for the start of 'tick'. */
+static void lu_common_timeout_schedule(lu_event_base_t *base, lu_uint64_t tick)
+{
+  struct timeval at;
+
+  lu_timer_wheel_tick_to_tv_(tick, &at);
+  base->common_timeout_scheduled_tick = tick;
+  lu_event_add_nolock_(&base->common_timeout_event, &at, 1);
+}
+
+/* Callback for the wheel's heap timer: activate every event on the wheel
+ * that has expired, then re-arm for the next one. */
+static void lu_common_timeout_callback(lu_evutil_socket_t fd, short what, void *arg)
+{
+  lu_event_base_t *base = arg;
+  lu_timer_wheel_t *wheel = &base->common_timeout_wheel;
+  struct timeval now;
+  lu_event_t *ev;
+  lu_uint64_t tick;
+
+  (void)fd;
+  (void)what;
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+  gettime(base, &now);
+  lu_timer_wheel_advance_(wheel, lu_timer_wheel_tv_to_tick_(&now));
+
+  while ((ev = TAILQ_FIRST(&wheel->due)) != NULL) {
+    lu_event_del_nolock_(ev);
+    lu_event_active_nolock_(ev, LU_EV_TIMEOUT, 1);
+  }
+
+  tick = lu_timer_wheel_next_tick_(wheel);
+  if (tick != LU_TIMER_WHEEL_NO_TICK)
+    lu_common_timeout_schedule(base, tick);
+  LU_EVBASE_RELEASE_LOCK(base);
+}
+
+const struct timeval *lu_event_base_init_common_timeout(lu_event_base_t *base,
+    const struct timeval *duration)
+{
+  int i;
+  struct timeval tv;
+  const struct timeval *result = NULL;
+  lu_common_timeout_list_t *new_ctl;
+
+  LU_EVBASE_ACQUIRE_LOCK(base);
+
+  if (duration->tv_usec > 1000000) {
+    memcpy(&tv, duration, sizeof(struct timeval));
+    if (lu_is_common_timeout(duration, base))
+      tv.tv_usec &= LU_MICROSECONDS_MASK;
+    tv.tv_sec += tv.tv_usec / 1000000;
+    tv.tv_usec %= 1000000;
+    duration = &tv;
+  }
+
+  if (lu_timer_wheel_tv_to_tick_(duration) < 1 ||
+      lu_timer_wheel_tv_to_tick_(duration) > LU_TIMER_WHEEL_MAX_TICKS) {
+    lu_event_warnx("%s: common timeout of %ld.%06ld seconds is outside "
+        "the timing wheel's range", __func__,
+        (long)duration->tv_sec, (long)duration->tv_usec);
+    goto done;
+  }
+
+  for (i = 0; i < base->n_common_timeouts; ++i) {
+    const lu_common_timeout_list_t *ctl = base->common_timeout_queues[i];
+    if (duration->tv_sec == ctl->duration.tv_sec &&
+        duration->tv_usec == (ctl->duration.tv_usec & LU_MICROSECONDS_MASK)) {
+      result = &ctl->duration;
+      goto done;
+    }
+  }
+
+  if (base->n_common_timeouts == LU_MAX_COMMON_TIMEOUTS) {
+    lu_event_warnx("%s: Too many common timeouts already in use; "
+        "we only support %d per event_base", __func__, LU_MAX_COMMON_TIMEOUTS);
+    goto done;
+  }
+  if (base->n_common_timeouts_allocated == base->n_common_timeouts) {
+    int n = base->n_common_timeouts < 16 ? 16 :
+        base->n_common_timeouts * 2;
+    lu_common_timeout_list_t **newqueues =
+        mm_realloc(base->common_timeout_queues,
+            n * sizeof(lu_common_timeout_list_t *));
+    if (!newqueues) {
+      lu_event_warn("%s: realloc", __func__);
+      goto done;
+    }
+    base->n_common_timeouts_allocated = n;
+    base->common_timeout_queues = newqueues;
+  }
+  new_ctl = mm_calloc(1, sizeof(lu_common_timeout_list_t));
+  if (!new_ctl) {
+    lu_event_warn("%s: calloc", __func__);
+    goto done;
+  }
+  new_ctl->duration.tv_sec = duration->tv_sec;
+  new_ctl->duration.tv_usec = duration->tv_usec | LU_COMMON_TIMEOUT_MAGIC |
+      (base->n_common_timeouts << LU_COMMON_TIMEOUT_IDX_SHIFT);
+  new_ctl->base = base;
+  base->common_timeout_queues[base->n_common_timeouts++] = new_ctl;
+
+  result = &new_ctl->duration;
+
+done:
+  LU_EVBASE_RELEASE_LOCK(base);
+  return result;
+}
+
+/* Wake the loop by bumping the eventfd counter.  Many notifications
+ * between two drains collapse into one readable event. */
+static int lu_evthread_notify_base_eventfd(lu_event_base_t *base)
+{
+  lu_uint64_t msg = 1;
+  int r;
+  do {
+    r = write(base->th_notify_fd[0], (void *)&msg, sizeof(msg));
+  } while (r < 0 && errno == EAGAIN);
+
+  return (r < 0) ? -1 : 0;
+}
+
+/* Wake the loop by writing a byte to the pipe; used without eventfd. */
+static int lu_evthread_notify_base_default(lu_event_base_t *base)
+{
+  char buf[1];
+  int r;
+  buf[0] = (char) 0;
+  r = write(base->th_notify_fd[1], buf, 1);
+  return (r < 0 && errno != EAGAIN) ? -1 : 0;
+}
+
+/* Callback for the eventfd: reset the counter and allow new notifies. */
+static void lu_evthread_notify_drain_eventfd(lu_evutil_socket_t fd, short what, void *arg)
+{
+  lu_event_base_t *base = arg;
+  lu_uint64_t msg;
+  ssize_t r;
+
+  (void)what;
+
+  /* Clear the flag before reading, so that a notify racing with us
+   * either lands in this read or writes again. */
+  __atomic_store_n(&base->is_notify_pending, 0, __ATOMIC_RELEASE);
+  r = read(fd, (void *)&msg, sizeof(msg));
+  if (r < 0 && errno != EAGAIN)
+    lu_event_warn("Error reading from eventfd");
+}
+
+/* Callback for the pipe: empty it and allow new notifies. */
+static void lu_evthread_notify_drain_default(lu_evutil_socket_t fd, short what, void *arg)
+{
+  unsigned char buf[1024];
+  lu_event_base_t *base = arg;
+
+  (void)what;
+
+  __atomic_store_n(&base->is_notify_pending, 0, __ATOMIC_RELEASE);
+  while (read(fd, (char *)buf, sizeof(buf)) > 0)
+    ;
+}
+
+/** Tell the thread currently running the event loop for base (if any) that
+ * it needs to stop waiting in its dispatch function (if it is) and process
+ * all active callbacks.  Only the first caller since the last drain pays
+ * for a syscall. */
+static int lu_evthread_notify_base(lu_event_base_t *base)
+{
+  if (!base->th_notify_fn)
+    return -1;
+  if (__atomic_exchange_n(&base->is_notify_pending, 1, __ATOMIC_ACQ_REL))
+    return 0;
+  return base->th_notify_fn(base);
+}
+
+/* Set up th_notify: an eventfd if the kernel has one, else a pipe. */
+static int lu_evthread_make_base_notifiable_nolock_(lu_event_base_t *base)
+{
+  void (*cb)(lu_evutil_socket_t, short, void *);
+  int (*notify)(lu_event_base_t *);
+
+  if (base->th_notify_fn != NULL) {
+    /* The base is already notifiable: we're doing fine. */
+    return 0;
+  }
+
+  base->th_notify_fd[0] = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  if (base->th_notify_fd[0] >= 0) {
+    base->th_notify_fd[1] = -1;
+    notify = lu_evthread_notify_base_eventfd;
+    cb = lu_evthread_notify_drain_eventfd;
+  } else if (pipe(base->th_notify_fd) == 0) {
+    fcntl(base->th_notify_fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(base->th_notify_fd[1], F_SETFD, FD_CLOEXEC);
+    lu_evutil_make_socket_nonblocking(base->th_notify_fd[0]);
+    lu_evutil_make_socket_nonblocking(base->th_notify_fd[1]);
+    notify = lu_evthread_notify_base_default;
+    cb = lu_evthread_notify_drain_default;
+  } else {
+    base->th_notify_fd[0] = base->th_notify_fd[1] = -1;
+    return -1;
+  }
+
+  base->th_notify_fn = notify;
+
+  /* prepare an event that we can use for wakeup */
+  lu_event_assign(&base->th_notify, base, base->th_notify_fd[0],
+      LU_EV_READ|LU_EV_PERSIST, cb, base);
+
+  /* we need to mark this as internal event */
+  base->th_notify.ev_flags |= LU_EVLIST_INTERNAL;
+  base->th_notify.ev_pri = 0;
+
+  return lu_event_add_nolock_(&base->th_notify, NULL, 0);
+}
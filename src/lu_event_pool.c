@@ -0,0 +1,331 @@
+/**
+ * @file lu_event_pool.c
+ * @brief Reactor pool: one base and loop thread per core.
+ */
+#define _GNU_SOURCE
+#include "lu_event_pool.h"
+#include "lu_event-internal.h"
+#include "lu_log-internal.h"
+#include "lu_memory_manager.h"
+#include "lu_util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** One reactor of the pool: a base and the thread that runs it. */
+typedef struct lu_event_pool_reactor_s {
+    lu_event_base_t *base;
+    pthread_t thread;
+    /* The CPU to pin the thread to, or -1. */
+    int cpu;
+} lu_event_pool_reactor_t;
+
+struct lu_event_pool_s {
+    lu_event_pool_reactor_t *reactors;
+    int nreactors;
+    /* Number of reactors whose thread is running. */
+    int nrunning;
+    int flags;
+    /* Set by lu_event_pool_stop(); checked by every loop before it polls,
+     * since a loopbreak sent before a loop starts would be forgotten. */
+    int stopping;
+    /* Counter for lu_event_pool_next_base(). */
+    unsigned int next;
+
+    /* Listener events, one per base for each lu_event_pool_listen(). */
+    lu_event_t **listeners;
+    int nlisteners;
+    int listeners_size;
+};
+
+
+/** Prepare watcher of every base: end the loop once the pool stops. */
+static void lu_event_pool_check_stop_(lu_evwatch_t *watcher,
+    const lu_evwatch_prepare_cb_info_t *info, void *arg)
+{
+    lu_event_pool_t *pool = arg;
+
+    (void)info;
+    if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE))
+        lu_event_base_loopbreak(lu_evwatch_base(watcher));
+}
+
+static void *lu_event_pool_thread_(void *arg)
+{
+    lu_event_pool_reactor_t *r = arg;
+
+    if (r->cpu >= 0) {
+        cpu_set_t set;
+        int err;
+
+        CPU_ZERO(&set);
+        CPU_SET(r->cpu, &set);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0)
+            lu_event_warnx("%s: cannot pin to cpu %d: %s", __func__, r->cpu,
+                strerror(err));
+    }
+
+    lu_event_base_loop(r->base, LU_EVLOOP_NO_EXIT_ON_EMPTY);
+    return NULL;
+}
+
+lu_event_pool_t *lu_event_pool_new(lu_event_config_t *cfg, int flags)
+{
+    lu_event_pool_t *pool;
+    cpu_set_t allowed;
+    int n, i, cpu;
+    int have_mask;
+
+    have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    n = cfg ? cfg->n_cpus_hint : 0;
+    if (n <= 0)
+        n = have_mask ? CPU_COUNT(&allowed) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0)
+        n = 1;
+
+    pool = mm_calloc(1, sizeof(lu_event_pool_t));
+    if (pool == NULL)
+        return NULL;
+    pool->reactors = mm_calloc(n, sizeof(lu_event_pool_reactor_t));
+    if (pool->reactors == NULL) {
+        mm_free(pool);
+        return NULL;
+    }
+    pool->flags = flags;
+
+    /* Assign the allowed CPUs in order, wrapping around when there are
+     * more bases than CPUs. */
+    cpu = -1;
+    for (i = 0; i < n; ++i) {
+        lu_event_pool_reactor_t *r = &pool->reactors[i];
+
+        r->cpu = -1;
+        if ((flags & LU_EVENT_POOL_PIN_CPUS) && have_mask) {
+            int tries;
+            for (tries = 0; tries < CPU_SETSIZE; ++tries) {
+                cpu = (cpu + 1) % CPU_SETSIZE;
+                if (CPU_ISSET(cpu, &allowed))
+                    break;
+            }
+            r->cpu = cpu;
+        }
+
+        r->base = cfg ? lu_event_base_new_with_config(cfg) : lu_event_base_new();
+        if (r->base == NULL) {
+            lu_event_warnx("%s: cannot create base %d of %d", __func__, i, n);
+            lu_event_pool_free(pool);
+            return NULL;
+        }
+        pool->nreactors = i + 1;
+        /* Freed with the base. */
+        if (lu_evwatch_prepare_new(r->base, lu_event_pool_check_stop_, pool) == NULL) {
+            lu_event_pool_free(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+/** Free the last listener event, and close its socket unless the
+ * listener before it shares the socket. */
+static void lu_event_pool_close_listener_(lu_event_pool_t *pool)
+{
+    lu_event_t *ev = pool->listeners[--pool->nlisteners];
+    lu_evutil_socket_t fd = ev->ev_fd;
+
+    lu_event_free(ev);
+    if (pool->nlisteners == 0 || pool->listeners[pool->nlisteners - 1]->ev_fd != fd)
+        close(fd);
+}
+
+void lu_event_pool_free(lu_event_pool_t *pool)
+{
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    lu_event_pool_stop(pool);
+
+    while (pool->nlisteners > 0)
+        lu_event_pool_close_listener_(pool);
+    if (pool->listeners)
+        mm_free(pool->listeners);
+
+    for (i = 0; i < pool->nreactors; ++i)
+        lu_event_base_free(pool->reactors[i].base);
+    mm_free(pool->reactors);
+    mm_free(pool);
+}
+
+int lu_event_pool_start(lu_event_pool_t *pool)
+{
+    int i, err;
+
+    if (pool->nrunning)
+        return (-1);
+
+    __atomic_store_n(&pool->stopping, 0, __ATOMIC_RELEASE);
+    for (i = 0; i < pool->nreactors; ++i) {
+        err = pthread_create(&pool->reactors[i].thread, NULL,
+            lu_event_pool_thread_, &pool->reactors[i]);
+        if (err != 0) {
+            lu_event_warnx("%s: pthread_create: %s", __func__, strerror(err));
+            lu_event_pool_stop(pool);
+            return (-1);
+        }
+        pool->nrunning = i + 1;
+    }
+
+    return (0);
+}
+
+int lu_event_pool_stop(lu_event_pool_t *pool)
+{
+    int i;
+
+    if (pool->nrunning == 0)
+        return (0);
+
+    /* A loop that has not started yet sees the flag before it first
+     * polls; a running one is woken by the loopbreak. */
+    __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < pool->nrunning; ++i)
+        lu_event_base_loopbreak(pool->reactors[i].base);
+    for (i = 0; i < pool->nrunning; ++i)
+        pthread_join(pool->reactors[i].thread, NULL);
+    pool->nrunning = 0;
+    __atomic_store_n(&pool->stopping, 0, __ATOMIC_RELEASE);
+
+    return (0);
+}
+
+int lu_event_pool_get_nbases(const lu_event_pool_t *pool)
+{
+    return pool->nreactors;
+}
+
+lu_event_base_t *lu_event_pool_get_base(lu_event_pool_t *pool, int i)
+{
+    if (i < 0 || i >= pool->nreactors)
+        return NULL;
+    return pool->reactors[i].base;
+}
+
+lu_event_base_t *lu_event_pool_next_base(lu_event_pool_t *pool)
+{
+    unsigned int i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    return pool->reactors[i % pool->nreactors].base;
+}
+
+/** Open a nonblocking listening socket on sa, that shares the port with
+ * the other bases' sockets if reuseport is set. */
+static lu_evutil_socket_t lu_event_pool_bind_(const struct sockaddr *sa,
+    socklen_t socklen, int backlog, int reuseport)
+{
+    lu_evutil_socket_t fd;
+
+    fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        lu_event_warn("%s: socket", __func__);
+        return -1;
+    }
+    if (lu_evutil_make_listen_socket_reuseable(fd) < 0 ||
+        (reuseport && lu_evutil_make_listen_socket_reuseable_port(fd) < 0)) {
+        lu_event_warn("%s: setsockopt", __func__);
+        goto err;
+    }
+    if (bind(fd, sa, socklen) < 0) {
+        lu_event_warn("%s: bind", __func__);
+        goto err;
+    }
+    if (listen(fd, backlog) < 0) {
+        lu_event_warn("%s: listen", __func__);
+        goto err;
+    }
+    return fd;
+
+err:
+    close(fd);
+    return -1;
+}
+
+int lu_event_pool_listen(lu_event_pool_t *pool, const struct sockaddr *sa,
+    socklen_t socklen, int backlog, lu_event_callback_fn cb, void *arg)
+{
+    int i, first = pool->nlisteners;
+    int exclusive = 0;
+    short events = LU_EV_READ | LU_EV_PERSIST;
+
+    if (pool->nlisteners + pool->nreactors > pool->listeners_size) {
+        int new_size = pool->listeners_size ? pool->listeners_size : 8;
+        lu_event_t **tmp;
+        while (new_size < pool->nlisteners + pool->nreactors)
+            new_size <<= 1;
+        tmp = mm_realloc(pool->listeners, new_size * sizeof(lu_event_t *));
+        if (tmp == NULL)
+            return (-1);
+        pool->listeners = tmp;
+        pool->listeners_size = new_size;
+    }
+
+    if (pool->flags & LU_EVENT_POOL_LISTEN_EXCLUSIVE) {
+        exclusive = (lu_event_base_get_features(pool->reactors[0].base) &
+            LU_EVENT_FEATURE_EXCLUSIVE) != 0;
+        if (!exclusive)
+            event_debug(("%s: backend %s can't wake one base only; "
+                "using one SO_REUSEPORT socket per base", __func__,
+                lu_event_base_get_method(pool->reactors[0].base)));
+    }
+    if (exclusive)
+        events |= LU_EV_EXCLUSIVE;
+
+    for (i = 0; i < pool->nreactors; ++i) {
+        lu_evutil_socket_t fd;
+        lu_event_t *ev;
+
+        /* Bind the first socket before the others so that a wildcard port
+         * 0 turns into one concrete port that they all share. */
+        if (i == 0) {
+            fd = lu_event_pool_bind_(sa, socklen, backlog, !exclusive);
+        } else if (exclusive) {
+            fd = pool->listeners[first]->ev_fd;
+        } else {
+            struct sockaddr_storage ss;
+            socklen_t len = sizeof(ss);
+            if (getsockname(pool->listeners[first]->ev_fd,
+                (struct sockaddr *)&ss, &len) < 0) {
+                lu_event_warn("%s: getsockname", __func__);
+                goto err;
+            }
+            fd = lu_event_pool_bind_((struct sockaddr *)&ss, len, backlog, 1);
+        }
+        if (fd < 0)
+            goto err;
+
+        ev = lu_event_new(pool->reactors[i].base, fd, events, cb, arg);
+        if (ev == NULL || lu_event_add(ev, NULL) < 0) {
+            if (ev)
+                lu_event_free(ev);
+            if (i == 0 || !exclusive)
+                close(fd);
+            goto err;
+        }
+        pool->listeners[pool->nlisteners++] = ev;
+    }
+
+    return (0);
+
+err:
+    while (pool->nlisteners > first)
+        lu_event_pool_close_listener_(pool);
+    return (-1);
+}
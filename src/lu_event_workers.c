@@ -0,0 +1,340 @@
+/**
+ * @file lu_event_workers.c
+ * @brief Work-stealing worker threads attached to a base.
+ *
+ * Every worker owns a deque of jobs guarded by its own small lock: the
+ * owner pushes and pops at the bottom, idle workers steal from the top.
+ * Jobs submitted from outside the pool are dealt round-robin.  A job's
+ * completion is a non-event callback embedded in the job, which the worker
+ * hands back to the loop through the base's lock-free activation queue, so
+ * finishing a job never takes the base lock.
+ */
+#define _GNU_SOURCE
+#include "lu_event_workers.h"
+#include "lu_event-internal.h"
+#include "lu_log-internal.h"
+#include "lu_memory_manager.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+
+typedef struct lu_event_work_s {
+    /* Completion, run in the loop's thread.  Must be first. */
+    lu_event_callback_t cb;
+    lu_event_work_fn work;
+    lu_event_work_done_fn done;
+    void *arg;
+    lu_event_base_t *base;
+} lu_event_work_t;
+
+/** A growable ring of jobs.  bottom - top jobs are queued, at indexes
+ * top..bottom-1 modulo size. */
+typedef struct lu_event_work_deque_s {
+    pthread_mutex_t lock;
+    lu_event_work_t **jobs;
+    unsigned int size;
+    unsigned int top;
+    unsigned int bottom;
+} lu_event_work_deque_t;
+
+typedef struct lu_event_worker_s {
+    struct lu_event_workers_s *pool;
+    pthread_t thread;
+    lu_event_work_deque_t deque;
+    int index;
+} lu_event_worker_t;
+
+struct lu_event_workers_s {
+    lu_event_worker_t *workers;
+    int nworkers;
+    /* Jobs queued in all deques; only changed with atomics. */
+    int nqueued;
+    /* Workers sleeping on 'wake'; only changed with 'lock' held. */
+    int nidle;
+    int stopping;
+    /* Round-robin counter for jobs from outside the pool. */
+    unsigned int next;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+#define LU_EVENT_WORK_DEQUE_INITIAL 64
+
+/* The worker running on this thread, if any. */
+static __thread lu_event_worker_t *lu_event_current_worker_ = NULL;
+
+
+static int lu_event_work_deque_push_(lu_event_work_deque_t *dq, lu_event_work_t *job)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom - dq->top == dq->size) {
+        unsigned int new_size = dq->size ? dq->size * 2 : LU_EVENT_WORK_DEQUE_INITIAL;
+        lu_event_work_t **jobs = mm_malloc(new_size * sizeof(lu_event_work_t *));
+        unsigned int i;
+
+        if (jobs == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            return (-1);
+        }
+        for (i = dq->top; i != dq->bottom; ++i)
+            jobs[i & (new_size - 1)] = dq->jobs[i & (dq->size - 1)];
+        if (dq->jobs)
+            mm_free(dq->jobs);
+        dq->jobs = jobs;
+        dq->size = new_size;
+    }
+    dq->jobs[dq->bottom++ & (dq->size - 1)] = job;
+    pthread_mutex_unlock(&dq->lock);
+    return (0);
+}
+
+/** Take the newest job; used by the deque's owner. */
+static lu_event_work_t *lu_event_work_deque_pop_(lu_event_work_deque_t *dq)
+{
+    lu_event_work_t *job = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom != dq->top)
+        job = dq->jobs[--dq->bottom & (dq->size - 1)];
+    pthread_mutex_unlock(&dq->lock);
+    return job;
+}
+
+/** Take the oldest job; used by thieves. */
+static lu_event_work_t *lu_event_work_deque_steal_(lu_event_work_deque_t *dq)
+{
+    lu_event_work_t *job = NULL;
+
+    /* Don't wait on a busy victim, just try the next one. */
+    if (pthread_mutex_trylock(&dq->lock) != 0)
+        return NULL;
+    if (dq->bottom != dq->top)
+        job = dq->jobs[dq->top++ & (dq->size - 1)];
+    pthread_mutex_unlock(&dq->lock);
+    return job;
+}
+
+/** Runs in the loop's thread when a job has finished. */
+static void lu_event_work_complete_(lu_event_callback_t *evcb, void *arg)
+{
+    lu_event_work_t *job = arg;
+    lu_event_base_t *base = job->base;
+
+    (void)evcb;
+
+    if (job->done)
+        job->done(job->arg);
+    mm_free(job);
+
+    LU_EVBASE_ACQUIRE_LOCK(base);
+    lu_event_base_del_virtual_(base);
+    LU_EVBASE_RELEASE_LOCK(base);
+}
+
+static void lu_event_work_run_(lu_event_work_t *job)
+{
+    __atomic_sub_fetch(&job->base->workers->nqueued, 1, __ATOMIC_SEQ_CST);
+    job->work(job->arg);
+    lu_event_callback_activate_async_(job->base, &job->cb, 1);
+}
+
+/** Find a job: our own newest one first, then the oldest of another
+ * worker, starting after ourselves so thieves spread over victims. */
+static lu_event_work_t *lu_event_worker_find_(lu_event_worker_t *self)
+{
+    struct lu_event_workers_s *pool = self->pool;
+    lu_event_work_t *job;
+    int i;
+
+    if ((job = lu_event_work_deque_pop_(&self->deque)) != NULL)
+        return job;
+    for (i = 1; i < pool->nworkers; ++i) {
+        lu_event_worker_t *victim = &pool->workers[(self->index + i) % pool->nworkers];
+        if ((job = lu_event_work_deque_steal_(&victim->deque)) != NULL)
+            return job;
+    }
+    return NULL;
+}
+
+static void *lu_event_worker_thread_(void *arg)
+{
+    lu_event_worker_t *self = arg;
+    struct lu_event_workers_s *pool = self->pool;
+    lu_event_work_t *job;
+
+    lu_event_current_worker_ = self;
+
+    for (;;) {
+        if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE))
+            break;
+        if ((job = lu_event_worker_find_(self)) != NULL) {
+            lu_event_work_run_(job);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        /* Publish that we are idle before the last look at nqueued, so a
+         * submitter either sees us idle or we see its job. */
+        __atomic_add_fetch(&pool->nidle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pool->nqueued, __ATOMIC_SEQ_CST) == 0)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        __atomic_sub_fetch(&pool->nidle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    lu_event_current_worker_ = NULL;
+    return NULL;
+}
+
+int lu_event_base_start_workers(lu_event_base_t *base, int nworkers)
+{
+    struct lu_event_workers_s *pool;
+    int i, err;
+
+    if (base->workers)
+        return (-1);
+
+    if (nworkers <= 0) {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+            nworkers = CPU_COUNT(&allowed);
+        else
+            nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nworkers <= 0)
+            nworkers = 1;
+    }
+
+    pool = mm_calloc(1, sizeof(struct lu_event_workers_s));
+    if (pool == NULL)
+        return (-1);
+    pool->workers = mm_calloc(nworkers, sizeof(lu_event_worker_t));
+    if (pool->workers == NULL) {
+        mm_free(pool);
+        return (-1);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    for (i = 0; i < nworkers; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init(&pool->workers[i].deque.lock, NULL);
+    }
+
+    base->workers = pool;
+    for (i = 0; i < nworkers; ++i) {
+        err = pthread_create(&pool->workers[i].thread, NULL,
+            lu_event_worker_thread_, &pool->workers[i]);
+        if (err != 0) {
+            lu_event_warnx("%s: pthread_create: %s", __func__, strerror(err));
+            lu_event_workers_free_(base);
+            return (-1);
+        }
+        pool->nworkers = i + 1;
+    }
+
+    return (0);
+}
+
+int lu_event_base_offload(lu_event_base_t *base, lu_event_work_fn work,
+    lu_event_work_done_fn done, void *arg)
+{
+    struct lu_event_workers_s *pool = base->workers;
+    lu_event_worker_t *target;
+    lu_event_work_t *job;
+
+    if (pool == NULL || pool->nworkers == 0 || work == NULL)
+        return (-1);
+
+    job = mm_calloc(1, sizeof(lu_event_work_t));
+    if (job == NULL)
+        return (-1);
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+    job->base = base;
+    job->cb.evcb_closure = LU_EV_CLOSURE_CB_SELF;
+    job->cb.evcb_cb_union.evcb_selfcb = lu_event_work_complete_;
+    job->cb.evcb_arg = job;
+    job->cb.evcb_pri = base->nactivequeues / 2;
+
+    if (lu_event_current_worker_ && lu_event_current_worker_->pool == pool)
+        target = lu_event_current_worker_;
+    else
+        target = &pool->workers[__atomic_fetch_add(&pool->next, 1,
+            __ATOMIC_RELAXED) % pool->nworkers];
+
+    LU_EVBASE_ACQUIRE_LOCK(base);
+    lu_event_base_add_virtual_(base);
+    LU_EVBASE_RELEASE_LOCK(base);
+
+    if (lu_event_work_deque_push_(&target->deque, job) < 0) {
+        LU_EVBASE_ACQUIRE_LOCK(base);
+        lu_event_base_del_virtual_(base);
+        LU_EVBASE_RELEASE_LOCK(base);
+        mm_free(job);
+        return (-1);
+    }
+
+    __atomic_add_fetch(&pool->nqueued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->nidle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return (0);
+}
+
+int lu_event_workers_owns_(const lu_event_callback_t *evcb)
+{
+    return evcb->evcb_closure == LU_EV_CLOSURE_CB_SELF &&
+        evcb->evcb_cb_union.evcb_selfcb == lu_event_work_complete_;
+}
+
+void lu_event_workers_discard_(lu_event_callback_t *evcb)
+{
+    mm_free(evcb->evcb_arg);
+}
+
+void lu_event_workers_free_(lu_event_base_t *base)
+{
+    struct lu_event_workers_s *pool = base->workers;
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* Workers finish their current job and exit; jobs still queued are
+     * dropped below.  Finished jobs whose completion has not run yet are
+     * freed by lu_event_base_free(), see lu_event_workers_owns_(). */
+    for (i = 0; i < pool->nworkers; ++i)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (i = 0; i < pool->nworkers; ++i) {
+        lu_event_work_deque_t *dq = &pool->workers[i].deque;
+        lu_event_work_t *job;
+        while ((job = lu_event_work_deque_pop_(dq)) != NULL)
+            mm_free(job);
+        if (dq->jobs)
+            mm_free(dq->jobs);
+        pthread_mutex_destroy(&dq->lock);
+    }
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    mm_free(pool->workers);
+    mm_free(pool);
+    base->workers = NULL;
+}
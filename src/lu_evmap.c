@@ -0,0 +1,591 @@
+/**
+ * @file lu_evmap.c
+ * @brief fd -> event mapping used by lu_event_add()/lu_event_del() and by
+ * the backends to turn readiness into active callbacks.
+ */
+#include "lu_evmap-internal.h"
+#include "lu_event.h"
+#include "lu_log-internal.h"
+#include "lu_memory_manager.h"
+
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+
+
+/** An entry for an lu_event_io_map_t.  Each entry holds a list of events
+ * that are waiting on a single fd, plus the number of events that want
+ * each kind of readiness: 16 bytes on LP64.  The backend's fdinfo
+ * (fdinfo_len bytes) is stored immediately after the struct, in the same
+ * slot. */
+typedef struct lu_evmap_io_s {
+    struct lu_event_dlist events;
+    lu_uint16_t nread;
+    lu_uint16_t nwrite;
+    lu_uint16_t nclose;
+} lu_evmap_io_t;
+
+/** An entry for an lu_event_signal_map_t.  Each entry holds the list of
+ * events that are waiting on one signal. */
+typedef struct lu_evmap_signal_s {
+    struct lu_event_dlist events;
+} lu_evmap_signal_t;
+
+
+#define LU_EVMAP_CACHELINE      64
+/** Smallest slot size of an io map. */
+#define LU_EVMAP_IO_MIN_ENTRY   16
+
+/** Return the slot for fd in an io map that has room for it. */
+#define LU_EVMAP_IO_SLOT_(map, fd) \
+    ((lu_evmap_io_t *)((char *)(map)->entries + (size_t)(fd) * (map)->entry_size))
+
+/** Expand 'map' with new entries of width 'msize' until it is big enough
+ * to store a value in 'slot'. */
+static int lu_evmap_make_space(lu_event_signal_map_t *map, int slot, int msize)
+{
+    if (map->nentries <= slot) {
+        int nentries = map->nentries ? map->nentries : 32;
+        void **tmp;
+
+        if (slot > INT_MAX / 2)
+            return (-1);
+
+        while (nentries <= slot)
+            nentries <<= 1;
+
+        if (nentries > INT_MAX / msize)
+            return (-1);
+
+        tmp = (void **)mm_realloc(map->entries, nentries * msize);
+        if (tmp == NULL)
+            return (-1);
+
+        memset(&tmp[map->nentries], 0,
+            (nentries - map->nentries) * msize);
+
+        map->nentries = nentries;
+        map->entries = tmp;
+    }
+
+    return (0);
+}
+
+/** Expand the io map until it has a slot for fd, doubling its size.
+ * Slots hold their list heads inline, so after the array moves the first
+ * event of each list must be pointed at the head's new address. */
+static int lu_evmap_io_make_space(lu_event_io_map_t *map, int fd,
+    size_t fdinfo_len)
+{
+    int nentries, i;
+    char *tmp;
+
+    if (map->nentries > fd)
+        return (0);
+
+    if (map->entry_size == 0) {
+        size_t need = sizeof(lu_evmap_io_t) + fdinfo_len;
+        int size = LU_EVMAP_IO_MIN_ENTRY;
+        while ((size_t)size < need)
+            size <<= 1;
+        map->entry_size = size;
+    }
+
+    nentries = map->nentries ? map->nentries : 32;
+    if (fd > INT_MAX / 2)
+        return (-1);
+    while (nentries <= fd)
+        nentries <<= 1;
+    if (nentries > INT_MAX / map->entry_size)
+        return (-1);
+
+    tmp = mm_memalign((size_t)nentries * map->entry_size, LU_EVMAP_CACHELINE);
+    if (tmp == NULL)
+        return (-1);
+
+    if (map->entries) {
+        memcpy(tmp, map->entries, (size_t)map->nentries * map->entry_size);
+        mm_free(map->entries);
+    }
+    memset(tmp + (size_t)map->nentries * map->entry_size, 0,
+        (size_t)(nentries - map->nentries) * map->entry_size);
+
+    map->entries = tmp;
+    for (i = 0; i < map->nentries; ++i) {
+        lu_evmap_io_t *ctx = LU_EVMAP_IO_SLOT_(map, i);
+        if (LIST_FIRST(&ctx->events) != NULL)
+            LIST_FIRST(&ctx->events)->ev_io_next.le_prev =
+                &LIST_FIRST(&ctx->events);
+    }
+    map->nentries = nentries;
+
+    return (0);
+}
+
+void lu_evmap_io_initmap_(lu_event_io_map_t *ctx)
+{
+    ctx->nentries = 0;
+    ctx->entries = NULL;
+    ctx->entry_size = 0;
+}
+
+void lu_evmap_io_clear_(lu_event_io_map_t *ctx)
+{
+    if (ctx->entries)
+        mm_free(ctx->entries);
+    ctx->entries = NULL;
+    ctx->nentries = 0;
+}
+
+/** Return the slot for fd, or NULL if fd is beyond the end of the map.
+ * A slot nothing was ever added to has an empty list and zero counts. */
+static inline lu_evmap_io_t *lu_evmap_io_get_(lu_event_io_map_t *map, lu_evutil_socket_t fd)
+{
+    if (fd < 0 || fd >= map->nentries)
+        return NULL;
+    return LU_EVMAP_IO_SLOT_(map, fd);
+}
+
+/** Return the slot for fd, growing the map if needed. */
+static lu_evmap_io_t *lu_evmap_io_get_or_alloc_(lu_event_io_map_t *map,
+    lu_evutil_socket_t fd, size_t fdinfo_len)
+{
+    if (lu_evmap_io_make_space(map, fd, fdinfo_len) == -1)
+        return NULL;
+    return LU_EVMAP_IO_SLOT_(map, fd);
+}
+
+int lu_evmap_io_add_(lu_event_base_t *base, lu_evutil_socket_t fd, lu_event_t *ev)
+{
+    const lu_event_op_t *evsel = base->evsel_op;
+    lu_event_io_map_t *io = &base->io;
+    lu_evmap_io_t *ctx = NULL;
+    int nread, nwrite, nclose, retval = 0;
+    short res = 0, old = 0;
+
+    if (fd < 0)
+        return 0;
+
+    ctx = lu_evmap_io_get_or_alloc_(io, fd, evsel->fdinfo_len);
+    if (ctx == NULL)
+        return (-1);
+
+    nread = ctx->nread;
+    nwrite = ctx->nwrite;
+    nclose = ctx->nclose;
+
+    if (nread)
+        old |= LU_EV_READ;
+    if (nwrite)
+        old |= LU_EV_WRITE;
+    if (nclose)
+        old |= LU_EV_CLOSED;
+
+    if (ev->ev_events & LU_EV_READ) {
+        if (++nread == 1)
+            res |= LU_EV_READ;
+    }
+    if (ev->ev_events & LU_EV_WRITE) {
+        if (++nwrite == 1)
+            res |= LU_EV_WRITE;
+    }
+    if (ev->ev_events & LU_EV_CLOSED) {
+        if (++nclose == 1)
+            res |= LU_EV_CLOSED;
+    }
+    if (nread > 0xffff || nwrite > 0xffff || nclose > 0xffff) {
+        lu_event_warnx("Too many events reading or writing on fd %d",
+            (int)fd);
+        return -1;
+    }
+    /* The backend registers the fd as a whole, so one edge-triggered (or
+     * exclusive) event would turn every other event on the fd into one. */
+    if (!LIST_EMPTY(&ctx->events) &&
+        ((LIST_FIRST(&ctx->events)->ev_events ^ ev->ev_events) &
+        (LU_EV_ET|LU_EV_EXCLUSIVE))) {
+        lu_event_warnx("Tried to mix edge-triggered or exclusive events with"
+            " other events on fd %d", (int)fd);
+        return -1;
+    }
+
+    /* Busy-polling bases ask the kernel to busy-poll the sockets they
+     * start reading too; not every fd is a socket, so failure is fine. */
+    if ((res & LU_EV_READ) && base->busy_poll_sock_usec > 0 &&
+        lu_evutil_make_socket_busy_poll(fd, base->busy_poll_sock_usec) < 0)
+        event_debug(("%s: SO_BUSY_POLL on fd %d: %s", __func__, (int)fd,
+            strerror(errno)));
+
+    if (res) {
+        void *extra = ((char *)ctx) + sizeof(lu_evmap_io_t);
+        if (evsel->add(base, ev->ev_fd, old,
+            (ev->ev_events & (LU_EV_ET|LU_EV_EXCLUSIVE)) | res, extra) == -1)
+            return (-1);
+
+        retval = 1;
+    }
+
+    ctx->nread = (lu_uint16_t)nread;
+    ctx->nwrite = (lu_uint16_t)nwrite;
+    ctx->nclose = (lu_uint16_t)nclose;
+    LIST_INSERT_HEAD(&ctx->events, ev, ev_io_next);
+
+    return (retval);
+}
+
+int lu_evmap_io_del_(lu_event_base_t *base, lu_evutil_socket_t fd, lu_event_t *ev)
+{
+    const lu_event_op_t *evsel = base->evsel_op;
+    lu_event_io_map_t *io = &base->io;
+    lu_evmap_io_t *ctx;
+    int nread, nwrite, nclose, retval = 0;
+    short res = 0, old = 0;
+
+    if (fd < 0)
+        return 0;
+
+    ctx = lu_evmap_io_get_(io, fd);
+    if (ctx == NULL)
+        return (-1);
+
+    nread = ctx->nread;
+    nwrite = ctx->nwrite;
+    nclose = ctx->nclose;
+
+    if (nread)
+        old |= LU_EV_READ;
+    if (nwrite)
+        old |= LU_EV_WRITE;
+    if (nclose)
+        old |= LU_EV_CLOSED;
+
+    if (ev->ev_events & LU_EV_READ) {
+        if (--nread == 0)
+            res |= LU_EV_READ;
+    }
+    if (ev->ev_events & LU_EV_WRITE) {
+        if (--nwrite == 0)
+            res |= LU_EV_WRITE;
+    }
+    if (ev->ev_events & LU_EV_CLOSED) {
+        if (--nclose == 0)
+            res |= LU_EV_CLOSED;
+    }
+
+    if (res) {
+        void *extra = ((char *)ctx) + sizeof(lu_evmap_io_t);
+        if (evsel->del(base, ev->ev_fd, old,
+            (ev->ev_events & (LU_EV_ET|LU_EV_EXCLUSIVE)) | res, extra) == -1) {
+            retval = -1;
+        } else {
+            retval = 1;
+        }
+    }
+
+    ctx->nread = (lu_uint16_t)nread;
+    ctx->nwrite = (lu_uint16_t)nwrite;
+    ctx->nclose = (lu_uint16_t)nclose;
+    LIST_REMOVE(ev, ev_io_next);
+
+    return (retval);
+}
+
+void lu_evmap_io_active_(lu_event_base_t *base, lu_evutil_socket_t fd, short events)
+{
+    lu_evmap_io_t *ctx;
+    lu_event_t *ev;
+
+    ctx = lu_evmap_io_get_(&base->io, fd);
+    if (ctx == NULL)
+        return;
+
+    LIST_FOREACH(ev, &ctx->events, ev_io_next) {
+        if (ev->ev_events & events)
+            lu_event_active_nolock_(ev, ev->ev_events & events, 1);
+    }
+}
+
+int lu_evmap_io_reinit_(lu_event_base_t *base)
+{
+    const lu_event_op_t *evsel = base->evsel_op;
+    lu_event_io_map_t *io = &base->io;
+    lu_evutil_socket_t fd;
+    int result = 0;
+
+    for (fd = 0; fd < io->nentries; ++fd) {
+        lu_evmap_io_t *ctx = LU_EVMAP_IO_SLOT_(io, fd);
+        void *extra = ((char *)ctx) + sizeof(lu_evmap_io_t);
+        short events = 0;
+
+        /* The fdinfo described the old backend's state (e.g. a changelist
+         * index); start from scratch. */
+        if (evsel->fdinfo_len)
+            memset(extra, 0, evsel->fdinfo_len);
+
+        if (ctx->nread)
+            events |= LU_EV_READ;
+        if (ctx->nwrite)
+            events |= LU_EV_WRITE;
+        if (ctx->nclose)
+            events |= LU_EV_CLOSED;
+        if (events == 0)
+            continue;
+        events |= LIST_FIRST(&ctx->events)->ev_events & (LU_EV_ET|LU_EV_EXCLUSIVE);
+
+        if (evsel->add(base, fd, 0, events, extra) == -1)
+            result = -1;
+    }
+
+    return (result);
+}
+
+void lu_evmap_signal_initmap_(lu_event_signal_map_t *ctx)
+{
+    ctx->nentries = 0;
+    ctx->entries = NULL;
+}
+
+void lu_evmap_signal_clear_(lu_event_signal_map_t *ctx)
+{
+    int i;
+    for (i = 0; i < ctx->nentries; ++i) {
+        if (ctx->entries[i] != NULL)
+            mm_free(ctx->entries[i]);
+    }
+    if (ctx->entries)
+        mm_free(ctx->entries);
+    ctx->entries = NULL;
+    ctx->nentries = 0;
+}
+
+int lu_evmap_signal_add_(lu_event_base_t *base, int sig, lu_event_t *ev)
+{
+    const lu_event_op_t *evsel = base->evsigsel_op;
+    lu_event_signal_map_t *map = &base->signal;
+    lu_evmap_signal_t *ctx = NULL;
+
+    if (sig < 0 || sig >= NSIG)
+        return (-1);
+
+    if (lu_evmap_make_space(map, sig,
+        sizeof(lu_evmap_signal_t *)) == -1)
+        return (-1);
+
+    ctx = (lu_evmap_signal_t *)map->entries[sig];
+    if (ctx == NULL) {
+        ctx = mm_calloc(1, sizeof(lu_evmap_signal_t));
+        if (ctx == NULL)
+            return (-1);
+        LIST_INIT(&ctx->events);
+        map->entries[sig] = ctx;
+    }
+
+    if (LIST_EMPTY(&ctx->events)) {
+        if (evsel == NULL ||
+            evsel->add(base, ev->ev_fd, 0, LU_EV_SIGNAL, NULL) == -1)
+            return (-1);
+    }
+
+    LIST_INSERT_HEAD(&ctx->events, ev, ev_signal_next);
+
+    return (1);
+}
+
+int lu_evmap_signal_del_(lu_event_base_t *base, int sig, lu_event_t *ev)
+{
+    const lu_event_op_t *evsel = base->evsigsel_op;
+    lu_event_signal_map_t *map = &base->signal;
+    lu_evmap_signal_t *ctx;
+
+    if (sig < 0 || sig >= map->nentries)
+        return (-1);
+
+    ctx = (lu_evmap_signal_t *)map->entries[sig];
+    if (ctx == NULL)
+        return (-1);
+
+    LIST_REMOVE(ev, ev_signal_next);
+
+    if (LIST_FIRST(&ctx->events) == NULL) {
+        if (evsel->del(base, ev->ev_fd, 0, LU_EV_SIGNAL, NULL) == -1)
+            return (-1);
+    }
+
+    return (1);
+}
+
+void lu_evmap_signal_active_(lu_event_base_t *base, lu_evutil_socket_t sig, int ncalls)
+{
+    lu_event_signal_map_t *map = &base->signal;
+    lu_evmap_signal_t *ctx;
+    lu_event_t *ev;
+
+    if (sig < 0 || sig >= map->nentries)
+        return;
+    ctx = (lu_evmap_signal_t *)map->entries[sig];
+    if (ctx == NULL)
+        return;
+
+    LIST_FOREACH(ev, &ctx->events, ev_signal_next)
+        lu_event_active_nolock_(ev, LU_EV_SIGNAL, ncalls);
+}
+
+/* Code specific to changelists, used by backends that let the evmap queue
+ * their add/del calls and apply them all at once before waiting.  Each io
+ * map slot's fdinfo holds the index of that fd's change, so that repeated
+ * add/del calls on one fd between dispatches update a single entry. */
+
+void lu_event_changelist_init_(lu_event_changelist_t *changelist)
+{
+    changelist->changes = NULL;
+    changelist->changes_size = 0;
+    changelist->n_changes = 0;
+}
+
+/** Helper: return the changelist_fdinfo corresponding to a given change. */
+static inline lu_event_changelist_fdinfo_t *lu_event_change_get_fdinfo(
+    lu_event_base_t *base, const lu_event_change_t *change)
+{
+    lu_evmap_io_t *ctx = LU_EVMAP_IO_SLOT_(&base->io, change->fd);
+    return (lu_event_changelist_fdinfo_t *)(((char *)ctx) + sizeof(lu_evmap_io_t));
+}
+
+void lu_event_changelist_remove_all_(lu_event_changelist_t *changelist,
+    lu_event_base_t *base)
+{
+    int i;
+
+    for (i = 0; i < changelist->n_changes; ++i) {
+        lu_event_change_t *ch = &changelist->changes[i];
+        lu_event_changelist_fdinfo_t *fdinfo = lu_event_change_get_fdinfo(base, ch);
+        fdinfo->idxplus1 = 0;
+    }
+
+    changelist->n_changes = 0;
+}
+
+void lu_event_changelist_freemem_(lu_event_changelist_t *changelist)
+{
+    if (changelist->changes)
+        mm_free(changelist->changes);
+    lu_event_changelist_init_(changelist); /* zero it all out. */
+}
+
+/** Increase the size of 'changelist' to hold more changes. */
+static int lu_event_changelist_grow(lu_event_changelist_t *changelist)
+{
+    int new_size;
+    lu_event_change_t *new_changes;
+
+    if (changelist->changes_size < 64)
+        new_size = 64;
+    else
+        new_size = changelist->changes_size * 2;
+
+    new_changes = mm_realloc(changelist->changes,
+        new_size * sizeof(lu_event_change_t));
+    if (new_changes == NULL)
+        return (-1);
+
+    changelist->changes = new_changes;
+    changelist->changes_size = new_size;
+
+    return (0);
+}
+
+/** Return a pointer to the changelist entry for the file descriptor or
+ * signal 'fd', whose fdinfo is 'fdinfo'.  If none exists, construct it,
+ * setting its old_events field to old_events. */
+static lu_event_change_t *lu_event_changelist_get_or_construct(
+    lu_event_changelist_t *changelist, lu_evutil_socket_t fd,
+    short old_events, lu_event_changelist_fdinfo_t *fdinfo)
+{
+    lu_event_change_t *change;
+
+    if (fdinfo->idxplus1 == 0) {
+        int idx;
+
+        if (changelist->n_changes == changelist->changes_size) {
+            if (lu_event_changelist_grow(changelist) < 0)
+                return NULL;
+        }
+
+        idx = changelist->n_changes++;
+        change = &changelist->changes[idx];
+        fdinfo->idxplus1 = idx + 1;
+
+        memset(change, 0, sizeof(lu_event_change_t));
+        change->fd = fd;
+        change->old_events = old_events;
+    } else {
+        change = &changelist->changes[fdinfo->idxplus1 - 1];
+    }
+    return change;
+}
+
+int lu_event_changelist_add_(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p)
+{
+    lu_event_changelist_t *changelist = &base->changelist;
+    lu_event_changelist_fdinfo_t *fdinfo = p;
+    lu_event_change_t *change;
+    lu_uint8_t evchange = LU_EV_CHANGE_ADD |
+        (events & (LU_EV_ET|LU_EV_EXCLUSIVE|LU_EV_PERSIST|LU_EV_SIGNAL));
+
+    change = lu_event_changelist_get_or_construct(changelist, fd, old, fdinfo);
+    if (!change)
+        return -1;
+
+    /* An add replaces any previous delete, but doesn't result in a no-op,
+     * since the delete might fail (because the fd had been closed since
+     * the last add, for instance. */
+
+    if (events & (LU_EV_READ|LU_EV_SIGNAL))
+        change->read_change = evchange;
+    if (events & LU_EV_WRITE)
+        change->write_change = evchange;
+    if (events & LU_EV_CLOSED)
+        change->error_change = evchange;
+
+    return (0);
+}
+
+int lu_event_changelist_del_(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p)
+{
+    lu_event_changelist_t *changelist = &base->changelist;
+    lu_event_changelist_fdinfo_t *fdinfo = p;
+    lu_event_change_t *change;
+    lu_uint8_t del = LU_EV_CHANGE_DEL | (events & (LU_EV_ET|LU_EV_EXCLUSIVE));
+
+    change = lu_event_changelist_get_or_construct(changelist, fd, old, fdinfo);
+    if (!change)
+        return -1;
+
+    /* A delete on an event set that doesn't contain the event to be
+     * deleted produces a no-op.  This effectively removes any previous
+     * uncommitted add, rather than replacing it: "add, delete, dispatch"
+     * must behave like "no-op, dispatch".
+     *
+     * The no-op entry stays in the array: skipping it when the changes are
+     * applied is far cheaper than rejuggling the array now. */
+    if (events & (LU_EV_READ|LU_EV_SIGNAL)) {
+        if (!(change->old_events & (LU_EV_READ | LU_EV_SIGNAL)))
+            change->read_change = 0;
+        else
+            change->read_change = del;
+    }
+    if (events & LU_EV_WRITE) {
+        if (!(change->old_events & LU_EV_WRITE))
+            change->write_change = 0;
+        else
+            change->write_change = del;
+    }
+    if (events & LU_EV_CLOSED) {
+        if (!(change->old_events & LU_EV_CLOSED))
+            change->error_change = 0;
+        else
+            change->error_change = del;
+    }
+
+    return (0);
+}
@@ -0,0 +1,522 @@
+/**
+ * @file lu_io_uring.c
+ * @brief io_uring(7) backend for lu_event_base_t.
+ *
+ * Interest changes are not applied with one syscall each: add/del only
+ * record the wanted mask for the fd, and dispatch turns every pending
+ * change into POLL_ADD / POLL_REMOVE SQEs that are submitted together with
+ * the wait in a single io_uring_enter().  Completions are then reaped from
+ * the CQ ring in bulk.
+ *
+ * Level-triggered events are armed as one-shot polls and re-armed in the
+ * next batch, because multishot poll only reports new wakeups.  Events
+ * registered with LU_EV_ET use multishot polls, which stay armed in the
+ * kernel until they are removed.
+ *
+ * The ring is driven with raw syscalls so there is no dependency on
+ * liburing.  Kernels without IORING_FEAT_EXT_ARG (< 5.11) are not used.
+ */
+#include "lu_event-internal.h"
+#include "lu_event.h"
+#include "lu_evmap-internal.h"
+#include "lu_log-internal.h"
+#include "lu_memory_manager.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#ifndef POLLRDHUP
+#define POLLRDHUP 0x2000
+#endif
+
+/* Number of SQ entries requested at setup; the CQ gets twice as many. */
+#define LU_IO_URING_ENTRIES         256
+/* user_data used for POLL_REMOVE requests whose completion we ignore. */
+#define LU_IO_URING_UDATA_IGNORE    (~(lu_uint64_t)0)
+
+#define LU_IO_URING_UDATA(fd, gen)  (((lu_uint64_t)(gen) << 32) | (lu_uint32_t)(fd))
+#define LU_IO_URING_UDATA_FD(u)     ((int)(lu_uint32_t)(u))
+#define LU_IO_URING_UDATA_GEN(u)    ((lu_uint32_t)((u) >> 32))
+
+
+/** Per-fd poll state, indexed by fd. */
+typedef struct lu_io_uring_fd_s {
+    /* Generation of the currently armed poll; stale completions from
+     * removed polls carry an older generation and are dropped. */
+    lu_uint32_t gen;
+    /* LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED|LU_EV_ET wanted by the evmap. */
+    short want;
+    /* The mask armed in the kernel, or 0 if no poll is outstanding. */
+    short armed;
+    /* Set while the fd is on the pending list. */
+    int dirty;
+} lu_io_uring_fd_t;
+
+typedef struct lu_io_uring_op_s {
+    int ring_fd;
+
+    /* Submission queue ring. */
+    void *sq_ring_ptr;
+    size_t sq_ring_sz;
+    unsigned *sq_khead;
+    unsigned *sq_ktail;
+    unsigned *sq_kring_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+    unsigned sq_entries;
+    /* Our copy of the tail; published to the kernel before each enter. */
+    unsigned sq_tail;
+
+    /* Completion queue ring. */
+    void *cq_ring_ptr;
+    size_t cq_ring_sz;
+    unsigned *cq_khead;
+    unsigned *cq_ktail;
+    unsigned *cq_kring_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Per-fd state, indexed by fd. */
+    lu_io_uring_fd_t *fds;
+    int nfds;
+
+    /* fds whose wanted mask changed since the last dispatch. */
+    int *pending;
+    int npending;
+    int pending_size;
+} lu_io_uring_op_t;
+
+
+static void *lu_io_uring_init(lu_event_base_t *base);
+static int   lu_io_uring_add(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p);
+static int   lu_io_uring_del(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p);
+static int   lu_io_uring_dispatch(lu_event_base_t *base, struct timeval *tv);
+static void  lu_io_uring_dealloc(lu_event_base_t *base);
+
+const lu_event_op_t lu_io_uringops = {
+    "io_uring",
+    lu_io_uring_init,
+    lu_io_uring_add,
+    lu_io_uring_del,
+    lu_io_uring_dispatch,
+    lu_io_uring_dealloc,
+    1, /* need reinit */
+    LU_EVENT_FEATURE_ET|LU_EVENT_FEATURE_O1|LU_EVENT_FEATURE_EARLY_CLOSE,
+    0
+};
+
+
+static int lu_sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int lu_sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+        flags, arg, argsz);
+}
+
+static void lu_io_uring_unmap(lu_io_uring_op_t *uop)
+{
+    if (uop->sqes)
+        munmap(uop->sqes, uop->sqes_sz);
+    if (uop->cq_ring_ptr && uop->cq_ring_ptr != uop->sq_ring_ptr)
+        munmap(uop->cq_ring_ptr, uop->cq_ring_sz);
+    if (uop->sq_ring_ptr)
+        munmap(uop->sq_ring_ptr, uop->sq_ring_sz);
+    uop->sqes = NULL;
+    uop->cq_ring_ptr = uop->sq_ring_ptr = NULL;
+}
+
+static int lu_io_uring_setup_ring(lu_io_uring_op_t *uop)
+{
+    struct io_uring_params p;
+    unsigned i;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+
+    uop->ring_fd = lu_sys_io_uring_setup(LU_IO_URING_ENTRIES, &p);
+    if (uop->ring_fd < 0) {
+        if (errno != ENOSYS && errno != EPERM)
+            lu_event_warn("io_uring_setup");
+        return -1;
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        event_debug(("%s: kernel lacks IORING_FEAT_EXT_ARG", __func__));
+        goto err;
+    }
+
+    uop->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    uop->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uop->cq_ring_sz > uop->sq_ring_sz)
+            uop->sq_ring_sz = uop->cq_ring_sz;
+        uop->cq_ring_sz = uop->sq_ring_sz;
+    }
+
+    uop->sq_ring_ptr = mmap(NULL, uop->sq_ring_sz, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, uop->ring_fd, IORING_OFF_SQ_RING);
+    if (uop->sq_ring_ptr == MAP_FAILED) {
+        uop->sq_ring_ptr = NULL;
+        goto err;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        uop->cq_ring_ptr = uop->sq_ring_ptr;
+    } else {
+        uop->cq_ring_ptr = mmap(NULL, uop->cq_ring_sz, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, uop->ring_fd, IORING_OFF_CQ_RING);
+        if (uop->cq_ring_ptr == MAP_FAILED) {
+            uop->cq_ring_ptr = NULL;
+            goto err;
+        }
+    }
+
+    uop->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    uop->sqes = mmap(NULL, uop->sqes_sz, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, uop->ring_fd, IORING_OFF_SQES);
+    if (uop->sqes == MAP_FAILED) {
+        uop->sqes = NULL;
+        goto err;
+    }
+
+    sq = uop->sq_ring_ptr;
+    uop->sq_khead = (unsigned *)(sq + p.sq_off.head);
+    uop->sq_ktail = (unsigned *)(sq + p.sq_off.tail);
+    uop->sq_kring_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    uop->sq_array = (unsigned *)(sq + p.sq_off.array);
+    uop->sq_entries = p.sq_entries;
+    uop->sq_tail = *uop->sq_ktail;
+
+    /* SQE slot i is always published through array index i, so the
+     * indirection array can be filled once. */
+    for (i = 0; i < p.sq_entries; ++i)
+        uop->sq_array[i] = i;
+
+    cq = uop->cq_ring_ptr;
+    uop->cq_khead = (unsigned *)(cq + p.cq_off.head);
+    uop->cq_ktail = (unsigned *)(cq + p.cq_off.tail);
+    uop->cq_kring_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    uop->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+
+err:
+    lu_io_uring_unmap(uop);
+    close(uop->ring_fd);
+    uop->ring_fd = -1;
+    return -1;
+}
+
+static void *lu_io_uring_init(lu_event_base_t *base)
+{
+    lu_io_uring_op_t *uop;
+
+    (void)base;
+
+    if (!(uop = mm_calloc(1, sizeof(lu_io_uring_op_t))))
+        return (NULL);
+
+    if (lu_io_uring_setup_ring(uop) < 0) {
+        mm_free(uop);
+        return (NULL);
+    }
+
+    return (uop);
+}
+
+/** Publish every queued SQE to the kernel and return how many the kernel
+ * has not consumed yet. */
+static unsigned lu_io_uring_publish(lu_io_uring_op_t *uop)
+{
+    __atomic_store_n(uop->sq_ktail, uop->sq_tail, __ATOMIC_RELEASE);
+    return uop->sq_tail - __atomic_load_n(uop->sq_khead, __ATOMIC_ACQUIRE);
+}
+
+/** Return a zeroed SQE, submitting the queued ones first if the SQ ring is
+ * full.  Returns NULL if no SQE could be made available. */
+static struct io_uring_sqe *lu_io_uring_get_sqe(lu_io_uring_op_t *uop)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(uop->sq_khead, __ATOMIC_ACQUIRE);
+
+    if (uop->sq_tail - head >= uop->sq_entries) {
+        unsigned to_submit = lu_io_uring_publish(uop);
+        if (lu_sys_io_uring_enter(uop->ring_fd, to_submit, 0, 0, NULL, 0) < 0) {
+            lu_event_warn("io_uring_enter");
+            return NULL;
+        }
+        head = __atomic_load_n(uop->sq_khead, __ATOMIC_ACQUIRE);
+        if (uop->sq_tail - head >= uop->sq_entries)
+            return NULL;
+    }
+
+    sqe = &uop->sqes[uop->sq_tail & *uop->sq_kring_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    uop->sq_tail++;
+    return sqe;
+}
+
+static int lu_io_uring_make_space(lu_io_uring_op_t *uop, int fd)
+{
+    int nfds;
+    lu_io_uring_fd_t *tmp;
+
+    if (fd < uop->nfds)
+        return 0;
+
+    nfds = uop->nfds ? uop->nfds : 32;
+    while (nfds <= fd)
+        nfds <<= 1;
+
+    tmp = mm_realloc(uop->fds, nfds * sizeof(lu_io_uring_fd_t));
+    if (tmp == NULL)
+        return -1;
+    memset(&tmp[uop->nfds], 0, (nfds - uop->nfds) * sizeof(lu_io_uring_fd_t));
+    uop->fds = tmp;
+    uop->nfds = nfds;
+    return 0;
+}
+
+/** Remember that fd needs its poll (re)armed in the next batch. */
+static int lu_io_uring_mark_pending(lu_io_uring_op_t *uop, int fd)
+{
+    lu_io_uring_fd_t *st = &uop->fds[fd];
+
+    if (st->dirty)
+        return 0;
+
+    if (uop->npending == uop->pending_size) {
+        int new_size = uop->pending_size ? uop->pending_size * 2 : 64;
+        int *tmp = mm_realloc(uop->pending, new_size * sizeof(int));
+        if (tmp == NULL)
+            return -1;
+        uop->pending = tmp;
+        uop->pending_size = new_size;
+    }
+    uop->pending[uop->npending++] = fd;
+    st->dirty = 1;
+    return 0;
+}
+
+static int lu_io_uring_add(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p)
+{
+    lu_io_uring_op_t *uop = base->evbase;
+
+    (void)p;
+
+    if (lu_io_uring_make_space(uop, fd) < 0)
+        return -1;
+
+    uop->fds[fd].want = (old | events) & (LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED|LU_EV_ET);
+    return lu_io_uring_mark_pending(uop, fd);
+}
+
+static int lu_io_uring_del(lu_event_base_t *base, lu_evutil_socket_t fd,
+    short old, short events, void *p)
+{
+    lu_io_uring_op_t *uop = base->evbase;
+    short want;
+
+    (void)p;
+
+    if (fd >= uop->nfds)
+        return 0;
+
+    want = old & ~events & (LU_EV_READ|LU_EV_WRITE|LU_EV_CLOSED);
+    if (want)
+        want |= uop->fds[fd].want & LU_EV_ET;
+    uop->fds[fd].want = want;
+    return lu_io_uring_mark_pending(uop, fd);
+}
+
+static unsigned lu_io_uring_events_to_poll(short events)
+{
+    unsigned mask = 0;
+    if (events & LU_EV_READ)
+        mask |= POLLIN;
+    if (events & LU_EV_WRITE)
+        mask |= POLLOUT;
+    if (events & LU_EV_CLOSED)
+        mask |= POLLRDHUP;
+    return mask;
+}
+
+/** Turn every pending interest change into SQEs. */
+static int lu_io_uring_queue_changes(lu_io_uring_op_t *uop)
+{
+    int i;
+
+    for (i = 0; i < uop->npending; ++i) {
+        int fd = uop->pending[i];
+        lu_io_uring_fd_t *st = &uop->fds[fd];
+        struct io_uring_sqe *sqe;
+
+        st->dirty = 0;
+
+        if (st->armed && st->armed != st->want) {
+            if ((sqe = lu_io_uring_get_sqe(uop)) == NULL)
+                goto err;
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = LU_IO_URING_UDATA(fd, st->gen);
+            sqe->user_data = LU_IO_URING_UDATA_IGNORE;
+            st->armed = 0;
+            st->gen++;
+        }
+
+        if (!st->armed && st->want) {
+            if ((sqe = lu_io_uring_get_sqe(uop)) == NULL)
+                goto err;
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = lu_io_uring_events_to_poll(st->want);
+            if (st->want & LU_EV_ET)
+                sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->user_data = LU_IO_URING_UDATA(fd, st->gen);
+            st->armed = st->want;
+        }
+    }
+    uop->npending = 0;
+    return 0;
+
+err:
+    /* Keep whatever was not queued for the next attempt. */
+    memmove(uop->pending, uop->pending + i, (uop->npending - i) * sizeof(int));
+    uop->npending -= i;
+    uop->fds[uop->pending[0]].dirty = 1;
+    return -1;
+}
+
+/** Handle one completion.  Errors are per-fd and only logged. */
+static void lu_io_uring_handle_cqe(lu_event_base_t *base, lu_io_uring_op_t *uop,
+    const struct io_uring_cqe *cqe)
+{
+    lu_io_uring_fd_t *st;
+    int fd;
+    short ev = 0;
+
+    if (cqe->user_data == LU_IO_URING_UDATA_IGNORE)
+        return;
+
+    fd = LU_IO_URING_UDATA_FD(cqe->user_data);
+    if (fd < 0 || fd >= uop->nfds)
+        return;
+    st = &uop->fds[fd];
+    if (st->gen != LU_IO_URING_UDATA_GEN(cqe->user_data) || !st->armed)
+        return;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        /* The poll is finished; re-arm it in the next batch if anyone
+         * still wants events on this fd. */
+        st->armed = 0;
+        if (st->want && cqe->res >= 0)
+            lu_io_uring_mark_pending(uop, fd);
+    }
+
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED)
+            lu_event_warnx("%s: poll on fd %d failed: %s", __func__, fd,
+                strerror(-cqe->res));
+        return;
+    }
+
+    if (cqe->res & POLLERR) {
+        ev = LU_EV_READ | LU_EV_WRITE;
+    } else if ((cqe->res & POLLHUP) && !(cqe->res & POLLRDHUP)) {
+        ev = LU_EV_READ | LU_EV_WRITE;
+    } else {
+        if (cqe->res & POLLIN)
+            ev |= LU_EV_READ;
+        if (cqe->res & POLLOUT)
+            ev |= LU_EV_WRITE;
+        if (cqe->res & POLLRDHUP)
+            ev |= LU_EV_CLOSED;
+    }
+
+    if (ev)
+        lu_evmap_io_active_(base, fd, ev);
+}
+
+static int lu_io_uring_dispatch(lu_event_base_t *base, struct timeval *tv)
+{
+    lu_io_uring_op_t *uop = base->evbase;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail, mask, to_submit, min_complete = 1;
+    int res, nreaped = 0;
+
+    if (lu_io_uring_queue_changes(uop) < 0)
+        return -1;
+
+    memset(&arg, 0, sizeof(arg));
+    if (tv != NULL) {
+        ts.tv_sec = tv->tv_sec;
+        ts.tv_nsec = tv->tv_usec * 1000;
+        if (!lu_evutil_timerisset(tv))
+            min_complete = 0;
+        else
+            arg.ts = (lu_uint64_t)(lu_uintptr_t)&ts;
+    }
+
+    /* One syscall both submits the batch and waits for completions. */
+    to_submit = lu_io_uring_publish(uop);
+
+    /* Other threads only touch the pending list, never the rings, so the
+     * lock can be dropped for the wait. */
+    LU_EVBASE_RELEASE_LOCK(base);
+
+    res = lu_sys_io_uring_enter(uop->ring_fd, to_submit, min_complete,
+        IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+    LU_EVBASE_ACQUIRE_LOCK(base);
+
+    if (res < 0 && errno != ETIME && errno != EINTR) {
+        lu_event_warn("io_uring_enter");
+        return (-1);
+    }
+
+    /* Reap everything that is in the CQ ring in one pass. */
+    head = *uop->cq_khead;
+    tail = __atomic_load_n(uop->cq_ktail, __ATOMIC_ACQUIRE);
+    mask = *uop->cq_kring_mask;
+    for (; head != tail; ++head, ++nreaped)
+        lu_io_uring_handle_cqe(base, uop, &uop->cqes[head & mask]);
+    __atomic_store_n(uop->cq_khead, head, __ATOMIC_RELEASE);
+
+    event_debug(("%s: io_uring_enter submitted %u, reaped %d", __func__,
+        to_submit, nreaped));
+
+    return (0);
+}
+
+static void lu_io_uring_dealloc(lu_event_base_t *base)
+{
+    lu_io_uring_op_t *uop = base->evbase;
+
+    lu_io_uring_unmap(uop);
+    if (uop->ring_fd >= 0)
+        close(uop->ring_fd);
+    if (uop->fds)
+        mm_free(uop->fds);
+    if (uop->pending)
+        mm_free(uop->pending);
+
+    memset(uop, 0, sizeof(lu_io_uring_op_t));
+    mm_free(uop);
+}
@@ -0,0 +1,364 @@
+/**
+ * @file lu_signal.c
+ * @brief sigaction()-based signal backend.
+ *
+ * Signal handlers are called asynchronously and can only do very little,
+ * so the handler just writes the signal number to a self-pipe.  The read
+ * end is watched by an internal event of the main backend; its callback
+ * counts the signals that arrived and activates their events.
+ *
+ * Only one base at a time can have signal handlers installed; adding a
+ * signal to a second base moves the handlers to it.
+ */
+#include "lu_evsignal-internal.h"
+#include "lu_evmap-internal.h"
+#include "lu_event.h"
+#include "lu_log-internal.h"
+#include "lu_memory_manager.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static int  lu_evsig_add(lu_event_base_t *base, lu_evutil_socket_t evsignal,
+    short old, short events, void *p);
+static int  lu_evsig_del(lu_event_base_t *base, lu_evutil_socket_t evsignal,
+    short old, short events, void *p);
+static void lu_evsig_dealloc(lu_event_base_t *base);
+
+const lu_event_op_t lu_evsigops = {
+    "signal",
+    NULL,
+    lu_evsig_add,
+    lu_evsig_del,
+    NULL,
+    lu_evsig_dealloc,
+    0, 0, 0
+};
+
+/* The base that currently owns the signal handlers, and the write end of
+ * its self-pipe.  Read from the signal handler. */
+static lu_event_base_t *lu_evsig_base = NULL;
+static volatile sig_atomic_t lu_evsig_base_fd = -1;
+/* Number of signals lu_evsig_base has added. */
+static int lu_evsig_base_n_signals_added = 0;
+static pthread_mutex_t lu_evsig_base_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lu_evsig_handler(int sig);
+
+
+/* Callback for when the signal handler writes a value to our pipe. */
+static void lu_evsig_cb(lu_evutil_socket_t fd, short what, void *arg)
+{
+    char signals[1024];
+    ssize_t n;
+    int i;
+    int ncaught[NSIG];
+    lu_event_base_t *base = arg;
+
+    (void)what;
+
+    memset(&ncaught, 0, sizeof(ncaught));
+
+    while (1) {
+        n = read(fd, signals, sizeof(signals));
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                lu_event_warn("%s: read", __func__);
+            break;
+        } else if (n == 0) {
+            /* XXX warn? */
+            break;
+        }
+        for (i = 0; i < n; ++i) {
+            lu_uint8_t sig = signals[i];
+            if (sig < NSIG)
+                ncaught[sig]++;
+        }
+    }
+
+    LU_EVBASE_ACQUIRE_LOCK(base);
+    for (i = 0; i < NSIG; ++i) {
+        if (ncaught[i])
+            lu_evmap_signal_active_(base, i, ncaught[i]);
+    }
+    LU_EVBASE_RELEASE_LOCK(base);
+}
+
+/* Open the self-pipe and set up the internal event that reads it. */
+static int lu_evsig_open_pair_(lu_event_base_t *base)
+{
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+
+    /*
+     * Our signal handler is going to write to one end of the pipe and
+     * the internal event is going to read from the other end.
+     */
+    if (pipe(sig->ev_signal_pair) == -1) {
+        lu_event_warn("%s: pipe", __func__);
+        sig->ev_signal_pair[0] = sig->ev_signal_pair[1] = -1;
+        return -1;
+    }
+    fcntl(sig->ev_signal_pair[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sig->ev_signal_pair[1], F_SETFD, FD_CLOEXEC);
+    lu_evutil_make_socket_nonblocking(sig->ev_signal_pair[0]);
+    lu_evutil_make_socket_nonblocking(sig->ev_signal_pair[1]);
+
+    lu_event_assign(&sig->ev_signal, base, sig->ev_signal_pair[0],
+        LU_EV_READ | LU_EV_PERSIST, lu_evsig_cb, base);
+
+    sig->ev_signal.ev_flags |= LU_EVLIST_INTERNAL;
+    sig->ev_signal.ev_pri = 0;
+
+    return 0;
+}
+
+int lu_evsig_init_(lu_event_base_t *base)
+{
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+
+    if (lu_evsig_open_pair_(base) < 0)
+        return -1;
+
+    if (sig->sh_old) {
+        mm_free(sig->sh_old);
+    }
+    sig->sh_old = NULL;
+    sig->sh_old_max = 0;
+
+    base->evsigsel_op = &lu_evsigops;
+
+    return 0;
+}
+
+int lu_evsig_reinit_(lu_event_base_t *base)
+{
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+    int owner;
+
+    /* The handlers survive fork(); only the pipe they write to must not
+     * be the parent's.  Keep the handler off the old pipe meanwhile. */
+    pthread_mutex_lock(&lu_evsig_base_lock);
+    owner = (lu_evsig_base == base);
+    if (owner)
+        lu_evsig_base_fd = -1;
+    pthread_mutex_unlock(&lu_evsig_base_lock);
+
+    if (sig->ev_signal_pair[0] != -1)
+        close(sig->ev_signal_pair[0]);
+    if (sig->ev_signal_pair[1] != -1)
+        close(sig->ev_signal_pair[1]);
+    if (lu_evsig_open_pair_(base) < 0)
+        return -1;
+
+    if (owner) {
+        pthread_mutex_lock(&lu_evsig_base_lock);
+        if (lu_evsig_base == base)
+            lu_evsig_base_fd = sig->ev_signal_pair[1];
+        pthread_mutex_unlock(&lu_evsig_base_lock);
+    }
+
+    return 0;
+}
+
+/* Helper: set the signal handler for evsignal to handler in base, so that
+ * we can restore the original handler when we clear the current one. */
+static int lu_evsig_set_handler_(lu_event_base_t *base, int evsignal,
+    void (*handler)(int))
+{
+    struct sigaction sa;
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+    void *p;
+
+    /*
+     * resize saved signal handler array up to the highest signal number.
+     * a dynamic array is used to keep footprint on the low side.
+     */
+    if (evsignal >= sig->sh_old_max) {
+        int new_max = evsignal + 1;
+        event_debug(("%s: evsignal (%d) >= sh_old_max (%d), resizing",
+            __func__, evsignal, sig->sh_old_max));
+        p = mm_realloc(sig->sh_old, new_max * sizeof(*sig->sh_old));
+        if (p == NULL) {
+            lu_event_warn("realloc");
+            return (-1);
+        }
+
+        memset((char *)p + sig->sh_old_max * sizeof(*sig->sh_old),
+            0, (new_max - sig->sh_old_max) * sizeof(*sig->sh_old));
+
+        sig->sh_old_max = new_max;
+        sig->sh_old = p;
+    }
+
+    /* allocate space for previous handler out of dynamic array */
+    sig->sh_old[evsignal] = mm_malloc(sizeof *sig->sh_old[evsignal]);
+    if (sig->sh_old[evsignal] == NULL) {
+        lu_event_warn("malloc");
+        return (-1);
+    }
+
+    /* save previous handler and setup new handler */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sa.sa_flags |= SA_RESTART;
+    sigfillset(&sa.sa_mask);
+
+    if (sigaction(evsignal, &sa, sig->sh_old[evsignal]) == -1) {
+        lu_event_warn("sigaction");
+        mm_free(sig->sh_old[evsignal]);
+        sig->sh_old[evsignal] = NULL;
+        return (-1);
+    }
+
+    return (0);
+}
+
+static int lu_evsig_add(lu_event_base_t *base, lu_evutil_socket_t evsignal,
+    short old, short events, void *p)
+{
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+
+    (void)old;
+    (void)events;
+    (void)p;
+
+    pthread_mutex_lock(&lu_evsig_base_lock);
+    if (lu_evsig_base != base && lu_evsig_base_n_signals_added) {
+        lu_event_warnx("Added a signal to event base %p with signals "
+            "already added to event_base %p.  Only one can have "
+            "signals at a time with the %s backend.  The base with "
+            "the most recently added signal or the most recent "
+            "lu_event_base_loop() call gets preference.",
+            (void *)base, (void *)lu_evsig_base, base->evsigsel_op->name);
+    }
+    lu_evsig_base = base;
+    lu_evsig_base_n_signals_added = ++sig->ev_n_signals_added;
+    lu_evsig_base_fd = base->evsig_info_s.ev_signal_pair[1];
+    pthread_mutex_unlock(&lu_evsig_base_lock);
+
+    event_debug(("%s: %d: changing signal handler", __func__, (int)evsignal));
+    if (lu_evsig_set_handler_(base, (int)evsignal, lu_evsig_handler) == -1) {
+        goto err;
+    }
+
+    if (!sig->ev_signal_added) {
+        if (lu_event_add(&sig->ev_signal, NULL))
+            goto err;
+        sig->ev_signal_added = 1;
+    }
+
+    return (0);
+
+err:
+    pthread_mutex_lock(&lu_evsig_base_lock);
+    --lu_evsig_base_n_signals_added;
+    --sig->ev_n_signals_added;
+    pthread_mutex_unlock(&lu_evsig_base_lock);
+    return (-1);
+}
+
+/* Helper: restore the handler that was in place before we set ours. */
+static int lu_evsig_restore_handler_(lu_event_base_t *base, int evsignal)
+{
+    int ret = 0;
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+    struct sigaction *sh;
+
+    if (evsignal >= sig->sh_old_max) {
+        /* Can't actually restore. */
+        return 0;
+    }
+
+    /* restore previous handler */
+    sh = sig->sh_old[evsignal];
+    sig->sh_old[evsignal] = NULL;
+    if (sh == NULL)
+        return 0;
+    if (sigaction(evsignal, sh, NULL) == -1) {
+        lu_event_warn("sigaction");
+        ret = -1;
+    }
+
+    mm_free(sh);
+
+    return ret;
+}
+
+static int lu_evsig_del(lu_event_base_t *base, lu_evutil_socket_t evsignal,
+    short old, short events, void *p)
+{
+    (void)old;
+    (void)events;
+    (void)p;
+
+    event_debug(("%s: %d: restoring signal handler", __func__, (int)evsignal));
+
+    pthread_mutex_lock(&lu_evsig_base_lock);
+    --lu_evsig_base_n_signals_added;
+    --base->evsig_info_s.ev_n_signals_added;
+    pthread_mutex_unlock(&lu_evsig_base_lock);
+
+    return (lu_evsig_restore_handler_(base, (int)evsignal));
+}
+
+static void lu_evsig_handler(int sig)
+{
+    int save_errno = errno;
+    unsigned char msg;
+
+    if (lu_evsig_base_fd < 0) {
+        errno = save_errno;
+        return;
+    }
+
+    /* Wake up our notification mechanism */
+    msg = sig;
+    {
+        int r = write(lu_evsig_base_fd, (char *)&msg, 1);
+        (void)r; /* Suppress 'unused return value' and 'unused var' */
+    }
+    errno = save_errno;
+}
+
+static void lu_evsig_dealloc(lu_event_base_t *base)
+{
+    int i = 0;
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+
+    if (sig->ev_signal_added) {
+        lu_event_del(&sig->ev_signal);
+        sig->ev_signal_added = 0;
+    }
+    pthread_mutex_lock(&lu_evsig_base_lock);
+    if (base == lu_evsig_base) {
+        lu_evsig_base = NULL;
+        lu_evsig_base_n_signals_added = 0;
+        lu_evsig_base_fd = -1;
+    }
+    pthread_mutex_unlock(&lu_evsig_base_lock);
+
+    for (i = 0; i < NSIG; ++i) {
+        if (i < sig->sh_old_max && sig->sh_old[i] != NULL)
+            lu_evsig_restore_handler_(base, i);
+    }
+
+    if (sig->ev_signal_pair[0] != -1) {
+        close(sig->ev_signal_pair[0]);
+        sig->ev_signal_pair[0] = -1;
+    }
+    if (sig->ev_signal_pair[1] != -1) {
+        close(sig->ev_signal_pair[1]);
+        sig->ev_signal_pair[1] = -1;
+    }
+    sig->sh_old_max = 0;
+
+    /* per index frees are handled in lu_evsig_del() */
+    if (sig->sh_old) {
+        mm_free(sig->sh_old);
+        sig->sh_old = NULL;
+    }
+}
@@ -0,0 +1,246 @@
+/**
+ * @file lu_signalfd.c
+ * @brief signalfd(2)-based signal backend.
+ *
+ * Every watched signal is blocked and routed to one signalfd, which is
+ * watched by an internal read event of the main backend.  There is no
+ * signal handler and no self-pipe: the kernel queues the signal and a
+ * single read() returns up to LU_SIGFD_BATCH of them.
+ *
+ * signalfd only sees signals that are blocked in the thread that would
+ * otherwise receive them, so the signals must also be blocked in every
+ * other thread of the process (e.g. by blocking them before creating
+ * threads).  The mask of the thread that adds a signal is changed here.
+ */
+#include "lu_evsignal-internal.h"
+#include "lu_evmap-internal.h"
+#include "lu_event.h"
+#include "lu_log-internal.h"
+#include "lu_memory_manager.h"
+
+#include <sys/signalfd.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Number of signalfd_siginfo records read per read() call. */
+#define LU_SIGFD_BATCH 16
+
+static int  lu_sigfd_add(lu_event_base_t *base, lu_evutil_socket_t evsignal,
+    short old, short events, void *p);
+static int  lu_sigfd_del(lu_event_base_t *base, lu_evutil_socket_t evsignal,
+    short old, short events, void *p);
+static void lu_sigfd_dealloc(lu_event_base_t *base);
+
+const lu_event_op_t lu_sigfdops = {
+    "signalfd",
+    NULL,
+    lu_sigfd_add,
+    lu_sigfd_del,
+    NULL,
+    lu_sigfd_dealloc,
+    0, 0, 0
+};
+
+
+/* Callback for the signalfd: drain it in batches, then activate each
+ * signal's events once with the number of times it was raised. */
+static void lu_sigfd_cb(lu_evutil_socket_t fd, short what, void *arg)
+{
+    struct signalfd_siginfo infos[LU_SIGFD_BATCH];
+    lu_event_base_t *base = arg;
+    int ncaught[NSIG];
+    ssize_t n;
+    int i;
+
+    (void)what;
+
+    memset(&ncaught, 0, sizeof(ncaught));
+
+    for (;;) {
+        n = read(fd, infos, sizeof(infos));
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                lu_event_warn("%s: read", __func__);
+            break;
+        }
+        n /= sizeof(struct signalfd_siginfo);
+        for (i = 0; i < n; ++i) {
+            if (infos[i].ssi_signo < NSIG)
+                ncaught[infos[i].ssi_signo]++;
+        }
+        if (n < LU_SIGFD_BATCH)
+            break;
+    }
+
+    LU_EVBASE_ACQUIRE_LOCK(base);
+    for (i = 0; i < NSIG; ++i) {
+        if (ncaught[i])
+            lu_evmap_signal_active_(base, i, ncaught[i]);
+    }
+    LU_EVBASE_RELEASE_LOCK(base);
+}
+
+/* Open a signalfd for sigfd_mask and set up the internal event that
+ * reads it. */
+static int lu_sigfd_open_(lu_event_base_t *base)
+{
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+    int fd;
+
+    fd = signalfd(-1, &sig->sigfd_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOSYS && errno != EINVAL)
+            lu_event_warn("%s: signalfd", __func__);
+        sig->ev_signal_pair[0] = -1;
+        return -1;
+    }
+
+    sig->ev_signal_pair[0] = fd;
+    sig->ev_signal_pair[1] = -1;
+
+    lu_event_assign(&sig->ev_signal, base, fd,
+        LU_EV_READ | LU_EV_PERSIST, lu_sigfd_cb, base);
+
+    sig->ev_signal.ev_flags |= LU_EVLIST_INTERNAL;
+    sig->ev_signal.ev_pri = 0;
+
+    return 0;
+}
+
+int lu_sigfd_init_(lu_event_base_t *base)
+{
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+
+    /* Create the signalfd with an empty mask now, so that a kernel
+     * without signalfd is detected before any signal is added. */
+    sigemptyset(&sig->sigfd_mask);
+    sigemptyset(&sig->sigfd_preblocked);
+    if (lu_sigfd_open_(base) < 0)
+        return -1;
+
+    sig->sh_old = NULL;
+    sig->sh_old_max = 0;
+
+    base->evsigsel_op = &lu_sigfdops;
+
+    return 0;
+}
+
+int lu_sigfd_reinit_(lu_event_base_t *base)
+{
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+
+    /* The child inherits the signal mask, so the same signals are still
+     * blocked; it only needs a signalfd of its own. */
+    if (sig->ev_signal_pair[0] != -1)
+        close(sig->ev_signal_pair[0]);
+    return lu_sigfd_open_(base);
+}
+
+static int lu_sigfd_add(lu_event_base_t *base, lu_evutil_socket_t evsignal,
+    short old, short events, void *p)
+{
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+    sigset_t one, prev;
+
+    (void)old;
+    (void)events;
+    (void)p;
+
+    sigemptyset(&one);
+    sigaddset(&one, (int)evsignal);
+
+    /* Block the signal first, so it is queued for the signalfd instead
+     * of being delivered the normal way. */
+    if (pthread_sigmask(SIG_BLOCK, &one, &prev) != 0) {
+        lu_event_warn("%s: pthread_sigmask", __func__);
+        return (-1);
+    }
+    if (sigismember(&prev, (int)evsignal))
+        sigaddset(&sig->sigfd_preblocked, (int)evsignal);
+
+    sigaddset(&sig->sigfd_mask, (int)evsignal);
+    if (signalfd(sig->ev_signal_pair[0], &sig->sigfd_mask, 0) == -1) {
+        lu_event_warn("%s: signalfd", __func__);
+        goto err;
+    }
+
+    if (!sig->ev_signal_added) {
+        if (lu_event_add(&sig->ev_signal, NULL))
+            goto err;
+        sig->ev_signal_added = 1;
+    }
+    ++sig->ev_n_signals_added;
+
+    return (0);
+
+err:
+    sigdelset(&sig->sigfd_mask, (int)evsignal);
+    if (!sigismember(&sig->sigfd_preblocked, (int)evsignal))
+        pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+    sigdelset(&sig->sigfd_preblocked, (int)evsignal);
+    return (-1);
+}
+
+static int lu_sigfd_del(lu_event_base_t *base, lu_evutil_socket_t evsignal,
+    short old, short events, void *p)
+{
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+    sigset_t one;
+    int ret = 0;
+
+    (void)old;
+    (void)events;
+    (void)p;
+
+    sigdelset(&sig->sigfd_mask, (int)evsignal);
+    if (signalfd(sig->ev_signal_pair[0], &sig->sigfd_mask, 0) == -1) {
+        lu_event_warn("%s: signalfd", __func__);
+        ret = -1;
+    }
+
+    if (!sigismember(&sig->sigfd_preblocked, (int)evsignal)) {
+        sigemptyset(&one);
+        sigaddset(&one, (int)evsignal);
+        pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+    }
+    sigdelset(&sig->sigfd_preblocked, (int)evsignal);
+
+    --sig->ev_n_signals_added;
+
+    return (ret);
+}
+
+static void lu_sigfd_dealloc(lu_event_base_t *base)
+{
+    lu_evsig_info_t *sig = &base->evsig_info_s;
+
+    if (sig->ev_signal_added) {
+        lu_event_del(&sig->ev_signal);
+        sig->ev_signal_added = 0;
+    }
+
+    /* Unblock whatever is still routed to us and was not blocked before. */
+    {
+        int i;
+        for (i = 1; i < NSIG; ++i) {
+            if (sigismember(&sig->sigfd_mask, i) == 1 &&
+                sigismember(&sig->sigfd_preblocked, i) != 1) {
+                sigset_t one;
+                sigemptyset(&one);
+                sigaddset(&one, i);
+                pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+            }
+        }
+        sigemptyset(&sig->sigfd_mask);
+        sigemptyset(&sig->sigfd_preblocked);
+    }
+
+    if (sig->ev_signal_pair[0] != -1) {
+        close(sig->ev_signal_pair[0]);
+        sig->ev_signal_pair[0] = -1;
+    }
+}
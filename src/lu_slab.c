@@ -0,0 +1,101 @@
+/**
+ * @file lu_slab.c
+ * @brief Fixed-size object allocator; see lu_slab-internal.h.
+ */
+#include "lu_slab-internal.h"
+#include "lu_memory_manager.h"
+
+
+#define LU_SLAB_CACHELINE   64
+/* Slabs grown on demand hold about this many bytes of objects. */
+#define LU_SLAB_BYTES       16384
+#define LU_SLAB_MIN_OBJS    8
+
+/* Each slab starts with a cache line whose first word links it to the
+ * next slab; the objects follow, so the first one is line-aligned too. */
+#define LU_SLAB_HEADER      LU_SLAB_CACHELINE
+
+
+void lu_slab_init_(lu_slab_t *slab, size_t obj_size)
+{
+    /* Room for the free-list link, and keep objects pointer-aligned. */
+    if (obj_size < sizeof(void *))
+        obj_size = sizeof(void *);
+    obj_size = (obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    slab->obj_size = obj_size;
+    slab->free_list = NULL;
+    slab->slabs = NULL;
+    slab->nobjs = 0;
+    slab->nfree = 0;
+}
+
+/** Allocate one slab of n objects and put them all on the free list. */
+static int lu_slab_grow_(lu_slab_t *slab, size_t n)
+{
+    char *mem, *obj;
+    size_t i;
+
+    mem = mm_memalign(LU_SLAB_HEADER + n * slab->obj_size, LU_SLAB_CACHELINE);
+    if (mem == NULL)
+        return (-1);
+
+    *(void **)mem = slab->slabs;
+    slab->slabs = mem;
+
+    /* Push from the end, so the list hands objects out in address
+     * order. */
+    obj = mem + LU_SLAB_HEADER + n * slab->obj_size;
+    for (i = 0; i < n; ++i) {
+        obj -= slab->obj_size;
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    slab->nobjs += n;
+    slab->nfree += n;
+    return (0);
+}
+
+void *lu_slab_alloc_(lu_slab_t *slab)
+{
+    void *obj;
+
+    if (slab->free_list == NULL) {
+        size_t n = LU_SLAB_BYTES / slab->obj_size;
+        if (n < LU_SLAB_MIN_OBJS)
+            n = LU_SLAB_MIN_OBJS;
+        if (lu_slab_grow_(slab, n) < 0)
+            return NULL;
+    }
+
+    obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+    --slab->nfree;
+    return obj;
+}
+
+void lu_slab_free_(lu_slab_t *slab, void *obj)
+{
+    *(void **)obj = slab->free_list;
+    slab->free_list = obj;
+    ++slab->nfree;
+}
+
+int lu_slab_reserve_(lu_slab_t *slab, size_t n)
+{
+    if (n <= slab->nfree)
+        return (0);
+    return lu_slab_grow_(slab, n - slab->nfree);
+}
+
+void lu_slab_clear_(lu_slab_t *slab)
+{
+    void *mem = slab->slabs;
+
+    while (mem) {
+        void *next = *(void **)mem;
+        mm_free(mem);
+        mem = next;
+    }
+    lu_slab_init_(slab, slab->obj_size);
+}
@@ -0,0 +1,206 @@
+/**
+ * @file lu_timer_wheel.c
+ * @brief Hierarchical timing wheel backing the common timeouts of a base.
+ *
+ * An event expiring at tick e is kept on the level of the highest
+ * LU_TIMER_WHEEL_BITS-bit group in which e differs from now_tick, in the
+ * slot given by e's bits in that group.  When now_tick reaches the start of
+ * a higher-level slot, that slot is cascaded: its events are placed again
+ * relative to the new now_tick and land on a lower level.  Because a slot
+ * is only ever entered through a cascade, an event's slot is a function of
+ * (e, now_tick) at all times, so removal needs no per-event bookkeeping.
+ */
+#include "lu_timer_wheel-internal.h"
+#include "lu_event.h"
+
+#include <string.h>
+
+
+#define LU_TIMER_WHEEL_MASK     ((lu_uint64_t)(LU_TIMER_WHEEL_SLOTS - 1))
+
+#define lu_timer_wheel_next_    ev_timeout_pos.ev_next_with_common_timeout
+
+
+lu_uint64_t lu_timer_wheel_tv_to_tick_(const struct timeval *tv)
+{
+    lu_uint64_t usec = (lu_uint64_t)tv->tv_sec * 1000000 +
+        (tv->tv_usec & LU_MICROSECONDS_MASK);
+    return usec / LU_TIMER_WHEEL_TICK_USEC;
+}
+
+void lu_timer_wheel_tick_to_tv_(lu_uint64_t tick, struct timeval *tv)
+{
+    lu_uint64_t usec = tick * LU_TIMER_WHEEL_TICK_USEC;
+    tv->tv_sec = (time_t)(usec / 1000000);
+    tv->tv_usec = (suseconds_t)(usec % 1000000);
+}
+
+/** The expiry tick of ev: its timeout rounded up to a whole tick. */
+static inline lu_uint64_t lu_timer_wheel_expiry_(const lu_event_t *ev)
+{
+    lu_uint64_t usec = (lu_uint64_t)ev->ev_timeout.tv_sec * 1000000 +
+        (ev->ev_timeout.tv_usec & LU_MICROSECONDS_MASK);
+    return (usec + LU_TIMER_WHEEL_TICK_USEC - 1) / LU_TIMER_WHEEL_TICK_USEC;
+}
+
+/** Return the list an event expiring at 'expiry' belongs on, and set
+ * *level and *slot to its position.  *level is -1 for the due list. */
+static struct lu_event_tqlist *lu_timer_wheel_locate_(lu_timer_wheel_t *wheel,
+    lu_uint64_t expiry, int *level, int *slot)
+{
+    int l;
+
+    if (expiry <= wheel->now_tick) {
+        *level = -1;
+        *slot = 0;
+        return &wheel->due;
+    }
+
+    l = (63 - __builtin_clzll(expiry ^ wheel->now_tick)) / LU_TIMER_WHEEL_BITS;
+    if (l >= LU_TIMER_WHEEL_LEVELS)
+        l = LU_TIMER_WHEEL_LEVELS - 1;
+
+    *level = l;
+    *slot = (int)((expiry >> (LU_TIMER_WHEEL_BITS * l)) & LU_TIMER_WHEEL_MASK);
+    return &wheel->slots[l][*slot];
+}
+
+/** Return the tick at which slot 'slot' of level 'level' is reached. */
+static lu_uint64_t lu_timer_wheel_slot_tick_(const lu_timer_wheel_t *wheel,
+    int level, int slot)
+{
+    int shift = LU_TIMER_WHEEL_BITS * level;
+    int upper = shift + LU_TIMER_WHEEL_BITS;
+    lu_uint64_t cur = (wheel->now_tick >> shift) & LU_TIMER_WHEEL_MASK;
+    lu_uint64_t tick = ((wheel->now_tick >> upper) << upper) |
+        ((lu_uint64_t)slot << shift);
+
+    /* Only the top level can wrap around. */
+    if ((lu_uint64_t)slot <= cur)
+        tick += (lu_uint64_t)1 << upper;
+    return tick;
+}
+
+/** Link ev into the slot its expiry maps to and return that slot's tick. */
+static lu_uint64_t lu_timer_wheel_link_(lu_timer_wheel_t *wheel, lu_event_t *ev)
+{
+    struct lu_event_tqlist *head;
+    int level, slot;
+
+    head = lu_timer_wheel_locate_(wheel, lu_timer_wheel_expiry_(ev),
+        &level, &slot);
+    TAILQ_INSERT_TAIL(head, ev, lu_timer_wheel_next_);
+    if (level < 0)
+        return wheel->now_tick;
+
+    wheel->occupied[level] |= (lu_uint64_t)1 << slot;
+    return lu_timer_wheel_slot_tick_(wheel, level, slot);
+}
+
+/** Re-place every event of a slot relative to the current tick. */
+static void lu_timer_wheel_cascade_(lu_timer_wheel_t *wheel, int level, int slot)
+{
+    struct lu_event_tqlist *head = &wheel->slots[level][slot];
+    lu_event_t *ev;
+
+    wheel->occupied[level] &= ~((lu_uint64_t)1 << slot);
+    while ((ev = TAILQ_FIRST(head)) != NULL) {
+        TAILQ_REMOVE(head, ev, lu_timer_wheel_next_);
+        lu_timer_wheel_link_(wheel, ev);
+    }
+}
+
+/** Like lu_timer_wheel_next_tick_(), but ignoring the due list. */
+static lu_uint64_t lu_timer_wheel_next_slot_tick_(const lu_timer_wheel_t *wheel)
+{
+    lu_uint64_t best = LU_TIMER_WHEEL_NO_TICK;
+    int l;
+
+    for (l = 0; l < LU_TIMER_WHEEL_LEVELS; ++l) {
+        lu_uint64_t bits = wheel->occupied[l];
+        lu_uint64_t cur, above, tick;
+        int slot;
+
+        if (!bits)
+            continue;
+
+        cur = (wheel->now_tick >> (LU_TIMER_WHEEL_BITS * l)) & LU_TIMER_WHEEL_MASK;
+        above = cur == LU_TIMER_WHEEL_MASK ? 0 : bits & (~(lu_uint64_t)0 << (cur + 1));
+        slot = __builtin_ctzll(above ? above : bits);
+
+        tick = lu_timer_wheel_slot_tick_(wheel, l, slot);
+        if (tick < best)
+            best = tick;
+    }
+
+    return best;
+}
+
+void lu_timer_wheel_init_(lu_timer_wheel_t *wheel, lu_uint64_t now_tick)
+{
+    int l, s;
+
+    for (l = 0; l < LU_TIMER_WHEEL_LEVELS; ++l) {
+        for (s = 0; s < LU_TIMER_WHEEL_SLOTS; ++s)
+            TAILQ_INIT(&wheel->slots[l][s]);
+        wheel->occupied[l] = 0;
+    }
+    TAILQ_INIT(&wheel->due);
+    wheel->now_tick = now_tick;
+    wheel->count = 0;
+}
+
+lu_uint64_t lu_timer_wheel_insert_(lu_timer_wheel_t *wheel, lu_event_t *ev)
+{
+    ++wheel->count;
+    return lu_timer_wheel_link_(wheel, ev);
+}
+
+void lu_timer_wheel_remove_(lu_timer_wheel_t *wheel, lu_event_t *ev)
+{
+    struct lu_event_tqlist *head;
+    int level, slot;
+
+    head = lu_timer_wheel_locate_(wheel, lu_timer_wheel_expiry_(ev),
+        &level, &slot);
+    TAILQ_REMOVE(head, ev, lu_timer_wheel_next_);
+    if (level >= 0 && TAILQ_EMPTY(head))
+        wheel->occupied[level] &= ~((lu_uint64_t)1 << slot);
+    --wheel->count;
+}
+
+void lu_timer_wheel_advance_(lu_timer_wheel_t *wheel, lu_uint64_t target_tick)
+{
+    for (;;) {
+        lu_uint64_t tick = lu_timer_wheel_next_slot_tick_(wheel);
+        int l;
+
+        if (tick == LU_TIMER_WHEEL_NO_TICK || tick > target_tick)
+            break;
+
+        wheel->now_tick = tick;
+
+        /* Higher levels first, so their events can drop into the lower
+         * slots that are reached at the same tick. */
+        for (l = LU_TIMER_WHEEL_LEVELS - 1; l >= 0; --l) {
+            int shift = LU_TIMER_WHEEL_BITS * l;
+            int slot;
+
+            if (tick & (((lu_uint64_t)1 << shift) - 1))
+                continue;
+            slot = (int)((tick >> shift) & LU_TIMER_WHEEL_MASK);
+            if (wheel->occupied[l] & ((lu_uint64_t)1 << slot))
+                lu_timer_wheel_cascade_(wheel, l, slot);
+        }
+    }
+
+    if (target_tick > wheel->now_tick)
+        wheel->now_tick = target_tick;
+}
+
+lu_uint64_t lu_timer_wheel_next_tick_(const lu_timer_wheel_t *wheel)
+{
+    if (!TAILQ_EMPTY(&wheel->due))
+        return wheel->now_tick;
+    return lu_timer_wheel_next_slot_tick_(wheel);
+}
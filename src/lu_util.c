@@ -6,6 +6,12 @@
 #include <assert.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "lu_memory_manager.h"
 #include "lu_hash_table-internal.h"
@@ -149,10 +155,201 @@ const char *lu_evutil_getenv_(const char *varname)
 }
 
 
+long lu_evutil_tv_to_msec_(const struct timeval *tv)
+{
+    if (tv->tv_usec > 1000000 || tv->tv_sec > (LONG_MAX - 1000) / 1000)
+        return -1;
+
+    return (tv->tv_sec * 1000) + ((tv->tv_usec + 999) / 1000);
+}
+
+int lu_evutil_make_socket_nonblocking(lu_evutil_socket_t fd)
+{
+    int flags;
+    if ((flags = fcntl(fd, F_GETFL, NULL)) < 0) {
+        return -1;
+    }
+    if (!(flags & O_NONBLOCK)) {
+        if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int lu_evutil_make_listen_socket_reuseable(lu_evutil_socket_t sock)
+{
+    int one = 1;
+    /* REUSEADDR on Unix means, "don't hang on to this address after the
+     * listener is closed." */
+    return setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void*) &one,
+        (lu_evutil_socklen_t)sizeof(one));
+}
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+int lu_evutil_make_listen_socket_reuseable_port(lu_evutil_socket_t sock)
+{
+    int one = 1;
+    /* REUSEPORT on Linux 3.9+ means, "Multiple servers (processes or
+     * threads) can bind to the same port if they each set the option." */
+    return setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void*) &one,
+        (lu_evutil_socklen_t)sizeof(one));
+}
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+int lu_evutil_make_socket_busy_poll(lu_evutil_socket_t sock, int usec)
+{
+    return setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, (void*) &usec,
+        (lu_evutil_socklen_t)sizeof(usec));
+}
+
+int lu_evutil_read_drain(lu_evutil_socket_t fd, void *buf, size_t len,
+    size_t *nread)
+{
+    size_t got = 0;
+    ssize_t n;
+    int r;
+
+    for (;;) {
+        if (got == len) {
+            r = LU_EVUTIL_EDGE_PENDING;
+            break;
+        }
+        n = read(fd, (char *)buf + got, len - got);
+        if (n > 0) {
+            got += n;
+        } else if (n == 0) {
+            r = LU_EVUTIL_EDGE_EOF;
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            r = LU_EVUTIL_EDGE_CONSUMED;
+            break;
+        } else {
+            r = -1;
+            break;
+        }
+    }
+
+    *nread = got;
+    return r;
+}
+
+int lu_evutil_write_drain(lu_evutil_socket_t fd, const void *buf, size_t len,
+    size_t *nwritten)
+{
+    size_t put = 0;
+    ssize_t n;
+    int r;
+
+    for (;;) {
+        if (put == len) {
+            r = LU_EVUTIL_EDGE_PENDING;
+            break;
+        }
+        n = write(fd, (const char *)buf + put, len - put);
+        if (n >= 0) {
+            put += n;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            r = LU_EVUTIL_EDGE_CONSUMED;
+            break;
+        } else {
+            r = -1;
+            break;
+        }
+    }
+
+    *nwritten = put;
+    return r;
+}
+
+
+/* Keep a gettimeofday()-based clock from going backwards: if the wall
+ * clock jumped back, shift every later result forward by the difference. */
+static void lu_evutil_adjust_monotonic_time_(lu_evutil_monotonic_timer_t *base,
+    struct timeval *tv)
+{
+    lu_evutil_timeradd(tv, &base->adjust_monotonic_clock, tv);
+
+    if (lu_evutil_timercmp(tv, &base->last_time, <)) {
+        /* Guess it's rewound time. */
+        struct timeval adjust;
+        lu_evutil_timersub(&base->last_time, tv, &adjust);
+        lu_evutil_timeradd(&adjust, &base->adjust_monotonic_clock,
+            &base->adjust_monotonic_clock);
+        *tv = base->last_time;
+    }
+    base->last_time = *tv;
+}
+
 int lu_evutil_configure_monotonic_time_(lu_evutil_monotonic_timer_t *base,
     int flags)
 {
-    //TODO: to be implemented
+    /* CLOCK_MONOTONIC_COARSE reads the time of the last tick instead of the
+     * hardware clock, so it's the cheapest clock to ask.  Only use it when
+     * its resolution is no worse than a millisecond (kernels with HZ < 1000
+     * advance it in 4ms or 10ms steps), otherwise timeouts would fire late
+     * by a whole tick. */
+    const int precise = flags & LU_EVENT_MONOT_PRECISE;
+    const int fallback = flags & LU_EVENT_MONOT_FALLBACK;
+    struct timespec ts;
+
+    memset(base, 0, sizeof(*base));
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    if (!precise && !fallback) {
+        if (clock_getres(CLOCK_MONOTONIC_COARSE, &ts) == 0 &&
+            ts.tv_sec == 0 && ts.tv_nsec <= 1000000 &&
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0) {
+            base->monotonic_clock = CLOCK_MONOTONIC_COARSE;
+            return 0;
+        }
+    }
+#endif
+    if (!fallback && clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        base->monotonic_clock = CLOCK_MONOTONIC;
+        return 0;
+    }
+
+    base->monotonic_clock = -1;
+    return 0;
+}
+
+int lu_evutil_gettime_monotonic_(lu_evutil_monotonic_timer_t *base,
+    struct timeval *tp)
+{
+    struct timespec ts;
+
+    if (base->monotonic_clock < 0) {
+        if (gettimeofday(tp, NULL) < 0)
+            return -1;
+        lu_evutil_adjust_monotonic_time_(base, tp);
+        return 0;
+    }
+
+    if (clock_gettime(base->monotonic_clock, &ts) == -1)
+        return -1;
+    tp->tv_sec = ts.tv_sec;
+    tp->tv_usec = ts.tv_nsec / 1000;
+    return 0;
+}
+
+int lu_evutil_gettime_precise_(struct timeval *tp)
+{
+    struct timespec ts;
 
- return 0;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        return -1;
+    tp->tv_sec = ts.tv_sec;
+    tp->tv_usec = ts.tv_nsec / 1000;
+    return 0;
 }
@@ -3,6 +3,17 @@
 #include "lu_erron.h"
 #include <memory.h>
 #include "lu_hash_table-internal.h"
+#include "lu_event.h"
+#include "lu_event_pool.h"
+#include "lu_event_workers.h"
+#include "lu_util.h"
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <pthread.h>
 
 
 //#define LU_EVENT__ENABLE_DEFAULT_MEMORY_LOGGING
@@ -132,8 +143,1075 @@ void test_mm_memory(){
 }
 
 
+static void test_epoll_read_cb(lu_evutil_socket_t fd, short what, void *arg){
+    int *count = (int *)arg;
+    char buf[64];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    printf("fd %d readable (what 0x%x), read %zd bytes\n", fd, what, n);
+    ++*count;
+}
+
+int test_epoll_pipe(){
+    int fds[2];
+    int count = 0;
+    lu_event_base_t *base = lu_event_base_new();
+    lu_event_t *ev;
+    int ok;
+
+    if (base == NULL || pipe(fds) < 0)
+        return -1;
+    printf("backend: %s\n", lu_event_base_get_method(base));
+
+    ev = lu_event_new(base, fds[0], LU_EV_READ, test_epoll_read_cb, &count);
+    lu_event_add(ev, NULL);
+    write(fds[1], "ping", 4);
+    lu_event_base_dispatch(base);
+
+    ok = count == 1;
+    printf("callbacks run: %d: %s\n", count, ok ? "ok" : "FAILED");
+    lu_event_free(ev);
+    lu_event_base_free(base);
+    close(fds[0]);
+    close(fds[1]);
+    return ok ? 0 : -1;
+}
+
+static const char *test_timer_order[2];
+static int test_timer_nfired;
+
+static void test_timer_cb(lu_evutil_socket_t fd, short what, void *arg){
+    (void)fd;
+    printf("timer %s fired (what 0x%x)\n", (const char *)arg, what);
+    if (test_timer_nfired < 2)
+        test_timer_order[test_timer_nfired] = arg;
+    ++test_timer_nfired;
+}
+
+/* Timers fire in deadline order, not the order they were added in. */
+int test_timer_heap(){
+    lu_event_base_t *base = lu_event_base_new();
+    struct timeval tv_late = {0, 300000}, tv_early = {0, 100000};
+    lu_event_t *late, *early;
+    int ok;
+
+    if (base == NULL)
+        return -1;
+    test_timer_nfired = 0;
+    late = lu_event_new(base, -1, 0, test_timer_cb, "late");
+    early = lu_event_new(base, -1, 0, test_timer_cb, "early");
+    lu_event_add(late, &tv_late);
+    lu_event_add(early, &tv_early);
+    lu_event_base_dispatch(base);
+
+    ok = test_timer_nfired == 2 &&
+        strcmp(test_timer_order[0], "early") == 0 &&
+        strcmp(test_timer_order[1], "late") == 0;
+    printf("timer heap: %d fired: %s\n", test_timer_nfired, ok ? "ok" : "FAILED");
+    lu_event_free(late);
+    lu_event_free(early);
+    lu_event_base_free(base);
+    return ok ? 0 : -1;
+}
+
+static void test_common_timeout_cb(lu_evutil_socket_t fd, short what, void *arg){
+    int *count = arg;
+    (void)fd;
+    (void)what;
+    ++*count;
+}
+
+/* Events on a common timeout fire once each, re-armed or not; deleted
+ * ones don't fire. */
+int test_common_timeout(){
+    lu_event_base_t *base = lu_event_base_new();
+    struct timeval tv_idle = {0, 200000};
+    const struct timeval *idle;
+    lu_event_t *evs[1000];
+    int i, count = 0;
+    int ok;
+
+    if (base == NULL)
+        return -1;
+    idle = lu_event_base_init_common_timeout(base, &tv_idle);
+    for (i = 0; i < 1000; ++i) {
+        evs[i] = lu_event_new(base, -1, 0, test_common_timeout_cb, &count);
+        lu_event_add(evs[i], idle);
+    }
+    /* re-arming and cancelling are O(1) on the timing wheel */
+    for (i = 0; i < 1000; i += 2)
+        lu_event_add(evs[i], idle);
+    for (i = 0; i < 1000; i += 10)
+        lu_event_del(evs[i]);
+    lu_event_base_dispatch(base);
+
+    ok = count == 900;
+    printf("common timeouts fired: %d: %s\n", count, ok ? "ok" : "FAILED");
+    for (i = 0; i < 1000; ++i)
+        lu_event_free(evs[i]);
+    lu_event_base_free(base);
+    return ok ? 0 : -1;
+}
+
+static void test_count_cb(lu_evutil_socket_t fd, short what, void *arg){
+    (void)fd;
+    (void)what;
+    ++*(int *)arg;
+}
+
+/* lu_event_del()/lu_event_free() cancel an lu_event_active_async() that
+ * the loop has not drained yet, and a reused slot doesn't inherit it. */
+int test_active_async_cancel(){
+    lu_event_base_t *base = lu_event_base_new();
+    int fds[2];
+    int n_ev = 0, n1 = 0, n2 = 0, n3 = 0;
+    lu_event_t *ev, *e1, *e2, *e3;
+    int ok;
+
+    if (base == NULL || pipe(fds) < 0)
+        return -1;
+
+    ev = lu_event_new(base, fds[0], LU_EV_READ|LU_EV_PERSIST, test_count_cb, &n_ev);
+    lu_event_add(ev, NULL);
+    lu_event_active_async(ev, LU_EV_READ);
+    lu_event_del(ev);
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+
+    e2 = lu_event_new(base, -1, 0, test_count_cb, &n2);
+    e1 = lu_event_new(base, -1, 0, test_count_cb, &n1);
+    lu_event_active_async(e2, LU_EV_TIMEOUT);
+    lu_event_active_async(e1, LU_EV_TIMEOUT);
+    lu_event_free(e1);
+    e3 = lu_event_new(base, -1, 0, test_count_cb, &n3);
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    lu_event_active_async(e2, LU_EV_TIMEOUT);
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+
+    ok = n_ev == 0 && n1 == 0 && n2 == 2 && n3 == 0;
+    printf("active_async cancel: deleted %d, freed %d, kept %d, reused %d: %s\n",
+        n_ev, n1, n2, n3, ok ? "ok" : "FAILED");
+
+    lu_event_free(ev);
+    lu_event_free(e2);
+    lu_event_free(e3);
+    lu_event_base_free(base);
+    close(fds[0]);
+    close(fds[1]);
+    return ok ? 0 : -1;
+}
+
+/* lu_event_pool_stop() right after lu_event_pool_start() must not lose
+ * the stop of a loop that has not started yet. */
+int test_pool_start_stop(){
+    lu_event_config_t *cfg = lu_event_config_new();
+    int i;
+
+    if (cfg == NULL)
+        return -1;
+    lu_event_config_set_num_cpus_hint(cfg, 4);
+    for (i = 0; i < 300; ++i) {
+        lu_event_pool_t *pool = lu_event_pool_new(cfg, 0);
+        int started;
+
+        if (pool == NULL)
+            break;
+        started = lu_event_pool_start(pool) == 0;
+        lu_event_pool_free(pool);
+        if (!started)
+            break;
+    }
+    lu_event_config_free(cfg);
+    printf("pool start/stop: %d of 300 rounds: %s\n", i, i == 300 ? "ok" : "FAILED");
+    return i == 300 ? 0 : -1;
+}
+
+/* A callback shorter than a coarse clock tick is still timed, and one over
+ * the slow threshold is reported. */
+static void test_trace_busy_cb(lu_evutil_socket_t fd, short what, void *arg){
+    struct timespec start, now;
+
+    (void)fd;
+    (void)what;
+    (void)arg;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000L +
+        (now.tv_nsec - start.tv_nsec) < 300000L);
+}
+
+static void test_trace_slow_cb(lu_event_base_t *base,
+    const lu_event_callback_trace_t *slow, void *arg){
+    (void)base;
+    *(lu_event_callback_trace_t *)arg = *slow;
+}
+
+int test_callback_trace(){
+    lu_event_base_t *base = lu_event_base_new();
+    struct timeval slow = {0, 100};
+    lu_event_callback_trace_t reported, records[4];
+    lu_event_t *ev;
+    long usec;
+    int n, ok;
+
+    if (base == NULL)
+        return -1;
+    memset(&reported, 0, sizeof(reported));
+    ev = lu_event_new(base, -1, 0, test_trace_busy_cb, NULL);
+    lu_event_base_trace_callbacks(base, 4, &slow, test_trace_slow_cb, &reported);
+    lu_event_active(ev, LU_EV_TIMEOUT, 0);
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    n = lu_event_base_get_callback_trace(base, records, 4);
+
+    usec = reported.run_time.tv_sec * 1000000L + reported.run_time.tv_usec;
+    ok = n == 1 && reported.callback == (void *)test_trace_busy_cb &&
+        usec >= 300 && records[0].run_time.tv_usec == reported.run_time.tv_usec;
+    printf("callback trace: %d records, slow callback ran %ldus: %s\n",
+        n, usec, ok ? "ok" : "FAILED");
+
+    lu_event_free(ev);
+    lu_event_base_free(base);
+    return ok ? 0 : -1;
+}
+
+
+static void test_offload_work(void *arg){
+    __atomic_add_fetch(&((int *)arg)[0], 1, __ATOMIC_RELAXED);
+}
+
+static void test_offload_done(void *arg){
+    ++((int *)arg)[1];
+}
+
+/* Offloaded jobs run on the workers, their 'done' runs in the loop, and
+ * the loop keeps running until the last one is done. */
+int test_offload(){
+    lu_event_base_t *base = lu_event_base_new();
+    int counts[2] = {0, 0};
+    int i, ok;
+
+    if (base == NULL || lu_event_base_start_workers(base, 4) < 0)
+        return -1;
+    for (i = 0; i < 1000; ++i)
+        lu_event_base_offload(base, test_offload_work, test_offload_done, counts);
+    lu_event_base_dispatch(base);
+
+    ok = counts[0] == 1000 && counts[1] == 1000;
+    printf("offload: %d run, %d done: %s\n", counts[0], counts[1],
+        ok ? "ok" : "FAILED");
+    lu_event_base_free(base);
+    return ok ? 0 : -1;
+}
+
+/* One-shot timers and fd events each run once, then let the loop exit. */
+int test_once(){
+    lu_event_base_t *base = lu_event_base_new();
+    struct timeval tv = {0, 1000};
+    int fds[2];
+    int ntimer = 0, nread = 0;
+    int i, ok;
+
+    if (base == NULL || pipe(fds) < 0)
+        return -1;
+    for (i = 0; i < 100; ++i)
+        lu_event_base_once(base, -1, LU_EV_TIMEOUT, test_count_cb, &ntimer,
+            i % 2 ? &tv : NULL);
+    lu_event_base_once(base, fds[0], LU_EV_READ, test_count_cb, &nread, NULL);
+    write(fds[1], "x", 1);
+    lu_event_base_dispatch(base);
+
+    ok = ntimer == 100 && nread == 1;
+    printf("once: %d timers, %d reads: %s\n", ntimer, nread, ok ? "ok" : "FAILED");
+    lu_event_base_free(base);
+    close(fds[0]);
+    close(fds[1]);
+    return ok ? 0 : -1;
+}
+
+static void test_prepare_cb(lu_evwatch_t *watcher,
+    const lu_evwatch_prepare_cb_info_t *info, void *arg){
+    (void)watcher;
+    (void)info;
+    ++((int *)arg)[0];
+}
+
+static void test_check_cb(lu_evwatch_t *watcher,
+    const lu_evwatch_check_cb_info_t *info, void *arg){
+    (void)watcher;
+    ++((int *)arg)[1];
+    ((int *)arg)[2] += info->nready;
+}
+
+/* Prepare and check watchers run around every wait, and the check watcher
+ * sees what the wait made active. */
+int test_watchers(){
+    lu_event_base_t *base = lu_event_base_new();
+    int counts[3] = {0, 0, 0};
+    int fds[2];
+    int nread = 0;
+    lu_event_t *ev;
+    int ok;
+
+    if (base == NULL || pipe(fds) < 0)
+        return -1;
+    lu_evwatch_prepare_new(base, test_prepare_cb, counts);
+    lu_evwatch_check_new(base, test_check_cb, counts);
+    ev = lu_event_new(base, fds[0], LU_EV_READ, test_count_cb, &nread);
+    lu_event_add(ev, NULL);
+    write(fds[1], "x", 1);
+    lu_event_base_dispatch(base);
+
+    ok = nread == 1 && counts[0] >= 1 && counts[0] == counts[1] &&
+        counts[2] == 1;
+    printf("watchers: %d prepare, %d check, %d ready: %s\n",
+        counts[0], counts[1], counts[2], ok ? "ok" : "FAILED");
+    lu_event_free(ev);
+    lu_event_base_free(base);
+    close(fds[0]);
+    close(fds[1]);
+    return ok ? 0 : -1;
+}
+
+/* The stats snapshot follows events being added and deleted and counts
+ * the loop's waits; a loop with nothing to wait for exits without one. */
+int test_stats(){
+    lu_event_base_t *base = lu_event_base_new();
+    lu_event_base_stats_t before, added, deleted;
+    int fds[2];
+    int n = 0;
+    lu_event_t *ev;
+    int ok;
+
+    if (base == NULL || pipe(fds) < 0)
+        return -1;
+    ev = lu_event_new(base, fds[0], LU_EV_READ, test_count_cb, &n);
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    lu_event_base_get_stats(base, &before);
+    lu_event_add(ev, NULL);
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    lu_event_base_get_stats(base, &added);
+    lu_event_del(ev);
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    lu_event_base_get_stats(base, &deleted);
+
+    ok = added.event_count == before.event_count + 1 &&
+        deleted.event_count == before.event_count &&
+        added.iterations == before.iterations + 1 &&
+        deleted.iterations == added.iterations;
+    printf("stats: events %d/%d/%d, iterations %llu: %s\n",
+        before.event_count, added.event_count, deleted.event_count,
+        (unsigned long long)deleted.iterations, ok ? "ok" : "FAILED");
+    lu_event_free(ev);
+    lu_event_base_free(base);
+    close(fds[0]);
+    close(fds[1]);
+    return ok ? 0 : -1;
+}
+
+/* After lu_event_reinit() in a forked child, fd, signal and timer events
+ * set up by the parent still fire in the child. */
+int test_reinit_after_fork(){
+    lu_event_base_t *base = lu_event_base_new();
+    struct timeval tv = {0, 10000};
+    int nread = 0, nsig = 0, ntimer = 0;
+    lu_event_t *rev, *sev, *tev;
+    int fds[2], status = -1;
+    pid_t pid;
+    int ok;
+
+    if (base == NULL || pipe(fds) < 0)
+        return -1;
+    rev = lu_event_new(base, fds[0], LU_EV_READ, test_count_cb, &nread);
+    sev = lu_evsignal_new(base, SIGUSR1, test_count_cb, &nsig);
+    tev = lu_event_new(base, -1, 0, test_count_cb, &ntimer);
+    lu_event_add(rev, NULL);
+    lu_evsignal_add(sev, NULL);
+
+    pid = fork();
+    if (pid == 0) {
+        if (lu_event_reinit(base) < 0)
+            _exit(2);
+        lu_event_add(tev, &tv);
+        write(fds[1], "x", 1);
+        kill(getpid(), SIGUSR1);
+        while (ntimer == 0)
+            lu_event_base_loop(base, LU_EVLOOP_ONCE);
+        _exit(nread == 1 && nsig == 1 ? 0 : 1);
+    }
+    if (pid > 0)
+        waitpid(pid, &status, 0);
+
+    ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("reinit after fork: child status %d: %s\n", status, ok ? "ok" : "FAILED");
+    lu_event_free(rev);
+    lu_event_free(sev);
+    lu_event_free(tev);
+    lu_event_base_free(base);
+    close(fds[0]);
+    close(fds[1]);
+    return ok ? 0 : -1;
+}
+
+/* The io_uring backend runs one-shot reads once, and keeps an LU_EV_ET
+ * event armed as a multishot poll that reports each new write once. */
+int test_io_uring(){
+    lu_event_config_t *cfg = lu_event_config_new();
+    lu_event_base_t *base;
+    int fds[2], efds[2];
+    int n_once = 0, n_et = 0;
+    lu_event_t *once, *et;
+    int ok;
+
+    if (cfg == NULL || pipe(fds) < 0 || pipe(efds) < 0)
+        return -1;
+    lu_event_config_avoid_method(cfg, "epoll");
+    base = lu_event_base_new_with_config(cfg);
+    lu_event_config_free(cfg);
+    if (base == NULL || strcmp(lu_event_base_get_method(base), "io_uring") != 0) {
+        printf("io_uring: not available, skipped\n");
+        if (base)
+            lu_event_base_free(base);
+        close(fds[0]);
+        close(fds[1]);
+        close(efds[0]);
+        close(efds[1]);
+        return 0;
+    }
+
+    once = lu_event_new(base, fds[0], LU_EV_READ, test_count_cb, &n_once);
+    et = lu_event_new(base, efds[0], LU_EV_READ|LU_EV_ET|LU_EV_PERSIST,
+        test_count_cb, &n_et);
+    lu_event_add(once, NULL);
+    lu_event_add(et, NULL);
+    write(fds[1], "x", 1);
+    write(efds[1], "x", 1);
+    lu_event_base_loop(base, LU_EVLOOP_ONCE);
+    /* Nothing was read, but there is no new edge either. */
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    write(efds[1], "x", 1);
+    lu_event_base_loop(base, LU_EVLOOP_ONCE);
+
+    ok = n_once == 1 && n_et == 2 &&
+        (lu_event_base_get_features(base) & LU_EVENT_FEATURE_ET);
+    printf("io_uring: %d one-shot, %d edge-triggered: %s\n", n_once, n_et,
+        ok ? "ok" : "FAILED");
+    lu_event_free(once);
+    lu_event_free(et);
+    lu_event_base_free(base);
+    close(fds[0]);
+    close(fds[1]);
+    close(efds[0]);
+    close(efds[1]);
+    return ok ? 0 : -1;
+}
+
+/* With LU_EVENT_BASE_FLAG_USE_SIGNALFD a signal event is read from the
+ * signalfd, once per delivery, and deleting it unblocks the signal. */
+int test_signalfd(){
+    lu_event_config_t *cfg = lu_event_config_new();
+    lu_event_base_t *base;
+    sigset_t mask;
+    int nsig = 0;
+    lu_event_t *ev;
+    int ok;
+
+    if (cfg == NULL)
+        return -1;
+    lu_event_config_set_flag(cfg, LU_EVENT_BASE_FLAG_USE_SIGNALFD);
+    base = lu_event_base_new_with_config(cfg);
+    lu_event_config_free(cfg);
+    if (base == NULL)
+        return -1;
+    if (strcmp(base->evsigsel_op->name, "signalfd") != 0) {
+        printf("signalfd: not available, skipped\n");
+        lu_event_base_free(base);
+        return 0;
+    }
+
+    ev = lu_evsignal_new(base, SIGUSR2, test_count_cb, &nsig);
+    lu_evsignal_add(ev, NULL);
+    raise(SIGUSR2);
+    lu_event_base_loop(base, LU_EVLOOP_ONCE);
+    raise(SIGUSR2);
+    lu_event_base_loop(base, LU_EVLOOP_ONCE);
+    lu_evsignal_del(ev);
+    pthread_sigmask(SIG_BLOCK, NULL, &mask);
+
+    ok = nsig == 2 && !sigismember(&mask, SIGUSR2);
+    printf("signalfd: %d signals, %s afterwards: %s\n", nsig,
+        sigismember(&mask, SIGUSR2) ? "blocked" : "unblocked", ok ? "ok" : "FAILED");
+    lu_event_free(ev);
+    lu_event_base_free(base);
+    return ok ? 0 : -1;
+}
+
+/* Average time, in microseconds, a 300us timer takes to fire on an epoll
+ * base with the given flags, or -1 on error. */
+static long test_timer_latency(int flags){
+    lu_event_config_t *cfg = lu_event_config_new();
+    struct timeval tv = {0, 300};
+    struct timespec start, end;
+    lu_event_base_t *base;
+    long total = 0;
+    int i, n = 0;
+    lu_event_t *ev;
+
+    if (cfg == NULL)
+        return -1;
+    /* io_uring waits with a timespec and never rounds. */
+    lu_event_config_avoid_method(cfg, "io_uring");
+    lu_event_config_set_flag(cfg, flags);
+    base = lu_event_base_new_with_config(cfg);
+    lu_event_config_free(cfg);
+    if (base == NULL)
+        return -1;
+    ev = lu_event_new(base, -1, 0, test_count_cb, &n);
+    for (i = 0; i < 100; ++i) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        lu_event_add(ev, &tv);
+        lu_event_base_dispatch(base);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        total += (end.tv_sec - start.tv_sec) * 1000000L +
+            (end.tv_nsec - start.tv_nsec) / 1000;
+    }
+    lu_event_free(ev);
+    lu_event_base_free(base);
+    return n == 100 ? total / 100 : -1;
+}
+
+/* With a precise timer, epoll waits on a timerfd and a sub-millisecond
+ * timeout is not rounded up to a whole millisecond. */
+int test_timerfd_precise(){
+    long precise = test_timer_latency(LU_EVENT_BASE_FLAG_PRECISE_TIMER);
+    long rounded = test_timer_latency(LU_EVENT_BASE_FLAG_PRECISE_TIMER |
+        LU_EVENT_BASE_FLAG_EPOLL_DISALLOW_TIMERFD);
+    int ok = precise > 0 && precise < 1000 && rounded >= 1000;
+
+    printf("timerfd: 300us timer fires after %ldus, %ldus without: %s\n",
+        precise, rounded, ok ? "ok" : "FAILED");
+    return ok ? 0 : -1;
+}
+
+/* With the changelist, adds and deletes on one fd between two dispatches
+ * are applied to epoll as a single change. */
+int test_changelist(){
+    lu_event_config_t *cfg = lu_event_config_new();
+    lu_event_base_stats_t before, after;
+    lu_event_base_t *base;
+    int fds[2];
+    int nread = 0, nwrite = 0;
+    lu_event_t *rev, *wev;
+    int i, round, ok;
+
+    if (cfg == NULL || pipe(fds) < 0)
+        return -1;
+    lu_event_config_avoid_method(cfg, "io_uring");
+    lu_event_config_set_flag(cfg, LU_EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+    base = lu_event_base_new_with_config(cfg);
+    lu_event_config_free(cfg);
+    if (base == NULL)
+        return -1;
+
+    rev = lu_event_new(base, fds[0], LU_EV_READ|LU_EV_PERSIST, test_count_cb, &nread);
+    wev = lu_event_new(base, fds[0], LU_EV_WRITE, test_count_cb, &nwrite);
+    lu_event_add(rev, NULL);
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    lu_event_base_get_stats(base, &before);
+    for (round = 0; round < 100; ++round) {
+        for (i = 0; i < 10; ++i) {
+            lu_event_add(wev, NULL);
+            lu_event_del(wev);
+        }
+        lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    }
+    lu_event_base_get_stats(base, &after);
+
+    ok = strcmp(lu_event_base_get_method(base), "epoll (with changelist)") == 0 &&
+        after.changelist_changes - before.changelist_changes <= 100 &&
+        nread == 0 && nwrite == 0;
+    printf("changelist: %llu changes for 2000 add/del in %llu flushes: %s\n",
+        (unsigned long long)(after.changelist_changes - before.changelist_changes),
+        (unsigned long long)(after.changelist_flushes - before.changelist_flushes),
+        ok ? "ok" : "FAILED");
+    lu_event_free(rev);
+    lu_event_free(wev);
+    lu_event_base_free(base);
+    close(fds[0]);
+    close(fds[1]);
+    return ok ? 0 : -1;
+}
+
+static int test_prio_log[32];
+static int test_prio_n;
+static lu_event_t *test_prio_late;
+
+static void test_prio_cb(lu_evutil_socket_t fd, short what, void *arg){
+    int pri = *(int *)arg;
+
+    (void)fd;
+    (void)what;
+    if (test_prio_n < 32)
+        test_prio_log[test_prio_n] = pri;
+    ++test_prio_n;
+    /* Made active in the middle of the round, above what is left. */
+    if (pri == 32)
+        lu_event_active(test_prio_late, LU_EV_TIMEOUT, 0);
+}
+
+/* Active events run in priority order, whatever order they were made
+ * active in, and one made active by a callback runs before the lower
+ * priorities still waiting. */
+int test_priorities(){
+    static int pris[16] = {63, 0, 40, 5, 63, 1, 32, 7, 0, 62, 17, 3, 33, 63, 2, 48};
+    static int late_pri = 4;
+    lu_event_base_t *base = lu_event_base_new();
+    lu_event_t *evs[16];
+    int i, ok;
+
+    if (base == NULL || lu_event_base_priority_init(base, 64) < 0)
+        return -1;
+    test_prio_n = 0;
+    for (i = 0; i < 16; ++i) {
+        evs[i] = lu_event_new(base, -1, 0, test_prio_cb, &pris[i]);
+        lu_event_priority_set(evs[i], pris[i]);
+    }
+    test_prio_late = lu_event_new(base, -1, 0, test_prio_cb, &late_pri);
+    lu_event_priority_set(test_prio_late, late_pri);
+    for (i = 0; i < 16; ++i)
+        lu_event_active(evs[i], LU_EV_TIMEOUT, 0);
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+
+    ok = test_prio_n == 17;
+    for (i = 1; ok && i < 17; ++i) {
+        if (test_prio_log[i] == late_pri)
+            ok = test_prio_log[i - 1] == 32 && test_prio_log[i + 1] >= 32;
+        else if (test_prio_log[i - 1] != late_pri)
+            ok = test_prio_log[i] >= test_prio_log[i - 1];
+    }
+    printf("priorities: %d callbacks, %d first, %d last: %s\n", test_prio_n,
+        test_prio_log[0], test_prio_log[16], ok ? "ok" : "FAILED");
+    for (i = 0; i < 16; ++i)
+        lu_event_free(evs[i]);
+    lu_event_free(test_prio_late);
+    lu_event_base_free(base);
+    return ok ? 0 : -1;
+}
+
+/* test_count_cb that takes about 300us. */
+static void test_slow_count_cb(lu_evutil_socket_t fd, short what, void *arg){
+    test_trace_busy_cb(fd, what, NULL);
+    ++*(int *)arg;
+}
+
+/* Makes 20 events with callback cb active on a base with the given
+ * dispatch bounds and runs them.  Returns how many ran, and the base's
+ * dispatch counters in *counters. */
+static int test_dispatch_bounds(const struct timeval *max_interval,
+    int max_callbacks, lu_event_callback_fn cb,
+    lu_event_dispatch_counters_t *counters){
+    lu_event_config_t *cfg = lu_event_config_new();
+    lu_event_base_t *base;
+    lu_event_t *evs[20];
+    int i, n = 0;
+
+    if (cfg == NULL)
+        return -1;
+    lu_event_config_set_max_dispatch_interval(cfg, max_interval, max_callbacks, 0);
+    base = lu_event_base_new_with_config(cfg);
+    lu_event_config_free(cfg);
+    if (base == NULL)
+        return -1;
+    for (i = 0; i < 20; ++i) {
+        evs[i] = lu_event_new(base, -1, 0, cb, &n);
+        lu_event_active(evs[i], LU_EV_TIMEOUT, 0);
+    }
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    lu_event_base_get_dispatch_counters(base, counters);
+    for (i = 0; i < 20; ++i)
+        lu_event_free(evs[i]);
+    lu_event_base_free(base);
+    return n;
+}
+
+/* A round of callbacks stops after max_callbacks of them, or once
+ * max_interval has elapsed, and the rest run in the following rounds. */
+int test_dispatch_limits(){
+    struct timeval interval = {0, 1000};
+    lu_event_dispatch_counters_t by_count, by_time;
+    int n_count, n_time, ok;
+
+    n_count = test_dispatch_bounds(NULL, 5, test_count_cb, &by_count);
+    n_time = test_dispatch_bounds(&interval, -1, test_slow_count_cb, &by_time);
+
+    ok = n_count == 20 && by_count.max_callbacks_hit >= 3 &&
+        by_count.max_interval_hit == 0 &&
+        n_time == 20 && by_time.max_interval_hit >= 2 &&
+        by_time.max_callbacks_hit == 0;
+    printf("dispatch limits: %llu rounds cut by count, %llu by time: %s\n",
+        (unsigned long long)by_count.max_callbacks_hit,
+        (unsigned long long)by_time.max_interval_hit, ok ? "ok" : "FAILED");
+    return ok ? 0 : -1;
+}
+
+/* lu_evutil_read_drain() and lu_evutil_write_drain() say whether the edge
+ * was consumed, and an LU_EV_ET event on epoll is reported once per edge. */
+int test_edge_drain(){
+    static char big[1 << 20];
+    lu_event_base_t *base = lu_event_base_new();
+    char buf[256];
+    size_t n_small, n_partial, n_eof, n_pending, n_blocked;
+    int r_small, r_partial, r_eof, r_pending, r_blocked, r_bad;
+    int fds[2];
+    int n_et = 0;
+    lu_event_t *ev;
+    int ok;
+
+    if (base == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return -1;
+    lu_evutil_make_socket_nonblocking(fds[0]);
+    lu_evutil_make_socket_nonblocking(fds[1]);
+
+    ev = lu_event_new(base, fds[0], LU_EV_READ|LU_EV_ET|LU_EV_PERSIST,
+        test_count_cb, &n_et);
+    lu_event_add(ev, NULL);
+    write(fds[1], "0123456789", 10);
+    lu_event_base_loop(base, LU_EVLOOP_ONCE);
+    /* The data is still there, but there is no new edge. */
+    lu_event_base_loop(base, LU_EVLOOP_NONBLOCK);
+    r_small = lu_evutil_read_drain(fds[0], buf, sizeof(buf), &n_small);
+    lu_event_free(ev);
+
+    write(fds[1], big, 100);
+    r_partial = lu_evutil_read_drain(fds[0], buf, 16, &n_partial);
+    close(fds[1]);
+    r_eof = lu_evutil_read_drain(fds[0], buf, sizeof(buf), &n_eof);
+    close(fds[0]);
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    lu_evutil_make_socket_nonblocking(fds[0]);
+    r_pending = lu_evutil_write_drain(fds[0], big, 10, &n_pending);
+    r_blocked = lu_evutil_write_drain(fds[0], big, sizeof(big), &n_blocked);
+    r_bad = lu_evutil_read_drain(-1, buf, sizeof(buf), &n_eof);
+
+    ok = n_et == 1 &&
+        r_small == LU_EVUTIL_EDGE_CONSUMED && n_small == 10 &&
+        r_partial == LU_EVUTIL_EDGE_PENDING && n_partial == 16 &&
+        r_eof == LU_EVUTIL_EDGE_EOF &&
+        r_pending == LU_EVUTIL_EDGE_PENDING && n_pending == 10 &&
+        r_blocked == LU_EVUTIL_EDGE_CONSUMED && n_blocked < sizeof(big) &&
+        r_bad == -1;
+    printf("edge drain: %d ET callback, read %d/%d/%d, write %d/%d: %s\n",
+        n_et, r_small, r_partial, r_eof, r_pending, r_blocked,
+        ok ? "ok" : "FAILED");
+    lu_event_base_free(base);
+    close(fds[0]);
+    close(fds[1]);
+    return ok ? 0 : -1;
+}
+
+typedef struct test_accept_s {
+    int naccepted;
+    int listen_fd;
+    int nfds;
+} test_accept_t;
+
+static void test_accept_cb(lu_evutil_socket_t fd, short what, void *arg){
+    test_accept_t *t = arg;
+    int expected = -1;
+    int c;
+
+    (void)what;
+    if (!__atomic_compare_exchange_n(&t->listen_fd, &expected, fd, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED) && expected != fd)
+        __atomic_store_n(&t->nfds, 2, __ATOMIC_RELAXED);
+    /* Another base may have been woken for the same connection. */
+    while ((c = accept(fd, NULL, NULL)) >= 0) {
+        close(c);
+        __atomic_add_fetch(&t->naccepted, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* With LU_EVENT_POOL_LISTEN_EXCLUSIVE every base watches one shared
+ * listening socket, and every connection is accepted exactly once. */
+int test_pool_listen_exclusive(){
+    lu_event_config_t *cfg = lu_event_config_new();
+    test_accept_t t = {0, -1, 1};
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    lu_event_pool_t *pool;
+    int clients[40];
+    int i, probe, ok;
+
+    if (cfg == NULL)
+        return -1;
+    lu_event_config_set_num_cpus_hint(cfg, 4);
+    pool = lu_event_pool_new(cfg, LU_EVENT_POOL_LISTEN_EXCLUSIVE);
+    lu_event_config_free(cfg);
+    if (pool == NULL)
+        return -1;
+    if (!(lu_event_base_get_features(lu_event_pool_get_base(pool, 0)) &
+        LU_EVENT_FEATURE_EXCLUSIVE)) {
+        printf("pool exclusive listen: not available, skipped\n");
+        lu_event_pool_free(pool);
+        return 0;
+    }
+
+    /* Find a free port: lu_event_pool_listen() doesn't say which port 0
+     * turned into. */
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    probe = socket(AF_INET, SOCK_STREAM, 0);
+    bind(probe, (struct sockaddr *)&sin, sizeof(sin));
+    getsockname(probe, (struct sockaddr *)&sin, &len);
+    close(probe);
+
+    if (lu_event_pool_listen(pool, (struct sockaddr *)&sin, sizeof(sin), 64,
+        test_accept_cb, &t) < 0 || lu_event_pool_start(pool) < 0) {
+        lu_event_pool_free(pool);
+        return -1;
+    }
+    for (i = 0; i < 40; ++i) {
+        clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+        connect(clients[i], (struct sockaddr *)&sin, sizeof(sin));
+    }
+    for (i = 0; i < 300 && __atomic_load_n(&t.naccepted, __ATOMIC_RELAXED) < 40; ++i)
+        usleep(10000);
+    lu_event_pool_stop(pool);
+
+    ok = t.naccepted == 40 && t.nfds == 1;
+    printf("pool exclusive listen: %d of 40 accepted, %s socket: %s\n",
+        t.naccepted, t.nfds == 1 ? "one shared" : "more than one",
+        ok ? "ok" : "FAILED");
+    for (i = 0; i < 40; ++i)
+        close(clients[i]);
+    lu_event_pool_free(pool);
+    return ok ? 0 : -1;
+}
+
+typedef struct test_late_write_s {
+    int fd;
+    useconds_t delay;
+} test_late_write_t;
+
+static void *test_late_write(void *arg){
+    test_late_write_t *w = arg;
+
+    usleep(w->delay);
+    write(w->fd, "x", 1);
+    return NULL;
+}
+
+/* Waits on a pipe written 'delay' microseconds from now by another
+ * thread, on a base that busy-polls for 'budget'.  Returns the base's
+ * dispatch counters in *counters and the number of reads. */
+static int test_busy_poll_wait(const struct timeval *budget, useconds_t delay,
+    lu_event_dispatch_counters_t *counters){
+    lu_event_config_t *cfg = lu_event_config_new();
+    lu_event_base_t *base;
+    test_late_write_t w;
+    pthread_t thread;
+    int fds[2];
+    int n = 0;
+    lu_event_t *ev;
+
+    if (cfg == NULL || pipe(fds) < 0)
+        return -1;
+    lu_event_config_set_busy_poll(cfg, budget, 0);
+    base = lu_event_base_new_with_config(cfg);
+    lu_event_config_free(cfg);
+    if (base == NULL)
+        return -1;
+    ev = lu_event_new(base, fds[0], LU_EV_READ, test_count_cb, &n);
+    lu_event_add(ev, NULL);
+    w.fd = fds[1];
+    w.delay = delay;
+    pthread_create(&thread, NULL, test_late_write, &w);
+    lu_event_base_dispatch(base);
+    pthread_join(thread, NULL);
+    lu_event_base_get_dispatch_counters(base, counters);
+    lu_event_free(ev);
+    lu_event_base_free(base);
+    close(fds[0]);
+    close(fds[1]);
+    return n;
+}
+
+/* A busy-polling base picks up an event that arrives within its budget
+ * while spinning, sleeps once the budget is spent, and never spins past
+ * its next timer. */
+int test_busy_poll(){
+    struct timeval long_budget = {0, 200000}, short_budget = {0, 100};
+    struct timeval tv = {0, 2000};
+    struct timespec start, end;
+    lu_event_dispatch_counters_t spun, slept;
+    lu_event_config_t *cfg;
+    lu_event_base_t *base;
+    int n_spun, n_slept, n_timer = 0;
+    long timer_usec;
+    lu_event_t *ev;
+    int ok;
+
+    n_spun = test_busy_poll_wait(&long_budget, 1000, &spun);
+    n_slept = test_busy_poll_wait(&short_budget, 20000, &slept);
+
+    if ((cfg = lu_event_config_new()) == NULL)
+        return -1;
+    lu_event_config_set_busy_poll(cfg, &long_budget, 0);
+    base = lu_event_base_new_with_config(cfg);
+    lu_event_config_free(cfg);
+    if (base == NULL)
+        return -1;
+    ev = lu_event_new(base, -1, 0, test_count_cb, &n_timer);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lu_event_add(ev, &tv);
+    lu_event_base_dispatch(base);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    timer_usec = (end.tv_sec - start.tv_sec) * 1000000L +
+        (end.tv_nsec - start.tv_nsec) / 1000;
+    lu_event_free(ev);
+    lu_event_base_free(base);
+
+    ok = n_spun == 1 && spun.busy_poll_hits == 1 && spun.busy_poll_sleeps == 0 &&
+        n_slept == 1 && slept.busy_poll_sleeps >= 1 &&
+        n_timer == 1 && timer_usec < 20000;
+    printf("busy poll: %llu hits, %llu sleeps, 2ms timer took %ldus: %s\n",
+        (unsigned long long)spun.busy_poll_hits,
+        (unsigned long long)slept.busy_poll_sleeps, timer_usec,
+        ok ? "ok" : "FAILED");
+    return ok ? 0 : -1;
+}
+
+/* Runs one round of the loop without blocking 'rounds' times and returns
+ * the size of the backend's result array afterwards. */
+static int test_backend_nevents_after(lu_event_base_t *base, int rounds){
+    lu_event_dispatch_counters_t counters;
+    int i;
+
+    for (i = 0; i < rounds; ++i)
+        lu_event_base_loop(base, LU_EVLOOP_ONCE|LU_EVLOOP_NONBLOCK);
+    lu_event_base_get_dispatch_counters(base, &counters);
+    return counters.backend_nevents;
+}
+
+/* epoll's result array grows when a wait fills it, is left alone by
+ * empty waits, and shrinks back after a long run of waits that use
+ * little of it. */
+int test_epoll_shrink(){
+    lu_event_config_t *cfg = lu_event_config_new();
+    lu_event_base_t *base;
+    int fds[100][2];
+    lu_event_t *evs[100];
+    int n = 0;
+    int initial, grown, idle, shrunk;
+    char c;
+    int i, ok;
+
+    if (cfg == NULL)
+        return -1;
+    lu_event_config_avoid_method(cfg, "io_uring");
+    base = lu_event_base_new_with_config(cfg);
+    lu_event_config_free(cfg);
+    if (base == NULL)
+        return -1;
+    for (i = 0; i < 100; ++i) {
+        if (pipe(fds[i]) < 0)
+            return -1;
+        evs[i] = lu_event_new(base, fds[i][0], LU_EV_READ|LU_EV_PERSIST,
+            test_count_cb, &n);
+        lu_event_add(evs[i], NULL);
+    }
+
+    initial = test_backend_nevents_after(base, 0);
+    for (i = 0; i < 100; ++i)
+        write(fds[i][1], "x", 1);
+    grown = test_backend_nevents_after(base, 4);
+    /* Nothing is ready: empty waits don't count as underuse. */
+    for (i = 0; i < 100; ++i)
+        read(fds[i][0], &c, 1);
+    idle = test_backend_nevents_after(base, 128 * 3);
+    /* One fd stays ready, far fewer than the array holds. */
+    write(fds[0][1], "x", 1);
+    shrunk = test_backend_nevents_after(base, 128 * 3);
+
+    ok = grown >= 4 * initial && idle == grown && shrunk == initial;
+    printf("epoll shrink: result array %d, grew to %d, %d when idle, shrank back to %d: %s\n",
+        initial, grown, idle, shrunk, ok ? "ok" : "FAILED");
+    for (i = 0; i < 100; ++i) {
+        lu_event_free(evs[i]);
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    lu_event_base_free(base);
+    return ok ? 0 : -1;
+}
+
+/* lu_event_new() reuses freed events from the base's slab: churn within
+ * the reserved count never grows it, and a freed event is handed out
+ * again right away. */
+int test_slab_reuse(){
+    lu_event_config_t *cfg = lu_event_config_new();
+    lu_event_base_t *base;
+    lu_event_t *evs[1000], *first, *again;
+    size_t reserved;
+    int i, round, n = 0;
+    int ok;
+
+    if (cfg == NULL)
+        return -1;
+    lu_event_config_reserve_events(cfg, 1000, 0);
+    base = lu_event_base_new_with_config(cfg);
+    lu_event_config_free(cfg);
+    if (base == NULL)
+        return -1;
+    reserved = base->event_slab.nobjs;
+
+    for (round = 0; round < 100; ++round) {
+        for (i = 0; i < 1000; ++i)
+            evs[i] = lu_event_new(base, -1, 0, test_count_cb, &n);
+        for (i = 0; i < 1000; ++i)
+            lu_event_free(evs[i]);
+    }
+    first = lu_event_new(base, -1, 0, test_count_cb, &n);
+    lu_event_free(first);
+    again = lu_event_new(base, -1, 0, test_count_cb, &n);
+
+    ok = reserved >= 1000 && base->event_slab.nobjs == reserved &&
+        again == first && base->event_slab.nfree == reserved - 1;
+    printf("slab reuse: %zu events reserved, %zu after churn: %s\n",
+        reserved, base->event_slab.nobjs, ok ? "ok" : "FAILED");
+    lu_event_free(again);
+    lu_event_base_free(base);
+    return ok ? 0 : -1;
+}
+
 int main(){
     //test_hash();
     //test_error_to_string();
-    return 0;
+    int failed = 0;
+
+    failed += test_epoll_pipe() != 0;
+    failed += test_timer_heap() != 0;
+    failed += test_common_timeout() != 0;
+    failed += test_active_async_cancel() != 0;
+    failed += test_pool_start_stop() != 0;
+    failed += test_callback_trace() != 0;
+    failed += test_offload() != 0;
+    failed += test_once() != 0;
+    failed += test_watchers() != 0;
+    failed += test_stats() != 0;
+    failed += test_reinit_after_fork() != 0;
+    failed += test_io_uring() != 0;
+    failed += test_signalfd() != 0;
+    failed += test_timerfd_precise() != 0;
+    failed += test_changelist() != 0;
+    failed += test_priorities() != 0;
+    failed += test_dispatch_limits() != 0;
+    failed += test_edge_drain() != 0;
+    failed += test_pool_listen_exclusive() != 0;
+    failed += test_busy_poll() != 0;
+    failed += test_epoll_shrink() != 0;
+    failed += test_slab_reuse() != 0;
+    return failed;
 }
\ No newline at end of file